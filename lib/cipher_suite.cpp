@@ -0,0 +1,91 @@
+/*
+ * Cipher suites and key derivation functions for SQLite3 encryption codec.
+ * (C) 2010 Olivier de Gaalon
+ * (C) 2016 Archibald Neil MacDonald
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#include "cipher_suite.h"
+
+#include "crypto_backend.h"
+
+namespace
+{
+    const CipherSuite CIPHER_SUITES[] =
+    {
+        //512 bit, 64 byte key (256 bit XTS key), 256 bit CMAC key
+        { CIPHER_SUITE_TWOFISH_XTS, "twofish-xts", "Twofish/XTS", 512/8,
+          "CMAC(Twofish)", 256/8 },
+
+        //Crypto backends pick the AES implementation at runtime from CPUID
+        //(AES-NI, VAES, ARMv8 or portable code), so one suite covers them all
+        { CIPHER_SUITE_AES_XTS, "aes-xts", "AES-256/XTS", 512/8,
+          "CMAC(AES-256)", 256/8 },
+    };
+
+    const KdfAlgorithm KDF_ALGORITHMS[] =
+    {
+        { KDF_PBKDF2_SHA256, "pbkdf2-sha256", "PBKDF2(SHA-256)", "HMAC(SHA-256)",
+          DEFAULT_KDF_ITERATIONS, 0, 0 },
+
+        //RFC 9106, second recommended option: 3 passes over 64 MiB, 4 lanes
+        { KDF_ARGON2ID, "argon2id", "Argon2id", "", 3, 64 * 1024, 4 },
+    };
+}
+
+const CipherSuite* findCipherSuite(uint8_t id)
+{
+    for (const CipherSuite& suite : CIPHER_SUITES)
+    {
+        if (suite.id == id)
+        {
+            return &suite;
+        }
+    }
+    return nullptr;
+}
+
+const CipherSuite* findCipherSuite(const string& name)
+{
+    if ("auto" == name)
+    {
+        const CipherSuite* twofish = findCipherSuite(CIPHER_SUITE_TWOFISH_XTS);
+        return findCipherSuite(CryptoBackend::hasHardwareAes() ||
+                               !CryptoBackend::supports(*twofish) ?
+                               CIPHER_SUITE_AES_XTS : CIPHER_SUITE_TWOFISH_XTS);
+    }
+
+    for (const CipherSuite& suite : CIPHER_SUITES)
+    {
+        if (suite.name == name)
+        {
+            return &suite;
+        }
+    }
+    return nullptr;
+}
+
+const KdfAlgorithm* findKdf(uint8_t id)
+{
+    for (const KdfAlgorithm& kdf : KDF_ALGORITHMS)
+    {
+        if (kdf.id == id)
+        {
+            return &kdf;
+        }
+    }
+    return nullptr;
+}
+
+const KdfAlgorithm* findKdf(const string& name)
+{
+    for (const KdfAlgorithm& kdf : KDF_ALGORITHMS)
+    {
+        if (kdf.name == name)
+        {
+            return &kdf;
+        }
+    }
+    return nullptr;
+}
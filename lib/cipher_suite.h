@@ -0,0 +1,119 @@
+/*
+ * Cipher suites and key derivation functions for SQLite3 encryption codec.
+ * (C) 2010 Olivier de Gaalon
+ * (C) 2016 Archibald Neil MacDonald
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#ifndef CIPHER_SUITE_H_
+#define CIPHER_SUITE_H_
+
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+/*Suite and KDF ids are written to the codec header of each database, so
+ *existing entries must never be renumbered or have their parameters
+ *changed. Add new entries with new ids instead.*/
+
+struct CipherSuite
+{
+    //id: Stored in the codec header to identify the suite
+    uint8_t id;
+
+    //name: Used to select the suite with the "cipher" codec parameter
+    string name;
+
+    //cipher: Cipher and mode used for encrypting the database, as named by
+    //Botan. Other backends map suites by id.
+    //make sure to add "/NoPadding" for modes that use padding schemes
+    string cipher;
+
+    //keySize: Size of the encryption key. Note that XTS splits the key
+    //between two ciphers, so if you're using XTS, double the intended key
+    //size. (ie, "AES-128/XTS" should have a 256 bit keySize)
+    size_t keySize;
+
+    //mac: CMAC used to derive the IV that is used for db page encryption
+    string mac;
+
+    //ivKeySize: Size of the key used with the CMAC (mac) above.
+    size_t ivKeySize;
+};
+
+struct KdfAlgorithm
+{
+    //id: Stored in the codec header to identify the KDF
+    uint8_t id;
+
+    //name: Used to select the KDF with the "kdf" codec parameter
+    string name;
+
+    //pbkdf: Key derivation function used to derive both the encryption
+    //and IV derivation keys from the given database passphrase
+    string pbkdf;
+
+    //prf: Pseudorandom function of the KDF, for deriving its output blocks
+    //separately, empty if they are not independent
+    string prf;
+
+    //iterations, memory, lanes: Cost of a database created with the KDF,
+    //unless set with the codec parameters. Memory (KiB) and lanes are 0 for
+    //KDFs that are not memory hard.
+    uint32_t iterations;
+    uint32_t memory;
+    uint8_t lanes;
+
+    bool isMemoryHard() const { return 0 != memory; }
+};
+
+/**
+* Cost of a KDF run. Iterations are passes over the memory for memory hard
+* KDFs, which also take their memory in KiB and number of lanes, computed
+* in parallel.
+*/
+struct KdfCost
+{
+    explicit KdfCost(uint32_t iterations, uint32_t memory = 0, uint8_t lanes = 0) :
+        iterations(iterations), memory(memory), lanes(lanes)
+    { }
+
+    uint32_t iterations;
+    uint32_t memory;
+    uint8_t lanes;
+};
+
+const uint8_t CIPHER_SUITE_TWOFISH_XTS = 1;
+const uint8_t CIPHER_SUITE_AES_XTS = 2;
+
+const uint8_t KDF_PBKDF2_SHA256 = 1;
+const uint8_t KDF_ARGON2ID = 2;
+
+//Suite used by databases without a codec header, and by default for new
+//databases.
+const uint8_t DEFAULT_CIPHER_SUITE = CIPHER_SUITE_TWOFISH_XTS;
+const uint8_t DEFAULT_KDF = KDF_PBKDF2_SHA256;
+
+//DEFAULT_KDF_ITERATIONS: Number of hash iterations used in the key
+//derivation process, unless the database header says otherwise.
+const uint32_t DEFAULT_KDF_ITERATIONS = 10000;
+
+//LEGACY_SALT_STR: Hard coded salt used to derive the key from the
+//passphrase for databases that have no room for a salt of their own.
+const string LEGACY_SALT_STR = "&g#nB'9]";
+
+const CipherSuite* findCipherSuite(uint8_t id);
+
+/**
+* Find a suite by name. "auto" picks the suite that is fastest on this CPU:
+* AES-XTS when the CPU has AES instructions or the crypto backend has no
+* Twofish, Twofish-XTS otherwise.
+*/
+const CipherSuite* findCipherSuite(const string& name);
+
+const KdfAlgorithm* findKdf(uint8_t id);
+const KdfAlgorithm* findKdf(const string& name);
+
+#endif
@@ -8,43 +8,132 @@
 
 #include "codec.h"
 
-#include <botan/init.h>
-#include <botan/lookup.h>
-#include <botan/pbkdf.h>
+#include "kdf_cache.h"
+#include "pbkdf2.h"
 
-Codec::Codec(void *db) :
-    Codec(db, false, false, SymmetricKey(), SymmetricKey(), SymmetricKey(), SymmetricKey())
-{ }
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 
-//Only used to copy main db key for an attached db
-Codec::Codec(const Codec* other, void *db) :
-    Codec(db, other->m_hasReadKey, other->m_hasWriteKey, other->m_readKey, other->m_writeKey,
-          other->m_ivReadKey, other->m_ivWriteKey)
-{ }
+namespace
+{
+    int hexValue(char c)
+    {
+        if (c >= '0' && c <= '9')
+        {
+            return c - '0';
+        }
+        if (c >= 'a' && c <= 'f')
+        {
+            return c - 'a' + 10;
+        }
+        if (c >= 'A' && c <= 'F')
+        {
+            return c - 'A' + 10;
+        }
+        return -1;
+    }
+}
+
+bool parseRawKey(const char* key, int length, SecureBytes& rawKey)
+{
+    // x'<hex>', like an SQL blob literal
+    const int hexLength = length - 3;
+    if (hexLength < (int) (2 * CODEC_MIN_RAW_KEY_SIZE) || 0 != hexLength % 2 ||
+        ('x' != key[0] && 'X' != key[0]) || '\'' != key[1] ||
+        '\'' != key[length - 1])
+    {
+        return false;
+    }
 
-Codec::Codec(void* db, bool hasReadKey, bool hasWriteKey, SymmetricKey readKey, SymmetricKey writeKey,
-             SymmetricKey ivReadKey, SymmetricKey ivWriteKey) :
-    m_hasReadKey(hasReadKey),
-    m_hasWriteKey(hasWriteKey),
+    rawKey.resize(hexLength / 2);
+    for (int i = 0; i < hexLength / 2; ++i)
+    {
+        const int high = hexValue(key[2 + 2 * i]);
+        const int low = hexValue(key[3 + 2 * i]);
+        if (high < 0 || low < 0)
+        {
+            rawKey.clear();
+            return false;
+        }
+        rawKey[i] = (uint8_t) ((high << 4) | low);
+    }
+    return true;
+}
+
+Codec::Codec(void *db) :
+    m_hasReadKey(false),
+    m_hasWriteKey(false),
+    m_keyFailed(false),
     m_db(db),
 
     m_page(nullptr),
     m_pageSize(0),
 
-    m_readKey(readKey),
-    m_writeKey(writeKey),
-    m_ivReadKey(ivReadKey),
-    m_ivWriteKey(ivWriteKey),
+    m_suite(nullptr),
+    m_kdf(nullptr),
+    m_kdfIterations(0),
+    m_kdfTime(0),
+    m_kdfMemory(0),
+    m_kdfLanes(0),
+    m_format(CODEC_FORMAT_LEGACY),
+    m_rekeyThreads(1),
+    m_keySlots(0),
+    m_rawKey(false),
+
+    m_keySlot(-1),
 
-    m_encipherFilter(get_cipher(BLOCK_CIPHER_STR, ENCRYPTION)),
-    m_encipherPipe(m_encipherFilter),
+    m_pendingKeyCheck(0),
 
-    m_decipherFilter(get_cipher(BLOCK_CIPHER_STR, DECRYPTION)),
-    m_decipherPipe(m_decipherFilter),
-    m_cmac(new MAC_Filter(MAC_STR)),
-    m_macPipe(m_cmac)
+    m_sweepPage(1),
+
+    m_preparedFirst(0),
+    m_preparedCount(0)
 { }
 
+//Only used to copy main db key for an attached db. Callers check
+//hasReadKey first, so any asynchronous derivation is done.
+Codec::Codec(const Codec* other, void *db) :
+    Codec(db)
+{
+    m_hasReadKey = other->m_hasReadKey;
+    m_hasWriteKey = other->m_hasWriteKey;
+
+    m_header = other->m_header;
+    m_suite = other->m_suite;
+    m_kdf = other->m_kdf;
+    m_kdfIterations = other->m_kdfIterations;
+    m_kdfTime = other->m_kdfTime;
+    m_kdfMemory = other->m_kdfMemory;
+    m_kdfLanes = other->m_kdfLanes;
+    m_format = other->m_format;
+    m_rekeyThreads = other->m_rekeyThreads;
+    m_keySlots = other->m_keySlots;
+    m_rawKey = other->m_rawKey;
+
+    m_dataKey = other->m_dataKey;
+    m_keySlot = other->m_keySlot;
+
+    // Cipher objects carry per-message state, so the attached db gets its own
+    if (other->m_writeCipher)
+    {
+        m_writeCipher = std::make_shared<PageCipher>(other->m_writeCipher->header(),
+                                                     other->m_writeCipher->key(),
+                                                     other->m_writeCipher->ivKey());
+    }
+
+    if (other->m_readCipher == other->m_writeCipher)
+    {
+        m_readCipher = m_writeCipher;
+    }
+    else if (other->m_readCipher)
+    {
+        m_readCipher = std::make_shared<PageCipher>(other->m_readCipher->header(),
+                                                    other->m_readCipher->key(),
+                                                    other->m_readCipher->ivKey());
+    }
+}
+
 void Codec::setPageSize(int pageSize)
 {
     // Delete old memory. Replace with new memory.
@@ -52,75 +141,1157 @@ void Codec::setPageSize(int pageSize)
     m_pageSize = pageSize;
 }
 
-void Codec::generateWriteKey(const char* userPassword, int passwordLength)
+bool Codec::setParameter(const string& name, const string& value)
+{
+    if ("cipher" == name)
+    {
+        const CipherSuite* suite = findCipherSuite(value);
+        if (nullptr == suite || !CryptoBackend::supports(*suite))
+        {
+            return false;
+        }
+        m_suite = suite;
+        return true;
+    }
+    else if ("kdf" == name)
+    {
+        const KdfAlgorithm* kdf = findKdf(value);
+        if (nullptr == kdf || !CryptoBackend::supports(*kdf))
+        {
+            return false;
+        }
+        m_kdf = kdf;
+        return true;
+    }
+    else if ("kdf_iter" == name)
+    {
+        char* end = nullptr;
+        unsigned long iterations = strtoul(value.c_str(), &end, 10);
+        if (value.empty() || '\0' != *end || 0 == iterations ||
+            iterations > 0xFFFFFFFFUL)
+        {
+            return false;
+        }
+        m_kdfIterations = (uint32_t) iterations;
+        m_kdfTime = 0;
+        return true;
+    }
+    else if ("kdf_time" == name)
+    {
+        char* end = nullptr;
+        unsigned long milliseconds = strtoul(value.c_str(), &end, 10);
+        if (value.empty() || '\0' != *end || 0 == milliseconds ||
+            milliseconds > KDF_MAX_CALIBRATION_TIME)
+        {
+            return false;
+        }
+        m_kdfTime = (uint32_t) milliseconds;
+        m_kdfIterations = 0;
+        return true;
+    }
+    else if ("kdf_memory" == name)
+    {
+        char* end = nullptr;
+        unsigned long memory = strtoul(value.c_str(), &end, 10);
+        if (value.empty() || '\0' != *end || memory < 8 ||
+            memory > CODEC_MAX_KDF_MEMORY)
+        {
+            return false;
+        }
+        m_kdfMemory = (uint32_t) memory;
+        return true;
+    }
+    else if ("kdf_lanes" == name)
+    {
+        char* end = nullptr;
+        unsigned long lanes = strtoul(value.c_str(), &end, 10);
+        if (value.empty() || '\0' != *end || 0 == lanes || lanes > 255)
+        {
+            return false;
+        }
+        m_kdfLanes = (uint32_t) lanes;
+        return true;
+    }
+    else if ("format" == name)
+    {
+        if ("1" == value)
+        {
+            m_format = CODEC_FORMAT_V1;
+            return true;
+        }
+        else if ("2" == value)
+        {
+            m_format = CODEC_FORMAT_V2;
+            return true;
+        }
+        return false;
+    }
+    else if ("rekey_threads" == name)
+    {
+        if ("auto" == value)
+        {
+            // hardware_concurrency may not know, and then says 0
+            const unsigned int cores = std::thread::hardware_concurrency();
+            m_rekeyThreads = std::max(1u, std::min(cores, CODEC_MAX_REKEY_THREADS));
+            return true;
+        }
+
+        char* end = nullptr;
+        unsigned long threads = strtoul(value.c_str(), &end, 10);
+        if (value.empty() || '\0' != *end || 0 == threads ||
+            threads > CODEC_MAX_REKEY_THREADS)
+        {
+            return false;
+        }
+        m_rekeyThreads = (uint32_t) threads;
+        return true;
+    }
+    else if ("key_slots" == name)
+    {
+        char* end = nullptr;
+        unsigned long slots = strtoul(value.c_str(), &end, 10);
+        if (value.empty() || '\0' != *end || slots > CODEC_MAX_KEY_SLOTS)
+        {
+            return false;
+        }
+        m_keySlots = (uint32_t) slots;
+        return true;
+    }
+    else if ("raw_key" == name)
+    {
+        if ("0" != value && "1" != value)
+        {
+            return false;
+        }
+        m_rawKey = "1" == value;
+        return true;
+    }
+
+    return false;
+}
+
+bool Codec::readHeader(const unsigned char* data, size_t length)
+{
+    CodecHeader header;
+    if (!header.read(data, length))
+    {
+        m_header = CodecHeader();
+        return false;
+    }
+
+    m_header = header;
+    return true;
+}
+
+bool Codec::headerExtension(size_t& offset, size_t& length) const
+{
+    if (!m_header.hasExtension())
+    {
+        return false;
+    }
+
+    offset = m_header.pageSize - m_header.reserve;
+    length = m_header.reserve;
+    return true;
+}
+
+bool Codec::readHeaderExtension(const unsigned char* data, size_t length)
+{
+    return m_header.readExtension(data, length);
+}
+
+int Codec::createHeader(bool withExtension)
+{
+    m_header = CodecHeader();
+    m_header.version = CODEC_FORMAT_V1;
+
+    // Backends without the default suite get the first one they have
+    if (!CryptoBackend::supports(*findCipherSuite(m_header.suite)))
+    {
+        m_header.suite = findCipherSuite("auto")->id;
+    }
+
+    if (withExtension)
+    {
+        m_header.reserve = CODEC_HEADER_EXT_SIZE;
+        m_header.salt.resize(CODEC_SALT_SIZE);
+        CryptoBackend::randomize(m_header.salt.data(), m_header.salt.size());
+
+        // Empty slots, the first key sets up the data key
+        if (0 != m_keySlots)
+        {
+            m_header.flags |= CODEC_FLAG_ENVELOPE;
+            m_header.reserve += m_keySlots * CODEC_KEY_SLOT_SIZE;
+            m_header.keySlots.assign(m_keySlots * CODEC_KEY_SLOT_SIZE, 0);
+        }
+    }
+
+    // After the extension, which memory hard KDFs depend on
+    applySettings(m_header);
+
+    return m_header.reserve;
+}
+
+bool Codec::keyMatchesHeader() const
+{
+    if (!m_hasReadKey)
+    {
+        return false;
+    }
+
+    const CodecHeader& keyHeader = m_readCipher->header();
+    return keyHeader.version == m_header.version &&
+           keyHeader.suite == m_header.suite &&
+           keyHeader.kdf == m_header.kdf &&
+           keyHeader.flags == m_header.flags &&
+           keyHeader.reserve == m_header.reserve &&
+           keyHeader.kdfIterations == m_header.kdfIterations &&
+           keyHeader.kdfMemory == m_header.kdfMemory &&
+           keyHeader.kdfLanes == m_header.kdfLanes &&
+           keyHeader.salt == m_header.salt;
+}
+
+bool Codec::isWrongKey() const
+{
+    // A finished rotation leaves the watermark behind, page 1 has the new
+    // key then like every other page
+    if (!m_hasWriteKey || !m_header.hasExtension() || 0 == m_header.page1Tag ||
+        rekeyInProgress())
+    {
+        return false;
+    }
+
+    return m_writeCipher->keyCheck() != m_header.page1Tag;
+}
+
+string Codec::cipherName() const
+{
+    if (!m_hasWriteKey)
+    {
+        return string();
+    }
+
+    return findCipherSuite(m_writeCipher->header().suite)->name + " (" +
+           m_writeCipher->provider() + ")";
+}
+
+uint64_t Codec::ivCacheHits() const
 {
-    std::unique_ptr<PBKDF> pbkdf(Botan::PBKDF::create(PBKDF_STR));
+    uint64_t hits = m_readCipher ? m_readCipher->ivCacheHits() : 0;
+    if (m_writeCipher && m_writeCipher != m_readCipher)
+    {
+        hits += m_writeCipher->ivCacheHits();
+    }
+    return hits;
+}
+
+uint64_t Codec::ivCacheMisses() const
+{
+    uint64_t misses = m_readCipher ? m_readCipher->ivCacheMisses() : 0;
+    if (m_writeCipher && m_writeCipher != m_readCipher)
+    {
+        misses += m_writeCipher->ivCacheMisses();
+    }
+    return misses;
+}
+
+void Codec::resetStats()
+{
+    if (m_readCipher)
+    {
+        m_readCipher->resetStats();
+    }
+    if (m_writeCipher)
+    {
+        m_writeCipher->resetStats();
+    }
+}
+
+int Codec::reserve() const
+{
+    return m_hasReadKey ? m_readCipher->header().reserve : m_header.reserve;
+}
+
+int Codec::headerPageSize() const
+{
+    return m_header.hasHeader() ? (int) m_header.pageSize : 0;
+}
+
+void Codec::applySettings(CodecHeader& header) const
+{
+    if (nullptr != m_suite)
+    {
+        header.suite = m_suite->id;
+    }
+    if (nullptr != m_kdf && m_kdf->id != header.kdf)
+    {
+        // Another KDF starts from its own cost
+        header.kdf = m_kdf->id;
+        header.kdfIterations = m_kdf->iterations;
+        header.kdfMemory = m_kdf->memory;
+        header.kdfLanes = m_kdf->lanes;
+    }
+    if (0 != m_kdfIterations)
+    {
+        header.kdfIterations = m_kdfIterations;
+    }
+    if (findKdf(header.kdf)->isMemoryHard())
+    {
+        if (0 != m_kdfMemory)
+        {
+            header.kdfMemory = m_kdfMemory;
+        }
+        if (0 != m_kdfLanes)
+        {
+            header.kdfLanes = (uint8_t) m_kdfLanes;
+        }
 
-    SymmetricKey masterKey =
-        pbkdf->derive_key(KEY_SIZE + IV_DERIVATION_KEY_SIZE,
-        std::string(userPassword, passwordLength),
-        reinterpret_cast<const uint8_t*>(SALT_STR.c_str()),
-        SALT_STR.length(),
-        PBKDF_ITERATIONS);
+        // Argon2 takes at least 8 KiB per lane
+        header.kdfMemory = std::max<uint32_t>(header.kdfMemory,
+                                              8 * header.kdfLanes);
 
-    m_writeKey = SymmetricKey(masterKey.bits_of().data(), KEY_SIZE);
+        // The memory cost is kept in the extension
+        if (!header.hasExtension())
+        {
+            const KdfAlgorithm& kdf = *findKdf(DEFAULT_KDF);
+            header.kdf = kdf.id;
+            header.kdfIterations = kdf.iterations;
+            header.kdfMemory = 0;
+            header.kdfLanes = 0;
+        }
+    }
+    if (CODEC_FORMAT_LEGACY != m_format)
+    {
+        header.version = m_format;
+    }
 
-    m_ivWriteKey = SymmetricKey(masterKey.bits_of().data() + KEY_SIZE,
-                                IV_DERIVATION_KEY_SIZE);
+    // Calibrated for the page key, whose blocks run in parallel. Envelope
+    // databases stretch only the shorter slot key, which is no slower.
+    // Memory hard KDFs take their cost as set.
+    if (0 != m_kdfTime && !findKdf(header.kdf)->isMemoryHard())
+    {
+        const CipherSuite& suite = *findCipherSuite(header.suite);
+        const size_t keyLength = suite.keySize +
+                                 (header.hasTweakIV() ? 0 : suite.ivKeySize);
+        header.kdfIterations = calibrateIterations(*findKdf(header.kdf),
+                                                   keyLength, m_kdfTime);
+    }
 
+    // Only the defaults can be used without a header to record them
+    if (!header.hasHeader() &&
+        (DEFAULT_CIPHER_SUITE != header.suite || DEFAULT_KDF != header.kdf ||
+         DEFAULT_KDF_ITERATIONS != header.kdfIterations))
+    {
+        header.version = CODEC_FORMAT_V1;
+    }
+}
+
+bool Codec::writeKeyHeader(CodecHeader& header)
+{
+    // Rekeying keeps the salt and reserved bytes of the database, but
+    // picks up changed parameters
+    if (m_hasReadKey && m_header.isEnvelope())
+    {
+        // Envelope databases change passwords through their key slots
+        return false;
+    }
+
+    header = m_hasReadKey ? m_readCipher->header() : m_header;
+    if (m_hasReadKey)
+    {
+        applySettings(header);
+
+        // A full rekey leaves no incremental rekey behind
+        header.rekeyWatermark = 0;
+        header.rekeyKeyCheck = 0;
+        m_header.rekeyWatermark = 0;
+        m_header.rekeyKeyCheck = 0;
+    }
+    return true;
+}
+
+bool Codec::generateWriteKey(const char* userPassword, int passwordLength,
+                             bool rawKey)
+{
+    awaitKey();
+
+    CodecHeader header;
+    if (!writeKeyHeader(header))
+    {
+        return false;
+    }
+
+    std::shared_ptr<PageCipher> cipher = deriveCipher(header, userPassword,
+                                                      passwordLength, rawKey);
+    if (!cipher)
+    {
+        return false;
+    }
+
+    m_writeCipher = cipher;
     m_hasWriteKey = true;
+    return true;
+}
+
+bool Codec::deriveKeyAsync(const char* userPassword, int passwordLength)
+{
+    awaitKey();
+
+    CodecHeader header;
+    if (!writeKeyHeader(header))
+    {
+        return false;
+    }
+
+    // Checked up front, the derivation itself cannot fail then
+    if (!CryptoBackend::supports(*findCipherSuite(header.suite)) ||
+        !CryptoBackend::supports(*findKdf(header.kdf)))
+    {
+        return false;
+    }
+
+    // The derivation only reads the codec, its result is taken by awaitKey
+    // on the connection thread
+    SecureBytes password(userPassword, userPassword + passwordLength);
+    m_derivation = std::async(std::launch::async, [this, header, password]()
+    {
+        DerivedKey derived;
+        deriveKey(header, reinterpret_cast<const char*>(password.data()),
+                  (int) password.size(), false, derived);
+        return derived;
+    });
+    return true;
+}
+
+void Codec::awaitKey()
+{
+    if (!m_derivation.valid())
+    {
+        return;
+    }
+
+    DerivedKey derived;
+    try
+    {
+        derived = m_derivation.get();
+    }
+    catch (...)
+    {
+        // Failed like a derivation without a result
+    }
+
+    // Without a key the pager would read and write plaintext, so the codec
+    // stays without one and refuses pages instead
+    if (!derived.cipher)
+    {
+        m_keyFailed = true;
+        return;
+    }
+
+    applyDerivedKey(derived);
+    m_writeCipher = derived.cipher;
+    m_hasWriteKey = true;
+    setReadIsWrite();
+}
+
+std::shared_ptr<PageCipher> Codec::deriveCipher(const CodecHeader& header,
+                                                const char* userPassword,
+                                                int passwordLength, bool rawKey)
+{
+    DerivedKey derived;
+    if (!deriveKey(header, userPassword, passwordLength, rawKey, derived))
+    {
+        return nullptr;
+    }
+
+    applyDerivedKey(derived);
+    return derived.cipher;
+}
+
+void Codec::applyDerivedKey(const DerivedKey& derived)
+{
+    if (derived.dataKey.empty())
+    {
+        return;
+    }
+
+    m_dataKey = derived.dataKey;
+    m_keySlot = derived.keySlot;
+    if (!derived.keySlots.empty())
+    {
+        m_header.keySlots = derived.keySlots;
+    }
+}
+
+bool Codec::deriveKey(const CodecHeader& header, const char* userPassword,
+                      int passwordLength, bool rawKey,
+                      DerivedKey& derived) const
+{
+    const CipherSuite& suite = *findCipherSuite(header.suite);
+    const KdfAlgorithm* kdf = findKdf(header.kdf);
+    if (!CryptoBackend::supports(suite) || !CryptoBackend::supports(*kdf))
+    {
+        return false;
+    }
+
+    // Formats that use the page number as tweak have no IV key
+    const size_t ivKeySize = header.hasTweakIV() ? 0 : suite.ivKeySize;
+    SecureBytes masterKey(suite.keySize + ivKeySize);
+
+    if (header.isEnvelope())
+    {
+        // The page key comes from the data key, which is random: a single
+        // iteration only spreads it over the key material
+        if (!openDataKey(header, userPassword, passwordLength, rawKey,
+                         derived) ||
+            !CryptoBackend::deriveKey(*findKdf(KDF_PBKDF2_SHA256),
+                                      reinterpret_cast<const char*>(derived.dataKey.data()),
+                                      derived.dataKey.size(),
+                                      header.salt.data(), header.salt.size(),
+                                      KdfCost(1), masterKey.data(), masterKey.size()))
+        {
+            return false;
+        }
+    }
+    else if (!derivePasswordKey(header, userPassword, passwordLength, rawKey,
+                                masterKey.data(), masterKey.size()))
+    {
+        return false;
+    }
+
+    SecureBytes key(masterKey.begin(), masterKey.begin() + suite.keySize);
+
+    SecureBytes ivKey(masterKey.begin() + suite.keySize, masterKey.end());
+
+    derived.cipher = std::make_shared<PageCipher>(header, key, ivKey);
+    return true;
+}
+
+SecureBytes Codec::deriveSlotKey(const CodecHeader& header,
+                                 const char* userPassword,
+                                 int passwordLength, bool rawKey) const
+{
+    // AES-256 key wrap
+    SecureBytes slotKey(32);
+    if (!derivePasswordKey(header, userPassword, passwordLength, rawKey,
+                           slotKey.data(), slotKey.size()))
+    {
+        slotKey.clear();
+    }
+    return slotKey;
+}
+
+bool Codec::derivePasswordKey(const CodecHeader& header,
+                              const char* userPassword, int passwordLength,
+                              bool rawKey, uint8_t* out, size_t outLength) const
+{
+    // Raw keys are high entropy already, a single iteration only spreads
+    // them over the key material. Opt-in only: a password of the same form
+    // has to keep opening the databases it keyed before.
+    SecureBytes keyBytes;
+    if ((rawKey || m_rawKey) &&
+        parseRawKey(userPassword, passwordLength, keyBytes))
+    {
+        return CryptoBackend::deriveKey(*findKdf(KDF_PBKDF2_SHA256),
+                                        reinterpret_cast<const char*>(keyBytes.data()),
+                                        keyBytes.size(),
+                                        header.salt.data(), header.salt.size(),
+                                        KdfCost(1), out, outLength);
+    }
+
+    // Passwords go through the process wide cache
+    return KdfCache::instance().deriveKey(*findKdf(header.kdf), userPassword,
+                                          passwordLength,
+                                          header.salt.data(), header.salt.size(),
+                                          header.kdfCost(),
+                                          out, outLength);
+}
+
+int Codec::openKeySlot(const CodecHeader& header, const SecureBytes& slotKey,
+                       uint8_t* dataKey) const
+{
+    for (size_t i = 0; i < header.keySlotCount(); ++i)
+    {
+        if (CryptoBackend::unwrapKey(slotKey.data(), slotKey.size(),
+                                     &header.keySlots[i * CODEC_KEY_SLOT_SIZE],
+                                     CODEC_KEY_SLOT_SIZE, dataKey))
+        {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+bool Codec::openDataKey(const CodecHeader& header, const char* userPassword,
+                        int passwordLength, bool rawKey,
+                        DerivedKey& derived) const
+{
+    SecureBytes slotKey = deriveSlotKey(header, userPassword, passwordLength,
+                                        rawKey);
+    if (slotKey.empty())
+    {
+        return false;
+    }
+
+    derived.dataKey.resize(CODEC_DATA_KEY_SIZE);
+    derived.keySlot = openKeySlot(header, slotKey, derived.dataKey.data());
+    if (derived.keySlot >= 0)
+    {
+        return true;
+    }
+
+    // A wrong password gets a random data key, so the database reads as
+    // garbage just like with a wrong password for a derived page key.
+    // Without any key yet, the database is new and this one is its key.
+    CryptoBackend::randomize(derived.dataKey.data(), derived.dataKey.size());
+    if (std::all_of(header.keySlots.begin(), header.keySlots.end(),
+                    [](uint8_t b) { return 0 == b; }))
+    {
+        derived.keySlots = header.keySlots;
+        CryptoBackend::wrapKey(slotKey.data(), slotKey.size(),
+                               derived.dataKey.data(), derived.dataKey.size(),
+                               derived.keySlots.data());
+        derived.keySlot = 0;
+    }
+    return true;
+}
+
+bool Codec::changeKeySlot(int op, const char* userPassword, int passwordLength)
+{
+    if (!m_header.isEnvelope() || m_dataKey.empty())
+    {
+        return false;
+    }
+
+    SecureBytes slotKey = deriveSlotKey(m_header, userPassword, passwordLength,
+                                        false);
+    if (slotKey.empty())
+    {
+        return false;
+    }
+
+    const size_t count = m_header.keySlotCount();
+    size_t used = 0;
+    int freeSlot = -1;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const uint8_t* slot = &m_header.keySlots[i * CODEC_KEY_SLOT_SIZE];
+        if (std::all_of(slot, slot + CODEC_KEY_SLOT_SIZE,
+                        [](uint8_t b) { return 0 == b; }))
+        {
+            freeSlot = freeSlot < 0 ? (int) i : freeSlot;
+        }
+        else
+        {
+            ++used;
+        }
+    }
+
+    int slot = -1;
+    switch (op)
+    {
+    case CODEC_KEY_SLOT_ADD:
+        slot = freeSlot;
+        break;
+    case CODEC_KEY_SLOT_REMOVE:
+    {
+        // The database keeps at least one way in
+        SecureBytes dataKey(CODEC_DATA_KEY_SIZE);
+        slot = used > 1 ? openKeySlot(m_header, slotKey, dataKey.data()) : -1;
+        break;
+    }
+    case CODEC_KEY_SLOT_REPLACE:
+        slot = m_keySlot;
+        break;
+    }
+
+    if (slot < 0)
+    {
+        return false;
+    }
+
+    m_changedHeader = m_header;
+
+    uint8_t* data = &m_header.keySlots[slot * CODEC_KEY_SLOT_SIZE];
+    if (CODEC_KEY_SLOT_REMOVE == op)
+    {
+        memset(data, 0, CODEC_KEY_SLOT_SIZE);
+    }
+    else
+    {
+        CryptoBackend::wrapKey(slotKey.data(), slotKey.size(),
+                               m_dataKey.data(), m_dataKey.size(), data);
+    }
+    return true;
+}
+
+bool Codec::setPendingKey(const char* userPassword, int passwordLength)
+{
+    // The watermark lives in the header extension. The pending key uses the
+    // same salt and parameters, only the password changes. Envelope
+    // databases change passwords through their key slots instead.
+    if (!m_hasReadKey || m_writeCipher != m_readCipher ||
+        !m_readCipher->header().hasExtension() || m_header.isEnvelope())
+    {
+        return false;
+    }
+
+    std::shared_ptr<PageCipher> cipher = deriveCipher(m_readCipher->header(),
+                                                      userPassword,
+                                                      passwordLength, false);
+    if (!cipher)
+    {
+        return false;
+    }
+
+    const uint64_t keyCheck = cipher->keyCheck();
+    if (rekeyInProgress() && keyCheck != m_header.rekeyKeyCheck)
+    {
+        return false;
+    }
+
+    m_pendingCipher = cipher;
+    m_pendingKeyCheck = keyCheck;
+
+    // The rekey may have been finished by another connection already
+    if (CODEC_REKEY_ALL == rekeyWatermark())
+    {
+        finishPendingKey();
+    }
+    return true;
+}
+
+bool Codec::rekeyInProgress() const
+{
+    return 0 != m_header.rekeyWatermark && CODEC_REKEY_ALL != m_header.rekeyWatermark;
+}
+
+uint32_t Codec::rekeyWatermark() const
+{
+    // A watermark left by a rekey to another key says nothing about this one
+    if (!m_pendingCipher || m_header.rekeyKeyCheck != m_pendingKeyCheck ||
+        0 == m_header.rekeyWatermark)
+    {
+        return 1;
+    }
+    return m_header.rekeyWatermark;
+}
+
+void Codec::beginRekeyStep(uint32_t watermark)
+{
+    m_changedHeader = m_header;
+
+    m_header.rekeyWatermark = watermark;
+    m_header.rekeyKeyCheck = m_pendingKeyCheck;
+}
+
+void Codec::endHeaderChange(bool committed)
+{
+    if (!committed)
+    {
+        m_header = m_changedHeader;
+
+        if (m_rotatedFrom)
+        {
+            m_readCipher = m_rotatedFrom;
+            m_writeCipher = m_rotatedFrom;
+            m_keyring.pop_back();
+        }
+    }
+    else if (CODEC_REKEY_ALL == rekeyWatermark())
+    {
+        finishPendingKey();
+    }
+
+    m_rotatedFrom.reset();
+}
+
+bool Codec::rotateKey(const char* userPassword, int passwordLength)
+{
+    if (!m_hasReadKey || m_writeCipher != m_readCipher ||
+        !m_readCipher->header().hasExtension() || m_header.isEnvelope() ||
+        m_pendingCipher || rekeyInProgress())
+    {
+        return false;
+    }
+
+    std::shared_ptr<PageCipher> cipher = deriveCipher(m_readCipher->header(),
+                                                      userPassword,
+                                                      passwordLength, false);
+    if (!cipher || cipher->keyCheck() == m_readCipher->keyCheck())
+    {
+        return false;
+    }
+
+    m_changedHeader = m_header;
+
+    // Pages written before tags existed use the key of the first rotation
+    if (0 == m_header.baseKeyCheck)
+    {
+        m_header.baseKeyCheck = m_readCipher->keyCheck();
+    }
+
+    m_rotatedFrom = m_readCipher;
+    m_keyring.push_back(m_readCipher);
+    m_readCipher = cipher;
+    m_writeCipher = cipher;
+    return true;
+}
+
+bool Codec::addKeyringKey(const char* userPassword, int passwordLength)
+{
+    if (!m_hasReadKey || !m_readCipher->header().hasExtension() ||
+        m_header.isEnvelope())
+    {
+        return false;
+    }
+
+    std::shared_ptr<PageCipher> cipher = deriveCipher(m_readCipher->header(),
+                                                      userPassword,
+                                                      passwordLength, false);
+    if (!cipher)
+    {
+        return false;
+    }
+
+    m_keyring.push_back(cipher);
+    return true;
+}
+
+bool Codec::isCurrentPage(const unsigned char* data) const
+{
+    return m_header.pageTag(data, m_pageSize) == m_writeCipher->keyCheck();
+}
+
+void Codec::endSweep(uint32_t nextPage)
+{
+    m_sweepPage = 0 != nextPage ? nextPage : 1;
+    if (0 == nextPage)
+    {
+        m_keyring.clear();
+    }
+}
+
+PageCipher& Codec::readCipher(int page, const unsigned char* data)
+{
+    if (!m_keyring.empty())
+    {
+        uint64_t tag = m_header.pageTag(data, m_pageSize);
+        if (0 == tag)
+        {
+            tag = m_header.baseKeyCheck;
+        }
+
+        if (tag == m_readCipher->keyCheck())
+        {
+            return *m_readCipher;
+        }
+        for (const std::shared_ptr<PageCipher>& cipher : m_keyring)
+        {
+            if (tag == cipher->keyCheck())
+            {
+                return *cipher;
+            }
+        }
+    }
+    return pageCipher(page, false);
+}
+
+void Codec::finishPendingKey()
+{
+    m_readCipher = m_pendingCipher;
+    m_writeCipher = m_pendingCipher;
+    m_pendingCipher.reset();
+}
+
+void Codec::readState(const unsigned char* page1)
+{
+    const CodecHeader& header = m_readCipher->header();
+    if (!header.hasExtension() ||
+        !m_header.readState(page1 + m_pageSize - header.reserve,
+                            header.reserve))
+    {
+        return;
+    }
+
+    // Another connection may have finished the rekey
+    if (m_pendingCipher && CODEC_REKEY_ALL == rekeyWatermark())
+    {
+        finishPendingKey();
+    }
+}
+
+PageCipher& Codec::pageCipher(int page, bool useWriteKey)
+{
+    if (m_pendingCipher && (uint32_t) page < rekeyWatermark())
+    {
+        return *m_pendingCipher;
+    }
+    return useWriteKey ? *m_writeCipher : *m_readCipher;
 }
 
 void Codec::dropWriteKey()
 {
+    m_writeCipher.reset();
     m_hasWriteKey = false;
 }
 
 void Codec::setReadIsWrite()
 {
-    m_readKey = m_writeKey;
-    m_ivReadKey = m_ivWriteKey;
+    m_readCipher = m_writeCipher;
     m_hasReadKey = m_hasWriteKey;
 }
 
 void Codec::setWriteIsRead()
 {
-    m_writeKey = m_readKey;
-    m_ivWriteKey = m_ivReadKey;
+    m_writeCipher = m_readCipher;
     m_hasWriteKey = m_hasReadKey;
 }
 
 unsigned char* Codec::encrypt(int page, unsigned char* data, bool useWriteKey)
 {
+    // Journalling a prepared page under the read key gives back what was
+    // read from disk, writing it under the write key what the workers
+    // encrypted. Workers never encrypt page 1, its state is set below.
+    if (isPrepared(page) &&
+        (!useWriteKey || (!m_preparedWrite.empty() && 1 != page)))
+    {
+        const size_t offset = (size_t) (page - m_preparedFirst) * m_pageSize;
+        if (0 == memcmp(data, m_preparedPlain.data() + offset, m_pageSize))
+        {
+            return useWriteKey ? m_preparedWrite.data() + offset :
+                                 m_preparedRaw.data() + offset;
+        }
+    }
+
     memcpy(m_page.get(), data, m_pageSize);
 
-    m_encipherFilter->set_key(useWriteKey ? m_writeKey : m_readKey);
-    m_encipherFilter->set_iv(getIVForPage(page, useWriteKey));
-    m_encipherPipe.process_msg(m_page.get(), m_pageSize);
-    m_encipherPipe.read(m_page.get(), 
-                        m_encipherPipe.remaining(Pipe::LAST_MESSAGE),
-                        Pipe::LAST_MESSAGE);
+    PageCipher& cipher = pageCipher(page, useWriteKey);
+    if (1 == page)
+    {
+        cipher.setState(m_header);
+    }
+    cipher.encrypt(page, m_page.get(), m_pageSize);
 
     return m_page.get(); //return location of newly ciphered data
 }
 
 void Codec::decrypt(int page, unsigned char *data)
 {
-    m_decipherFilter->set_key(m_readKey);
-    m_decipherFilter->set_iv(getIVForPage(page, false));
-    m_decipherPipe.process_msg(data, m_pageSize);
-    m_decipherPipe.read(data,
-                        m_decipherPipe.remaining(Pipe::LAST_MESSAGE),
-                        Pipe::LAST_MESSAGE);
+    if (isPrepared(page))
+    {
+        const size_t offset = (size_t) (page - m_preparedFirst) * m_pageSize;
+        if (0 == memcmp(data, m_preparedRaw.data() + offset, m_pageSize))
+        {
+            memcpy(data, m_preparedPlain.data() + offset, m_pageSize);
+            return;
+        }
+    }
+
+    // Page 1 says which pages use which key, in its plaintext extension,
+    // and has the key slots other connections may have changed
+    if (1 == page)
+    {
+        readState(data);
+    }
+    readCipher(page, data).decrypt(page, data, m_pageSize);
+}
+
+void Codec::encryptBatch(CodecPage* pages, int count, bool useWriteKey)
+{
+    // During an incremental rekey the key differs from page to page
+    if (m_pendingCipher)
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            pageCipher(pages[i].page, useWriteKey).encrypt(pages[i].page,
+                                                           pages[i].data,
+                                                           m_pageSize);
+        }
+        return;
+    }
+
+    PageCipher& cipher = useWriteKey ? *m_writeCipher : *m_readCipher;
+    cipher.encryptBatch(pages, count, m_pageSize);
+}
+
+void Codec::decryptBatch(CodecPage* pages, int count)
+{
+    if (m_pendingCipher || !m_keyring.empty())
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            decrypt(pages[i].page, pages[i].data);
+        }
+        return;
+    }
+
+    m_readCipher->decryptBatch(pages, count, m_pageSize);
+}
+
+void Codec::preparePages(int firstPage, const unsigned char* raw, int count)
+{
+    const size_t length = (size_t) count * m_pageSize;
+    m_preparedRaw.assign(raw, raw + length);
+    m_preparedPlain.assign(raw, raw + length);
+
+    std::vector<CodecPage> pages(count);
+    for (int i = 0; i < count; ++i)
+    {
+        pages[i].page = firstPage + i;
+        pages[i].data = m_preparedPlain.data() + (size_t) i * m_pageSize;
+    }
+
+    if (!m_workers)
+    {
+        if (m_hasReadKey)
+        {
+            decryptBatch(pages.data(), count);
+        }
+    }
+    else
+    {
+        std::vector<CodecPage> writePages(pages);
+        if (m_hasWriteKey)
+        {
+            m_preparedWrite.resize(length);
+            for (int i = 0; i < count; ++i)
+            {
+                writePages[i].data = m_preparedWrite.data() + (size_t) i * m_pageSize;
+            }
+        }
+
+        // Page 1 carries the codec state, which only this thread keeps up
+        // to date: it is decrypted here, and encrypt() encrypts it after
+        // setState instead of taking a copy from the workers
+        const size_t skip = 1 == firstPage ? 1 : 0;
+        if (skip && m_hasReadKey)
+        {
+            readState(pages[0].data);
+            readCipher(1, pages[0].data).decrypt(1, pages[0].data, m_pageSize);
+        }
+
+        // One contiguous share of the other pages per worker
+        const size_t workers = m_workers->size();
+        const size_t share = (count - skip + workers - 1) / workers;
+        m_workers->run(workers, [&](size_t task, size_t worker)
+        {
+            const size_t first = skip + task * share;
+            if (first >= (size_t) count)
+            {
+                return;
+            }
+            const size_t n = std::min(share, count - first);
+
+            if (m_hasReadKey)
+            {
+                m_workerReadCiphers[worker]->decryptBatch(&pages[first], n,
+                                                          m_pageSize);
+            }
+            if (m_hasWriteKey)
+            {
+                memcpy(writePages[first].data, pages[first].data, n * m_pageSize);
+                m_workerWriteCiphers[worker]->encryptBatch(&writePages[first], n,
+                                                           m_pageSize);
+            }
+        });
+    }
+
+    m_preparedFirst = firstPage;
+    m_preparedCount = count;
+}
+
+void Codec::clearPreparedPages()
+{
+    m_preparedFirst = 0;
+    m_preparedCount = 0;
+
+    // Release (and so wipe) the decrypted pages
+    std::vector<unsigned char>().swap(m_preparedRaw);
+    SecureBytes().swap(m_preparedPlain);
+    std::vector<unsigned char>().swap(m_preparedWrite);
 }
 
-InitializationVector Codec::getIVForPage(u32bit page, bool useWriteKey)
+void Codec::reencryptPages(int firstPage, unsigned char* data, int count)
 {
-    static unsigned char* intiv[4];
-    store_le(page, reinterpret_cast<byte*>(intiv));
-    m_cmac->set_key(useWriteKey ? m_ivWriteKey : m_ivReadKey);
-    m_macPipe.process_msg(reinterpret_cast<byte*>(intiv), 4);
-    return m_macPipe.read_all(Pipe::LAST_MESSAGE);
+    std::vector<CodecPage> pages(count);
+    for (int i = 0; i < count; ++i)
+    {
+        pages[i].page = firstPage + i;
+        pages[i].data = data + (size_t) i * m_pageSize;
+    }
+
+    // Page 1 carries the header, which the workers' ciphers don't track
+    size_t first = 0;
+    if (1 == firstPage && count > 0)
+    {
+        decrypt(1, data);
+        memcpy(data, encrypt(1, data, true), m_pageSize);
+        first = 1;
+    }
+
+    if (!m_workers)
+    {
+        decryptBatch(pages.data() + first, count - (int) first);
+        encryptBatch(pages.data() + first, count - (int) first, true);
+        return;
+    }
+
+    const size_t workers = m_workers->size();
+    const size_t share = (count - first + workers - 1) / workers;
+    m_workers->run(workers, [&](size_t task, size_t worker)
+    {
+        const size_t begin = first + task * share;
+        if (begin >= (size_t) count)
+        {
+            return;
+        }
+        const size_t n = std::min(share, count - begin);
+
+        m_workerReadCiphers[worker]->decryptBatch(&pages[begin], n, m_pageSize);
+        m_workerWriteCiphers[worker]->encryptBatch(&pages[begin], n, m_pageSize);
+    });
+}
+
+int Codec::startWorkers()
+{
+    stopWorkers();
+
+    // Workers only have the read and write keys
+    if (m_rekeyThreads <= 1 || m_pendingCipher || !m_keyring.empty())
+    {
+        return 1;
+    }
+
+    // Cipher objects carry per-message state, so every worker gets its own
+    for (uint32_t i = 0; i < m_rekeyThreads; ++i)
+    {
+        if (m_hasReadKey)
+        {
+            m_workerReadCiphers.emplace_back(new PageCipher(m_readCipher->header(),
+                                                            m_readCipher->key(),
+                                                            m_readCipher->ivKey()));
+        }
+        if (m_hasWriteKey)
+        {
+            m_workerWriteCiphers.emplace_back(new PageCipher(m_writeCipher->header(),
+                                                             m_writeCipher->key(),
+                                                             m_writeCipher->ivKey()));
+        }
+    }
+
+    m_workers.reset(new ThreadPool(m_rekeyThreads));
+    return (int) m_workers->size();
 }
 
+void Codec::stopWorkers()
+{
+    m_workers.reset();
+    m_workerReadCiphers.clear();
+    m_workerWriteCiphers.clear();
+}
 
+bool Codec::isPrepared(int page) const
+{
+    return page >= m_preparedFirst && page < m_preparedFirst + m_preparedCount;
+}
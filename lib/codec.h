@@ -9,102 +9,467 @@
 #ifndef CODEC_H_
 #define CODEC_H_
 
+#include <future>
 #include <string>
 #include <memory>
-#include <botan/botan.h>
-#include <botan/pipe.h>
-#include <botan/loadstor.h>
-#include <botan/filters.h>
+#include <vector>
 
-using namespace std;
-using namespace Botan;
-
-/*These constants can be used to tweak the codec behavior as follows
- *Note that once you've encrypted a database with these settings,
- *recompiling with any different settings will give you a library that
- *cannot read that database, even given the same passphrase.*/
-
-//BLOCK_CIPHER_STR: Cipher and mode used for encrypting the database
-//make sure to add "/NoPadding" for modes that use padding schemes
-const string BLOCK_CIPHER_STR = "Twofish/XTS";
-
-//KEY_SIZE: Size of the encryption key. Note that XTS splits the key
-//between two ciphers, so if you're using XTS, double the intended key
-//size. (ie, "AES-128/XTS" should have a 256 bit KEY_SIZE)
-const size_t KEY_SIZE = 512/8; //512 bit, 64 byte key. (256 bit XTS key)
-
-//PBKDF_STR: Key derivation function used to derive both the encryption
-//and IV derivation keys from the given database passphrase
-const string PBKDF_STR = "PBKDF2(SHA-256)";
+#include "page_cipher.h"
+#include "thread_pool.h"
 
-//PBKDF_ITERATIONS: Number of hash iterations used in the key derivation
-//process.
-const size_t PBKDF_ITERATIONS = 10000;
+using namespace std;
 
-//SALT_STR: Hard coded salt used to derive the key from the passphrase.
-const string SALT_STR = "&g#nB'9]";
+//CODEC_MAX_REKEY_THREADS: Upper bound of the rekey_threads parameter.
+const uint32_t CODEC_MAX_REKEY_THREADS = 64;
 
-//MAC_STR: CMAC used to derive the IV that is used for db page
-//encryption
-const string MAC_STR = "CMAC(Twofish)";
+//CODEC_MAX_KDF_MEMORY: Upper bound of the kdf_memory parameter, in KiB.
+const uint32_t CODEC_MAX_KDF_MEMORY = 4 * 1024 * 1024;
 
-//IV_DERIVATION_KEY_SIZE: Size of the key used with the CMAC (MAC_STR)
-//above.
-const size_t IV_DERIVATION_KEY_SIZE = 256/8; //256 bit, 32 byte key
+/**
+* Recognise a raw key, given as x'<hex>' instead of a password. Raw keys
+* are used as they are, without the stretching of the KDF, so they must come
+* from a key store or a random source, not a person.
+* @param key key as passed to sqlite3_key.
+* @param length length of key.
+* @param rawKey receives the key bytes.
+* @return false if key is a password: not of that form, or shorter than
+* CODEC_MIN_RAW_KEY_SIZE bytes.
+*/
+bool parseRawKey(const char* key, int length, SecureBytes& rawKey);
 
+/*Cipher suites and KDFs are described in cipher_suite.h, and provided by
+ *the crypto backend the library is built with (crypto_backend.h). New databases
+ *get a codec header (see codec_header.h) recording which ones they use,
+ *selected at runtime through the codec parameters below. Databases
+ *without a header use the defaults from cipher_suite.h, which therefore
+ *must never change.
+ *
+ *Codec parameters (sqlite3_codec_config, or URI parameters of a new
+ *database file):
+ *  cipher    name of a cipher suite, e.g. "aes-xts", or "auto" for
+ *            AES-XTS on CPUs with AES instructions, Twofish-XTS otherwise
+ *  kdf       name of a key derivation function, e.g. "pbkdf2-sha256", or
+ *            "argon2id" where the backend has it
+ *  kdf_iter  number of KDF iterations, passes over the memory for Argon2id
+ *  kdf_time  milliseconds PBKDF2 should take on this host, instead of
+ *            kdf_iter: the iterations are measured when the header is
+ *            written and recorded in it
+ *  kdf_memory  memory of Argon2id in KiB
+ *  kdf_lanes lanes of Argon2id, derived in parallel
+ *  format    page format: 1 derives each page IV with CMAC, 2 uses the
+ *            page number as XTS tweak (see codec_header.h)
+ *They apply when a new database is created, and when an encrypted database
+ *is rekeyed.
+ *  rekey_threads  threads sharing the cipher work of sqlite3_rekey, or
+ *            "auto" for one per core (default 1)
+ *  key_slots number of key slots of a new database, 1 to
+ *            CODEC_MAX_KEY_SLOTS for an envelope database, 0 (default)
+ *            to derive the page key from the password*/
 
+/*A Codec belongs to exactly one pager. SQLite never runs two pages through
+ *the same pager at once (connections in shared cache mode serialise on the
+ *BtShared mutex), so the per page path needs no locks as long as it only
+ *touches state owned by this Codec: no statics, and cipher objects are
+ *never shared between Codec instances.*/
 class Codec
 {
 public:
     Codec(void* db);
     Codec(const Codec* other, void* db);
 
-    void generateWriteKey(const char* userPassword, int passwordLength);
+    /**
+    * Set a codec parameter for databases created or rekeyed with this codec.
+    * @return false if the parameter or its value is unknown.
+    */
+    bool setParameter(const string& name, const string& value);
+
+    /**
+    * Read the codec header from the start of an existing database file.
+    * @return true if the database has a header, false for legacy databases.
+    */
+    bool readHeader(const unsigned char* data, size_t length);
+
+    /**
+    * Location of the header extension in the database file, if the header
+    * read by readHeader says there is one.
+    */
+    bool headerExtension(size_t& offset, size_t& length) const;
+
+    bool readHeaderExtension(const unsigned char* data, size_t length);
+
+    /**
+    * Start a header for a database that has no encrypted content yet,
+    * using the current parameters.
+    * @param withExtension if the database has room for a header extension.
+    * @return number of bytes to reserve at the end of each page.
+    */
+    int createHeader(bool withExtension);
+
+    /**
+    * Whether the keys were derived for the header read by readHeader, i.e.
+    * with the same salt and parameters. Keys copied from another codec may
+    * have been derived for another database.
+    */
+    bool keyMatchesHeader() const;
+
+    /**
+    * Whether the write key is known not to be the key of the database: the
+    * tag of page 1, read with the header extension, names another key.
+    * Without tags, or during an incremental rekey, a wrong key only shows
+    * when pages are read.
+    */
+    bool isWrongKey() const;
+
+    /**
+    * Number of bytes the codec keeps at the end of each page.
+    */
+    int reserve() const;
+
+    /**
+    * Page size recorded in plaintext in the header read by readHeader, so
+    * the pager can read page 1 at its size before there is a key.
+    * @return 0 for legacy databases.
+    */
+    int headerPageSize() const;
+
+    /**
+    * Derive the write key for the current header and parameters.
+    * @param rawKey if the key is a raw key given as x'<hex>', for this call
+    * only. The "raw_key" parameter turns it on for every call.
+    * @return false if the crypto backend lacks the suite or KDF.
+    */
+    bool generateWriteKey(const char* userPassword, int passwordLength,
+                          bool rawKey = false);
     void dropWriteKey();
+
+    /**
+    * Derive the read and write key for the current header on a background
+    * thread. hasReadKey and hasWriteKey wait for it, so the first page the
+    * pager reads or writes blocks until the key is ready.
+    * @return false if the crypto backend lacks the suite or KDF.
+    */
+    bool deriveKeyAsync(const char* userPassword, int passwordLength);
+
+    /**
+    * Whether the derivation of deriveKeyAsync failed, e.g. when the KDF ran
+    * out of memory. The codec then has no key, and must neither read nor
+    * write pages: they would go to disk unencrypted.
+    */
+    bool keyFailed() { awaitKey(); return m_keyFailed; }
+
+    /**
+    * Derive the key an incremental rekey moves the database to. Pages
+    * below the watermark recorded on page 1 are read and written with it,
+    * the others with the read key.
+    * @return false if the database has no header extension to record the
+    * watermark in, or a rekey to another key is in progress.
+    */
+    bool setPendingKey(const char* userPassword, int passwordLength);
+    bool hasPendingKey() const { return nullptr != m_pendingCipher; }
+
+    /**
+    * Whether any incremental rekey is in progress on the database, as of
+    * the last time page 1 was read.
+    */
+    bool rekeyInProgress() const;
+
+    /**
+    * First page not yet using the pending key, 1 if none do and
+    * CODEC_REKEY_ALL if all do.
+    */
+    uint32_t rekeyWatermark() const;
+
+    /**
+    * Move the watermark, to be written with page 1 in the current
+    * transaction, see endHeaderChange.
+    */
+    void beginRekeyStep(uint32_t watermark);
+
+    /**
+    * Change the key slots of an envelope database, to be written with
+    * page 1 in the current transaction, see endHeaderChange.
+    * @param op CODEC_KEY_SLOT_ADD to wrap the data key for another
+    * password, CODEC_KEY_SLOT_REMOVE to empty the slot of a password, or
+    * CODEC_KEY_SLOT_REPLACE to change the password of the current key.
+    * @return false if the database is no envelope database, there is no
+    * free slot to add to, no slot to remove or it is the last one.
+    */
+    bool changeKeySlot(int op, const char* userPassword, int passwordLength);
+    bool isEnvelope() const { return m_header.isEnvelope(); }
+
+    /**
+    * Make a new key the read and write key right away, keeping the current
+    * one in the keyring. Pages move to the new key as they are written,
+    * to be written with page 1 in the current transaction, see
+    * endHeaderChange.
+    * @return false if the database has no header extension for page tags,
+    * is an envelope database, or is in an incremental rekey.
+    */
+    bool rotateKey(const char* userPassword, int passwordLength);
+
+    /**
+    * Add an older key, for reading the pages still tagged with it.
+    * @return false if the database has no header extension for page tags.
+    */
+    bool addKeyringKey(const char* userPassword, int passwordLength);
+    bool hasKeyring() const { return !m_keyring.empty(); }
+
+    /**
+    * Whether a page, as on disk, is encrypted with the write key.
+    */
+    bool isCurrentPage(const unsigned char* data) const;
+
+    /**
+    * Page where the next sweep of pages using older keys continues, 1 for a
+    * new sweep. endSweep(0) finishes a sweep and drops the keyring.
+    */
+    uint32_t sweepPage() const { return m_sweepPage; }
+    void endSweep(uint32_t nextPage);
+
+    /**
+    * End a header change of the current transaction. The previous header
+    * comes back if the transaction did not commit. Once every page uses
+    * the pending key of an incremental rekey, it becomes the only key.
+    */
+    void endHeaderChange(bool committed);
+
     void setWriteIsRead();
     void setReadIsWrite();
 
     unsigned char* encrypt(int page, unsigned char* data, bool useWriteKey);
     void decrypt(int page, unsigned char *data);
 
+    /**
+    * Encrypt or decrypt several pages in place, in one pass through the
+    * cipher. Unlike encrypt, the pages themselves are overwritten.
+    */
+    void encryptBatch(CodecPage* pages, int count, bool useWriteKey);
+    void decryptBatch(CodecPage* pages, int count);
+
+    /**
+    * Take consecutive pages read straight from the database file and
+    * decrypt them in one batch, ahead of the pager. While prepared, the
+    * pager's decrypt and journal encrypt calls for these pages are copies.
+    * Pages are only served if their data still matches, so stale pages
+    * just fall back to the regular path.
+    * @param firstPage page number of the first page in raw.
+    * @param raw encrypted pages, count * page size bytes.
+    * @param count number of pages.
+    */
+    void preparePages(int firstPage, const unsigned char* raw, int count);
+    void clearPreparedPages();
+
+    /**
+    * Re-encrypt consecutive pages read straight from the database file with
+    * the write key, in place, for a copy of the database under a new key.
+    * The pages are split between the worker threads if they run.
+    * @param firstPage page number of the first page in data.
+    * @param data encrypted pages, count * page size bytes.
+    * @param count number of pages.
+    */
+    void reencryptPages(int firstPage, unsigned char* data, int count);
+
+    /**
+    * Start the rekey_threads worker threads, each with its own copy of the
+    * keys. While they run, preparePages splits its pages between them and
+    * also encrypts them with the write key, so the pager's main database
+    * writes of prepared pages are copies as well.
+    * @return number of threads, 1 if the pages stay on the calling thread.
+    */
+    int startWorkers();
+    void stopWorkers();
+
     /**
     * Delete old page, replace with new page.
     * @param pageSize size of page in bytes.
     */
     void setPageSize(int pageSize);
 
-    bool hasReadKey() const { return m_hasReadKey; }
-    bool hasWriteKey() const { return m_hasWriteKey; }
+    /**
+    * Name of the cipher suite and implementation of the write key.
+    */
+    string cipherName() const;
+
+    /**
+    * Statistics of the current keys since they were set or last reset.
+    * A rekey starts them over.
+    */
+    uint64_t ivCacheHits() const;
+    uint64_t ivCacheMisses() const;
+    void resetStats();
+
+    bool hasReadKey() { awaitKey(); return m_hasReadKey; }
+    bool hasWriteKey() { awaitKey(); return m_hasWriteKey; }
     void* getDB() { return m_db; }
 
 private:
-    Codec(void* db, bool hasReadKey, bool hasWriteKey, SymmetricKey readKey, SymmetricKey writeKey,
-          SymmetricKey ivReadKey, SymmetricKey ivWriteKey);
+    /**
+    * Result of deriving a key, self-contained so it can be derived on
+    * another thread: the page cipher, and for envelope databases the data
+    * key and key slot state it came with.
+    */
+    struct DerivedKey
+    {
+        DerivedKey() : keySlot(-1) { }
+
+        std::shared_ptr<PageCipher> cipher;
+        SecureBytes dataKey;
+        int keySlot;
+        // Key slots with the new key of a new database, empty otherwise
+        SecureBytes keySlots;
+    };
 
-    InitializationVector getIVForPage(u32bit page, bool useWriteKey);
+    void applySettings(CodecHeader& header) const;
+
+    /**
+    * Header the next write key is derived for.
+    * @return false for envelope databases, which change keys through
+    * their key slots.
+    */
+    bool writeKeyHeader(CodecHeader& header);
+
+    /**
+    * Take the key of deriveKeyAsync, once it is ready.
+    */
+    void awaitKey();
+
+    /**
+    * Cipher with the key of the given header and password, nullptr if the
+    * backend lacks the suite or KDF. Takes the data key of envelope
+    * databases, see applyDerivedKey.
+    */
+    std::shared_ptr<PageCipher> deriveCipher(const CodecHeader& header,
+                                             const char* userPassword,
+                                             int passwordLength, bool rawKey);
+
+    /**
+    * deriveCipher without touching the codec, for deriveKeyAsync.
+    * @return false if the backend lacks the suite or KDF.
+    */
+    bool deriveKey(const CodecHeader& header, const char* userPassword,
+                   int passwordLength, bool rawKey, DerivedKey& derived) const;
+
+    /**
+    * Take the data key and key slot state of a derived key.
+    */
+    void applyDerivedKey(const DerivedKey& derived);
+
+    /**
+    * Run the KDF of a header on a password, or a single iteration of
+    * PBKDF2 on a raw key (parseRawKey), if rawKey or the "raw_key"
+    * parameter is set.
+    * @return false if the backend lacks the KDF.
+    */
+    bool derivePasswordKey(const CodecHeader& header, const char* userPassword,
+                           int passwordLength, bool rawKey, uint8_t* out,
+                           size_t outLength) const;
+
+    /**
+    * Key that wraps the data key in a key slot, for a password.
+    */
+    SecureBytes deriveSlotKey(const CodecHeader& header,
+                              const char* userPassword, int passwordLength,
+                              bool rawKey) const;
+
+    /**
+    * Slot of the header that the slot key opens, -1 if none.
+    * @param dataKey receives the data key.
+    */
+    int openKeySlot(const CodecHeader& header, const SecureBytes& slotKey,
+                    uint8_t* dataKey) const;
+
+    /**
+    * Open the data key from the key slots of an envelope database, or
+    * create it in the first slot for a new database.
+    * @return false if the backend lacks the KDF.
+    */
+    bool openDataKey(const CodecHeader& header, const char* userPassword,
+                     int passwordLength, bool rawKey,
+                     DerivedKey& derived) const;
+
+    /**
+    * Cipher for a page: the pending key below the rekey watermark, the
+    * write or read key otherwise.
+    */
+    PageCipher& pageCipher(int page, bool useWriteKey);
+
+    /**
+    * Cipher to decrypt a page with, the key its tag names if the keyring
+    * is in use.
+    */
+    PageCipher& readCipher(int page, const unsigned char* data);
+
+    /**
+    * Pick up the rekey state and key slots from page 1, as it is read from
+    * disk.
+    */
+    void readState(const unsigned char* page1);
+    void finishPendingKey();
+
+    bool isPrepared(int page) const;
 
 private:
     bool m_hasReadKey;
     bool m_hasWriteKey;
+    bool m_keyFailed;
 
     void* m_db;
 
     std::unique_ptr<unsigned char[]> m_page;
     int m_pageSize;
 
-    SymmetricKey m_readKey;
-    SymmetricKey m_writeKey;
-    SymmetricKey m_ivReadKey;
-    SymmetricKey m_ivWriteKey;
+    // Format of the database file, used by the next generateWriteKey
+    CodecHeader m_header;
+
+    // Parameters, nullptr/0 when not set
+    const CipherSuite* m_suite;
+    const KdfAlgorithm* m_kdf;
+    uint32_t m_kdfIterations;
+    uint32_t m_kdfTime;
+    uint32_t m_kdfMemory;
+    uint32_t m_kdfLanes;
+    uint8_t m_format;
+    uint32_t m_rekeyThreads;
+    uint32_t m_keySlots;
+    bool m_rawKey;
+
+    // Keyed once when the key changes, shared when read key == write key
+    std::shared_ptr<PageCipher> m_readCipher;
+    std::shared_ptr<PageCipher> m_writeCipher;
+
+    // Envelope databases: data key, and the key slot the key opened
+    SecureBytes m_dataKey;
+    int m_keySlot;
+
+    // Incremental rekey: key being rotated to
+    std::shared_ptr<PageCipher> m_pendingCipher;
+    uint64_t m_pendingKeyCheck;
+
+    // Lazy key rotation: older keys still used by some pages, the key
+    // rotated from in the current transaction, and the sweep position
+    std::vector<std::shared_ptr<PageCipher>> m_keyring;
+    std::shared_ptr<PageCipher> m_rotatedFrom;
+    uint32_t m_sweepPage;
+
+    // m_header before the change of the current transaction
+    CodecHeader m_changedHeader;
 
-    Keyed_Filter* m_encipherFilter;
-    Pipe m_encipherPipe;
+    // Pages read ahead by preparePages, as on disk and decrypted
+    int m_preparedFirst;
+    int m_preparedCount;
+    std::vector<unsigned char> m_preparedRaw;
+    SecureBytes m_preparedPlain;
+    // Encrypted with the write key, only filled by the workers
+    std::vector<unsigned char> m_preparedWrite;
 
-    Keyed_Filter* m_decipherFilter;
-    Pipe m_decipherPipe;
+    // Running between startWorkers and stopWorkers, ciphers by worker
+    std::unique_ptr<ThreadPool> m_workers;
+    std::vector<std::unique_ptr<PageCipher>> m_workerReadCiphers;
+    std::vector<std::unique_ptr<PageCipher>> m_workerWriteCiphers;
 
-    MAC_Filter* m_cmac;
-    Pipe m_macPipe;
+    // Key being derived by deriveKeyAsync. Last, so destroying the codec
+    // waits for the derivation before the members it reads go away.
+    std::future<DerivedKey> m_derivation;
 };
 
 #endif
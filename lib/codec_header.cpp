@@ -0,0 +1,188 @@
+/*
+ * Per-database header for SQLite3 encryption codec.
+ * (C) 2010 Olivier de Gaalon
+ * (C) 2016 Archibald Neil MacDonald
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#include "codec_header.h"
+
+#include "cipher_suite.h"
+
+#include <cstring>
+
+namespace
+{
+    uint64_t readUint64(const uint8_t* data)
+    {
+        uint64_t value = 0;
+        for (size_t i = 0; i < 8; ++i)
+        {
+            value = (value << 8) | data[i];
+        }
+        return value;
+    }
+
+    void writeUint64(uint8_t* data, uint64_t value)
+    {
+        for (size_t i = 0; i < 8; ++i)
+        {
+            data[i] = (uint8_t) (value >> (56 - 8 * i));
+        }
+    }
+
+    const uint8_t HEADER_MAGIC[4] = { 'B', 'S', 'Q', '3' };
+
+    const uint8_t SQLITE_FILE_MAGIC[CODEC_HEADER_SIZE] =
+        { 'S', 'Q', 'L', 'i', 't', 'e', ' ', 'f', 'o', 'r', 'm', 'a', 't', ' ', '3', 0 };
+}
+
+CodecHeader::CodecHeader() :
+    version(CODEC_FORMAT_LEGACY),
+    suite(DEFAULT_CIPHER_SUITE),
+    kdf(DEFAULT_KDF),
+    flags(0),
+    pageSize(0),
+    reserve(0),
+    kdfIterations(DEFAULT_KDF_ITERATIONS),
+    kdfMemory(0),
+    kdfLanes(0),
+    salt(LEGACY_SALT_STR.begin(), LEGACY_SALT_STR.end()),
+    rekeyWatermark(0),
+    rekeyKeyCheck(0),
+    baseKeyCheck(0),
+    page1Tag(0)
+{ }
+
+bool CodecHeader::read(const uint8_t* data, size_t length)
+{
+    if (length < CODEC_HEADER_SIZE ||
+        0 != memcmp(data, HEADER_MAGIC, sizeof(HEADER_MAGIC)))
+    {
+        return false;
+    }
+
+    // Same encoding as the SQLite header, 65536 is stored as 0x0001
+    const uint32_t size = (data[8] << 8) | (data[9] << 16);
+
+    // Garbage that happens to start with the magic still has to make sense
+    if (data[4] < CODEC_FORMAT_V1 || data[4] > CODEC_FORMAT_LATEST ||
+        nullptr == findCipherSuite(data[5]) ||
+        nullptr == findKdf(data[6]) ||
+        size < 512 || size > 65536 || 0 != (size & (size - 1)) ||
+        (0 != data[10] && data[10] < CODEC_HEADER_EXT_SIZE) ||
+        (0 != (data[7] & CODEC_FLAG_ENVELOPE) &&
+         data[10] < CODEC_HEADER_EXT_SIZE + CODEC_KEY_SLOT_SIZE) ||
+        (findKdf(data[6])->isMemoryHard() &&
+         (0 == data[11] || data[10] < CODEC_HEADER_EXT_SIZE)))
+    {
+        return false;
+    }
+
+    version = data[4];
+    suite = data[5];
+    kdf = data[6];
+    flags = data[7];
+    pageSize = size;
+    reserve = data[10];
+    kdfLanes = data[11];
+    kdfIterations = ((uint32_t) data[12] << 24) | ((uint32_t) data[13] << 16) |
+                    ((uint32_t) data[14] << 8) | data[15];
+
+    return kdfIterations > 0;
+}
+
+bool CodecHeader::readExtension(const uint8_t* data, size_t length)
+{
+    if (!hasExtension() || length < CODEC_HEADER_EXT_SIZE)
+    {
+        return false;
+    }
+
+    salt.assign(data, data + CODEC_SALT_SIZE);
+    kdfMemory = ((uint32_t) data[44] << 24) | ((uint32_t) data[45] << 16) |
+                ((uint32_t) data[46] << 8) | data[47];
+    page1Tag = readUint64(data + CODEC_PAGE_TAG_OFFSET);
+    return readState(data, length);
+}
+
+bool CodecHeader::readState(const uint8_t* data, size_t length)
+{
+    if (!hasExtension() || length < CODEC_HEADER_EXT_SIZE)
+    {
+        return false;
+    }
+
+    rekeyWatermark = ((uint32_t) data[16] << 24) | ((uint32_t) data[17] << 16) |
+                     ((uint32_t) data[18] << 8) | data[19];
+    rekeyKeyCheck = readUint64(data + 20);
+    baseKeyCheck = readUint64(data + 36);
+
+    const uint8_t* slots = data + CODEC_HEADER_EXT_SIZE;
+    keySlots.assign(slots, slots + keySlotCount() * CODEC_KEY_SLOT_SIZE);
+    return true;
+}
+
+void CodecHeader::write(uint8_t* page, size_t pageSize) const
+{
+    memcpy(page, HEADER_MAGIC, sizeof(HEADER_MAGIC));
+    page[4] = version;
+    page[5] = suite;
+    page[6] = kdf;
+    page[7] = flags;
+    page[8] = (uint8_t) ((pageSize >> 8) & 0xFF);
+    page[9] = (uint8_t) ((pageSize >> 16) & 0xFF);
+    page[10] = reserve;
+    page[11] = kdfLanes;
+    page[12] = (uint8_t) (kdfIterations >> 24);
+    page[13] = (uint8_t) (kdfIterations >> 16);
+    page[14] = (uint8_t) (kdfIterations >> 8);
+    page[15] = (uint8_t) kdfIterations;
+
+    if (hasExtension())
+    {
+        uint8_t* extension = page + pageSize - reserve;
+        memset(extension, 0, reserve);
+        memcpy(extension, salt.data(), salt.size());
+
+        extension[16] = (uint8_t) (rekeyWatermark >> 24);
+        extension[17] = (uint8_t) (rekeyWatermark >> 16);
+        extension[18] = (uint8_t) (rekeyWatermark >> 8);
+        extension[19] = (uint8_t) rekeyWatermark;
+        writeUint64(extension + 20, rekeyKeyCheck);
+        writeUint64(extension + 36, baseKeyCheck);
+        extension[44] = (uint8_t) (kdfMemory >> 24);
+        extension[45] = (uint8_t) (kdfMemory >> 16);
+        extension[46] = (uint8_t) (kdfMemory >> 8);
+        extension[47] = (uint8_t) kdfMemory;
+
+        if (!keySlots.empty())
+        {
+            memcpy(extension + CODEC_HEADER_EXT_SIZE, keySlots.data(),
+                   keySlots.size());
+        }
+    }
+}
+
+uint64_t CodecHeader::pageTag(const uint8_t* page, size_t pageSize) const
+{
+    if (!hasExtension())
+    {
+        return 0;
+    }
+    return readUint64(page + pageSize - reserve + CODEC_PAGE_TAG_OFFSET);
+}
+
+void CodecHeader::writePageTag(uint8_t* page, size_t pageSize, uint64_t tag) const
+{
+    if (hasExtension())
+    {
+        writeUint64(page + pageSize - reserve + CODEC_PAGE_TAG_OFFSET, tag);
+    }
+}
+
+void CodecHeader::restore(uint8_t* page) const
+{
+    memcpy(page, SQLITE_FILE_MAGIC, sizeof(SQLITE_FILE_MAGIC));
+}
@@ -0,0 +1,186 @@
+/*
+ * Per-database header for SQLite3 encryption codec.
+ * (C) 2010 Olivier de Gaalon
+ * (C) 2016 Archibald Neil MacDonald
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#ifndef CODEC_HEADER_H_
+#define CODEC_HEADER_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "crypto_backend.h"
+
+/*Databases written by this codec start with a plaintext header that takes
+ *the place of SQLite's constant "SQLite format 3" magic string on page 1.
+ *The header records how the database is encrypted, so databases using
+ *different suites can be opened by the same library. Databases that have
+ *room for it (created by this codec) also keep a header extension in the
+ *reserved bytes at the end of page 1, holding their random salt.
+ *
+ *Header layout (all integers big endian):
+ *  0..3   magic "BSQ3"
+ *  4      format version, see CODEC_FORMAT_*
+ *  5      cipher suite id
+ *  6      KDF id
+ *  7      flags, see CODEC_FLAG_*
+ *  8..9   page size, encoded as in the SQLite header
+ *  10     codec reserved bytes at the end of each page
+ *  11     KDF lanes of memory hard KDFs, zero otherwise
+ *  12..15 KDF iterations
+ *
+ *Extension layout, at page size - reserved bytes on page 1:
+ *  0..15  salt
+ *  16..19 incremental rekey watermark: pages below it are encrypted with
+ *         the key being rotated to, 0 for none, CODEC_REKEY_ALL for all
+ *  20..27 key check value of the key being rotated to
+ *  28..35 page key tag, as on every page
+ *  36..43 key check value of the key of untagged pages, 0 if not known
+ *  44..47 KDF memory in KiB of memory hard KDFs, zero otherwise
+ *  48..   key slots of envelope databases, up to the end of the reserved
+ *         bytes, CODEC_KEY_SLOT_SIZE bytes each, all zero when unused
+ *
+ *Databases with an extension tag every page they write with the key check
+ *value of its key (PageCipher::keyCheck), in the reserved bytes at
+ *CODEC_PAGE_TAG_OFFSET. Pages keep the key they were written with until
+ *they are written again, so keys can be rotated lazily. The tag of page 1
+ *is plaintext like the rest of the extension, so a wrong key shows when the
+ *key is set rather than when page 1 decrypts to garbage.
+ *
+ *Envelope databases encrypt their pages with a random data key instead of
+ *one derived from the password. Each key slot holds the data key wrapped
+ *(RFC 3394) with a key derived from a password, so changing a password
+ *only rewrites page 1.
+ *
+ *Memory hard KDFs (Argon2id) need the extension for their memory cost, and
+ *at least one lane.
+ *
+ *Databases without the magic are legacy databases: no header, the whole
+ *page encrypted with the default suite and the hard coded salt.*/
+
+//CODEC_HEADER_SIZE: Size of the plaintext header at the start of page 1
+const size_t CODEC_HEADER_SIZE = 16;
+
+//CODEC_HEADER_EXT_SIZE: Reserved bytes taken by the header extension
+const size_t CODEC_HEADER_EXT_SIZE = 48;
+
+//CODEC_SALT_SIZE: Size of the random salt kept in the header extension
+const size_t CODEC_SALT_SIZE = 16;
+
+//CODEC_PAGE_TAG_OFFSET: Offset of the page key tag in the reserved bytes
+const size_t CODEC_PAGE_TAG_OFFSET = 28;
+
+//CODEC_REKEY_ALL: Rekey watermark once every page uses the new key
+const uint32_t CODEC_REKEY_ALL = 0xFFFFFFFF;
+
+//CODEC_FLAG_ENVELOPE: Pages use a random data key, kept in key slots
+const uint8_t CODEC_FLAG_ENVELOPE = 0x01;
+
+//CODEC_DATA_KEY_SIZE: Size of the random data key of envelope databases
+const size_t CODEC_DATA_KEY_SIZE = 32;
+
+//CODEC_KEY_SLOT_SIZE: Size of a key slot, the wrapped data key
+const size_t CODEC_KEY_SLOT_SIZE = CODEC_DATA_KEY_SIZE + 8;
+
+//CODEC_MAX_KEY_SLOTS: Key slots that fit in the reserved bytes
+const uint32_t CODEC_MAX_KEY_SLOTS = (255 - CODEC_HEADER_EXT_SIZE) / CODEC_KEY_SLOT_SIZE;
+
+//Page formats. V1 derives the IV of each page as CMAC(page number), V2
+//uses the page number directly as the XTS tweak, which is what the tweak
+//is meant for and saves a MAC per page.
+const uint8_t CODEC_FORMAT_LEGACY = 0;
+const uint8_t CODEC_FORMAT_V1 = 1;
+const uint8_t CODEC_FORMAT_V2 = 2;
+const uint8_t CODEC_FORMAT_LATEST = CODEC_FORMAT_V2;
+
+struct CodecHeader
+{
+    /**
+    * Legacy settings, used for databases without a header.
+    */
+    CodecHeader();
+
+    /**
+    * Parse the header at the start of page 1.
+    * @param data start of the database file.
+    * @param length number of bytes available at data.
+    * @return true if data starts with a valid codec header.
+    */
+    bool read(const uint8_t* data, size_t length);
+
+    /**
+    * Parse the header extension from the reserved bytes of page 1.
+    * @param data reserved bytes of page 1.
+    * @param length number of bytes available at data.
+    * @return true if the extension is valid.
+    */
+    bool readExtension(const uint8_t* data, size_t length);
+
+    /**
+    * Parse only the parts of the extension that change after the database
+    * is created: the incremental rekey state and the key slots.
+    */
+    bool readState(const uint8_t* data, size_t length);
+
+    /**
+    * Write the header and extension to plaintext parts of page 1.
+    * @param page page 1 data.
+    * @param pageSize size of the page.
+    */
+    void write(uint8_t* page, size_t pageSize) const;
+
+    /**
+    * Key tag of a page, as read from disk or about to be written.
+    * @return 0 for untagged pages and databases without an extension.
+    */
+    uint64_t pageTag(const uint8_t* page, size_t pageSize) const;
+    void writePageTag(uint8_t* page, size_t pageSize, uint64_t tag) const;
+
+    /**
+    * Put back what SQLite expects to find where the header was written.
+    * @param page page 1 data.
+    */
+    void restore(uint8_t* page) const;
+
+    bool hasHeader() const { return version != CODEC_FORMAT_LEGACY; }
+    bool hasTweakIV() const { return version >= CODEC_FORMAT_V2; }
+    bool hasExtension() const { return reserve >= CODEC_HEADER_EXT_SIZE; }
+    bool isEnvelope() const { return 0 != (flags & CODEC_FLAG_ENVELOPE); }
+
+    KdfCost kdfCost() const { return KdfCost(kdfIterations, kdfMemory, kdfLanes); }
+
+    size_t keySlotCount() const
+    {
+        return isEnvelope() ? (reserve - CODEC_HEADER_EXT_SIZE) / CODEC_KEY_SLOT_SIZE : 0;
+    }
+
+    uint8_t version;
+    uint8_t suite;
+    uint8_t kdf;
+    uint8_t flags;
+    uint32_t pageSize;
+    uint8_t reserve;
+    uint32_t kdfIterations;
+    uint32_t kdfMemory;
+    uint8_t kdfLanes;
+    SecureBytes salt;
+
+    // Incremental rekey state, see the extension layout
+    uint32_t rekeyWatermark;
+    uint64_t rekeyKeyCheck;
+
+    // Key of the pages without a tag, for lazy key rotation
+    uint64_t baseKeyCheck;
+
+    // Tag of page 1 as read with the extension, for telling a wrong key
+    // before any page is decrypted. write() leaves tags to writePageTag.
+    uint64_t page1Tag;
+
+    // Key slots of envelope databases, back to back
+    SecureBytes keySlots;
+};
+
+#endif
@@ -9,6 +9,7 @@
 #include "codec_interface.h"
 
 #include "codec.h"
+#include "kdf_cache.h"
 
 void* initializeNewCodec(void* db)
 {
@@ -20,9 +21,75 @@ void* initializeFromOtherCodec(const void* otherCodec, void* db)
     return new Codec(static_cast<const Codec*>(otherCodec), db);
 }
 
-void generateWriteKey(void* codec, const char* userPassword, int passwordLength)
+int codecSetParameter(void* codec, const char* name, const char* value)
 {
-    static_cast<Codec*>(codec)->generateWriteKey(userPassword, passwordLength);
+    return static_cast<Codec*>(codec)->setParameter(name, value);
+}
+
+int codecReadHeader(void* codec, const unsigned char* data, int length)
+{
+    return static_cast<Codec*>(codec)->readHeader(data, length);
+}
+
+int codecHeaderExtension(void* codec, int* offset, int* length)
+{
+    size_t extensionOffset = 0;
+    size_t extensionLength = 0;
+
+    if (!static_cast<Codec*>(codec)->headerExtension(extensionOffset,
+                                                     extensionLength))
+    {
+        return 0;
+    }
+
+    *offset = (int) extensionOffset;
+    *length = (int) extensionLength;
+    return 1;
+}
+
+int codecReadHeaderExtension(void* codec, const unsigned char* data, int length)
+{
+    return static_cast<Codec*>(codec)->readHeaderExtension(data, length);
+}
+
+int codecCreateHeader(void* codec, int withExtension)
+{
+    return static_cast<Codec*>(codec)->createHeader(withExtension != 0);
+}
+
+int codecGetReserve(void* codec)
+{
+    return static_cast<Codec*>(codec)->reserve();
+}
+
+int codecGetHeaderPageSize(void* codec)
+{
+    return static_cast<Codec*>(codec)->headerPageSize();
+}
+
+int codecKeyMatchesHeader(void* codec)
+{
+    return static_cast<Codec*>(codec)->keyMatchesHeader();
+}
+
+int codecIsWrongKey(void* codec)
+{
+    return static_cast<Codec*>(codec)->isWrongKey();
+}
+
+void codecSetKdfCacheCapacity(unsigned int entries)
+{
+    KdfCache::instance().setCapacity(entries);
+}
+
+int generateWriteKey(void* codec, const char* userPassword, int passwordLength)
+{
+    return static_cast<Codec*>(codec)->generateWriteKey(userPassword, passwordLength);
+}
+
+int codecGenerateRawWriteKey(void* codec, const char* rawKey, int rawKeyLength)
+{
+    return static_cast<Codec*>(codec)->generateWriteKey(rawKey, rawKeyLength, true);
 }
 
 void dropWriteKey(void* codec)
@@ -30,6 +97,16 @@ void dropWriteKey(void* codec)
     static_cast<Codec*>(codec)->dropWriteKey();
 }
 
+int codecDeriveKeyAsync(void* codec, const char* userPassword, int passwordLength)
+{
+    return static_cast<Codec*>(codec)->deriveKeyAsync(userPassword, passwordLength);
+}
+
+int codecKeyFailed(void* codec)
+{
+    return static_cast<Codec*>(codec)->keyFailed();
+}
+
 void setWriteIsRead(void* codec)
 {
     static_cast<Codec*>(codec)->setWriteIsRead();
@@ -40,6 +117,74 @@ void setReadIsWrite(void* codec)
     static_cast<Codec*>(codec)->setReadIsWrite();
 }
 
+int codecSetPendingKey(void* codec, const char* userPassword, int passwordLength)
+{
+    return static_cast<Codec*>(codec)->setPendingKey(userPassword, passwordLength);
+}
+
+unsigned int codecHasPendingKey(void* codec)
+{
+    return static_cast<Codec*>(codec)->hasPendingKey();
+}
+
+unsigned int codecRekeyInProgress(void* codec)
+{
+    return static_cast<Codec*>(codec)->rekeyInProgress();
+}
+
+unsigned int codecRekeyWatermark(void* codec)
+{
+    return static_cast<Codec*>(codec)->rekeyWatermark();
+}
+
+void codecBeginRekeyStep(void* codec, unsigned int watermark)
+{
+    // 0 marks the last step
+    static_cast<Codec*>(codec)->beginRekeyStep(0 != watermark ? watermark :
+                                                                CODEC_REKEY_ALL);
+}
+
+int codecChangeKey(void* codec, int op, const char* userPassword,
+                   int passwordLength)
+{
+    if (CODEC_KEY_ROTATE == op)
+    {
+        return static_cast<Codec*>(codec)->rotateKey(userPassword, passwordLength);
+    }
+    return static_cast<Codec*>(codec)->changeKeySlot(op, userPassword,
+                                                     passwordLength);
+}
+
+unsigned int codecIsEnvelope(void* codec)
+{
+    return static_cast<Codec*>(codec)->isEnvelope();
+}
+
+void codecEndHeaderChange(void* codec, int committed)
+{
+    static_cast<Codec*>(codec)->endHeaderChange(committed != 0);
+}
+
+int codecAddKeyringKey(void* codec, const char* userPassword, int passwordLength)
+{
+    return static_cast<Codec*>(codec)->addKeyringKey(userPassword, passwordLength);
+}
+
+unsigned int codecIsCurrentPage(void* codec, const unsigned char* data)
+{
+    return static_cast<Codec*>(codec)->isCurrentPage(data);
+}
+
+unsigned int codecSweepPage(void* codec)
+{
+    return static_cast<Codec*>(codec)->sweepPage();
+}
+
+void codecEndSweep(void* codec, unsigned int nextPage)
+{
+    static_cast<Codec*>(codec)->endSweep(nextPage);
+}
+
 unsigned char* codecEncrypt(void* codec, int page, unsigned char* data,
                             unsigned int useWriteKey)
 {
@@ -51,11 +196,72 @@ void codecDecrypt(void* codec, int page, unsigned char* data)
     static_cast<Codec*>(codec)->decrypt(page, data);
 }
 
+void codecEncryptBatch(void* codec, CodecPage* pages, int count,
+                       unsigned int useWriteKey)
+{
+    static_cast<Codec*>(codec)->encryptBatch(pages, count, useWriteKey != 0);
+}
+
+void codecDecryptBatch(void* codec, CodecPage* pages, int count)
+{
+    static_cast<Codec*>(codec)->decryptBatch(pages, count);
+}
+
+void codecPreparePages(void* codec, int firstPage, const unsigned char* raw,
+                       int count)
+{
+    static_cast<Codec*>(codec)->preparePages(firstPage, raw, count);
+}
+
+void codecClearPreparedPages(void* codec)
+{
+    static_cast<Codec*>(codec)->clearPreparedPages();
+}
+
+void codecReencryptPages(void* codec, int firstPage, unsigned char* data,
+                         int count)
+{
+    static_cast<Codec*>(codec)->reencryptPages(firstPage, data, count);
+}
+
+int codecStartWorkers(void* codec)
+{
+    return static_cast<Codec*>(codec)->startWorkers();
+}
+
+void codecStopWorkers(void* codec)
+{
+    static_cast<Codec*>(codec)->stopWorkers();
+}
+
 void setPageSize(void* codec, int pageSize)
 {
     static_cast<Codec*>(codec)->setPageSize(pageSize);
 }
 
+const char* codecCipherName(void* codec)
+{
+    // Keeps the string alive for the caller, for the lifetime of the thread
+    static thread_local string name;
+    name = static_cast<Codec*>(codec)->cipherName();
+    return name.c_str();
+}
+
+unsigned long long codecIvCacheHits(void* codec)
+{
+    return static_cast<Codec*>(codec)->ivCacheHits();
+}
+
+unsigned long long codecIvCacheMisses(void* codec)
+{
+    return static_cast<Codec*>(codec)->ivCacheMisses();
+}
+
+void codecResetStats(void* codec)
+{
+    static_cast<Codec*>(codec)->resetStats();
+}
+
 unsigned int hasReadKey(void* codec)
 {
     return static_cast<Codec*>(codec)->hasReadKey();
@@ -14,28 +14,131 @@ extern "C"
 {
 #   endif
 
+    /**
+    * A page in a batch: page number and page data, processed in place.
+    */
+    typedef struct CodecPage
+    {
+        int page;
+        unsigned char *data;
+    } CodecPage;
+
+    /**
+    * Shortest raw key, in bytes, see parseRawKey.
+    */
+#   define CODEC_MIN_RAW_KEY_SIZE 16
+
     void initializeBotan();
 
     void* initializeNewCodec(void *db);
 
     void* initializeFromOtherCodec(const void *otherCodec, void *db);
 
-    void generateWriteKey(void *codec, const char *userPassword,
-                          int passwordLength);
+    int codecSetParameter(void *codec, const char *name, const char *value);
+
+    int codecReadHeader(void *codec, const unsigned char *data, int length);
+
+    int codecHeaderExtension(void *codec, int *offset, int *length);
+
+    int codecReadHeaderExtension(void *codec, const unsigned char *data,
+                                 int length);
+
+    int codecCreateHeader(void *codec, int withExtension);
+
+    int codecGetReserve(void *codec);
+
+    int codecGetHeaderPageSize(void *codec);
+
+    int codecKeyMatchesHeader(void *codec);
+
+    int codecIsWrongKey(void *codec);
+
+    void codecSetKdfCacheCapacity(unsigned int entries);
+
+    int generateWriteKey(void *codec, const char *userPassword,
+                         int passwordLength);
+
+    int codecGenerateRawWriteKey(void *codec, const char *rawKey,
+                                 int rawKeyLength);
 
     void dropWriteKey(void *codec);
 
+    int codecDeriveKeyAsync(void *codec, const char *userPassword,
+                            int passwordLength);
+
+    int codecKeyFailed(void *codec);
+
     void setWriteIsRead(void *codec);
 
     void setReadIsWrite(void *codec);
 
+    int codecSetPendingKey(void *codec, const char *userPassword,
+                           int passwordLength);
+
+    unsigned int codecHasPendingKey(void *codec);
+
+    unsigned int codecRekeyInProgress(void *codec);
+
+    unsigned int codecRekeyWatermark(void *codec);
+
+    void codecBeginRekeyStep(void *codec, unsigned int watermark);
+
+    /**
+    * Key changes written with page 1, see codecChangeKey.
+    */
+#   define CODEC_KEY_SLOT_ADD     0
+#   define CODEC_KEY_SLOT_REMOVE  1
+#   define CODEC_KEY_SLOT_REPLACE 2
+#   define CODEC_KEY_ROTATE       3
+
+    int codecChangeKey(void *codec, int op, const char *userPassword,
+                       int passwordLength);
+
+    unsigned int codecIsEnvelope(void *codec);
+
+    void codecEndHeaderChange(void *codec, int committed);
+
+    int codecAddKeyringKey(void *codec, const char *userPassword,
+                           int passwordLength);
+
+    unsigned int codecIsCurrentPage(void *codec, const unsigned char *data);
+
+    unsigned int codecSweepPage(void *codec);
+
+    void codecEndSweep(void *codec, unsigned int nextPage);
+
     unsigned char* codecEncrypt(void *codec, int page, unsigned char *data,
                                 unsigned int useWriteKey);
 
     void codecDecrypt(void *codec, int page, unsigned char *data);
 
+    void codecEncryptBatch(void *codec, CodecPage *pages, int count,
+                           unsigned int useWriteKey);
+
+    void codecDecryptBatch(void *codec, CodecPage *pages, int count);
+
+    void codecPreparePages(void *codec, int firstPage,
+                           const unsigned char *raw, int count);
+
+    void codecClearPreparedPages(void *codec);
+
+    void codecReencryptPages(void *codec, int firstPage, unsigned char *data,
+                             int count);
+
+    int codecStartWorkers(void *codec);
+
+    void codecStopWorkers(void *codec);
+
     void setPageSize(void *codec, int pageSize);
 
+    const char* codecCipherName(void *codec);
+
+    unsigned long long codecIvCacheHits(void *codec);
+
+    unsigned long long codecIvCacheMisses(void *codec);
+
+    void codecResetStats(void *codec);
+
     unsigned int hasReadKey(void *codec);
 
     unsigned int hasWriteKey(void *codec);
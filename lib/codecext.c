@@ -13,6 +13,42 @@
 #ifdef SQLITE_HAS_CODEC
 
 #include "codec_interface.h"
+#include "sqlite3codec.h"
+
+/**
+* Number of pages sqlite3_rekey reads and decrypts at once.
+*/
+#define REKEY_BATCH_PAGES 64
+
+/**
+* Bytes sqlite3_rekey prepares at once when the cipher work is spread over
+* worker threads (rekey_threads). Every such batch is written out before
+* the next one, at the cost of a journal sync, so they are larger.
+*/
+#define REKEY_PARALLEL_BATCH_BYTES (8 * 1024 * 1024)
+
+/**
+* Milliseconds sqlite3_rekey_copy waits for other connections' locks, when
+* it starts and before it puts the copy in place.
+*/
+#define REKEY_COPY_BUSY_TIMEOUT 10000
+
+/**
+* Codec parameters that can be given as URI parameters of a database file.
+*/
+static const char* const azCodecUriParameters[] =
+{
+    "cipher",
+    "kdf",
+    "kdf_iter",
+    "kdf_time",
+    "kdf_memory",
+    "kdf_lanes",
+    "format",
+    "rekey_threads",
+    "key_slots",
+    "raw_key",
+};
 
 /**
 * Under regular `see` sqlite, this is the encryption activation module.
@@ -47,12 +83,20 @@ void sqlite3CodecSizeChange(void* codec, int pageSize, int reserve)
 * @param data the raw data to decrypt.
 * @param pageNum the current page number.
 * @param mode dictates the behaviour of the encrypt/decrypt.
-* @return unecrypted data.
+* @return unecrypted data, NULL (which the pager takes as SQLITE_NOMEM)
+* if the key derived by sqlite3_key_async failed.
 */
 void* sqlite3Codec(void* codec, void* data, Pgno pageNum, int mode)
 {
     void* outData = data;
 
+    // Without its key the database must not be read or written as
+    // plaintext
+    if (NULL != codec && codecKeyFailed(codec))
+    {
+        return NULL;
+    }
+
     //Db is encrypted
     if (NULL != codec)
     {
@@ -96,9 +140,267 @@ void* sqlite3Codec(void* codec, void* data, Pgno pageNum, int mode)
     return outData;
 }
 
+/**
+* Install a codec on a database pager.
+* The BtShared mutex is held while the codec is swapped so that connections
+* sharing the pager (shared cache) never see a codec being freed under them.
+* The codec itself is never locked, per page calls are serialised by SQLite.
+* @param db database connection.
+* @param nDb index of the database in db->aDb.
+* @param pCodec codec to install, NULL to remove encryption.
+*/
+static void codecInstall(sqlite3* db, int nDb, void* pCodec)
+{
+    Btree* pBt = db->aDb[nDb].pBt;
+
+    sqlite3BtreeEnter(pBt);
+    if (NULL != pCodec)
+    {
+        sqlite3PagerSetCodec(sqlite3BtreePager(pBt),
+                             sqlite3Codec,
+                             sqlite3CodecSizeChange,
+                             sqlite3PagerFreeCodec,
+                             pCodec);
+    }
+    else
+    {
+        sqlite3PagerSetCodec(sqlite3BtreePager(pBt), NULL, NULL, NULL, NULL);
+    }
+    sqlite3BtreeLeave(pBt);
+}
+
+/**
+* Pass codec parameters from the URI of a database file to its codec.
+* @param db database connection.
+* @param nDb index of the database in db->aDb.
+* @param pCodec codec receiving the parameters.
+* @return SQLITE_OK, or SQLITE_ERROR for an invalid parameter value.
+*/
+static int codecApplyUriParameters(sqlite3* db, int nDb, void* pCodec)
+{
+    const char* zFilename = sqlite3PagerFilename(
+        sqlite3BtreePager(db->aDb[nDb].pBt), 1);
+    int i;
+
+    if (NULL == zFilename)
+    {
+        return SQLITE_OK;
+    }
+
+    for (i = 0; i < ArraySize(azCodecUriParameters); ++i)
+    {
+        const char* zValue = sqlite3_uri_parameter(zFilename,
+                                                   azCodecUriParameters[i]);
+
+        if (NULL != zValue &&
+            !codecSetParameter(pCodec, azCodecUriParameters[i], zValue))
+        {
+            sqlite3ErrorWithMsg(db, SQLITE_ERROR, "Invalid codec parameter %s=%s",
+                                azCodecUriParameters[i], zValue);
+            return SQLITE_ERROR;
+        }
+    }
+
+    return SQLITE_OK;
+}
+
+/**
+* Read the codec header of an existing database file, or start a new one
+* for an empty file, so the key can be derived with the right parameters.
+* New databases reserve room at the end of each page for the header
+* extension.
+* @param db database connection.
+* @param nDb index of the database in db->aDb.
+* @param pCodec codec to load the header into.
+* @return SQLite error code.
+*/
+static int codecLoadHeader(sqlite3* db, int nDb, void* pCodec)
+{
+    Btree* pBt = db->aDb[nDb].pBt;
+    sqlite3_file* fd = sqlite3PagerFile(sqlite3BtreePager(pBt));
+    unsigned char header[100];
+    unsigned char extension[256];
+    sqlite3_int64 fileSize = 0;
+    int offset = 0;
+    int length = 0;
+    int rc = SQLITE_OK;
+
+    if (NULL != fd->pMethods)
+    {
+        rc = sqlite3OsFileSize(fd, &fileSize);
+    }
+
+    if (SQLITE_OK != rc)
+    {
+        return rc;
+    }
+
+    if (0 == fileSize)
+    {
+        if (SQLITE_OK != sqlite3BtreeSetPageSize(pBt, -1,
+                                                 codecCreateHeader(pCodec, 1), 0))
+        {
+            // Page size already fixed, no room for the header extension
+            codecCreateHeader(pCodec, 0);
+        }
+        return SQLITE_OK;
+    }
+
+    // A short file reads as zeros, which is not a header: legacy database
+    rc = sqlite3OsRead(fd, header, sizeof(header), 0);
+    if (SQLITE_IOERR_SHORT_READ == rc)
+    {
+        rc = SQLITE_OK;
+    }
+
+    if (SQLITE_OK != rc || !codecReadHeader(pCodec, header, sizeof(header)))
+    {
+        return rc;
+    }
+
+    // The page size and reserve are plaintext in the codec header, so page
+    // 1 is read at its size right away instead of at the default size and
+    // again once it is decrypted. Fails once page 1 was read, then the size
+    // is right already.
+    sqlite3BtreeSetPageSize(pBt, codecGetHeaderPageSize(pCodec),
+                            codecGetReserve(pCodec), 0);
+
+    if (codecHeaderExtension(pCodec, &offset, &length))
+    {
+        rc = sqlite3OsRead(fd, extension, length, offset);
+        if (SQLITE_OK == rc &&
+            !codecReadHeaderExtension(pCodec, extension, length))
+        {
+            rc = SQLITE_NOTADB;
+        }
+    }
+
+    return rc;
+}
+
+/**
+* Whether a rollback journal or WAL file sits next to a database file. Page
+* 1 on disk may then be from a transaction that was never committed, or be
+* older than the one in the WAL, so its key check says nothing yet.
+* @param db database connection, its mutex held.
+* @param nDb index of the database in db->aDb.
+* @return nonzero if either file exists, or if that cannot be told.
+*/
+static int codecHasJournal(sqlite3* db, int nDb)
+{
+    Pager* pPager = sqlite3BtreePager(db->aDb[nDb].pBt);
+    const char* zPath = sqlite3PagerFilename(pPager, 1);
+    const char* zJournal = sqlite3PagerJournalname(pPager);
+    char* zWal;
+    int exists = 0;
+    int rc = SQLITE_OK;
+
+    if (NULL == zPath || 0 == zPath[0])
+    {
+        return 0;
+    }
+
+    if (NULL != zJournal && 0 != zJournal[0])
+    {
+        rc = sqlite3OsAccess(db->pVfs, zJournal, SQLITE_ACCESS_EXISTS, &exists);
+    }
+    if (SQLITE_OK == rc && !exists)
+    {
+        zWal = sqlite3_mprintf("%s-wal", zPath);
+        if (NULL == zWal)
+        {
+            return 1;
+        }
+        rc = sqlite3OsAccess(db->pVfs, zWal, SQLITE_ACCESS_EXISTS, &exists);
+        sqlite3_free(zWal);
+    }
+
+    return SQLITE_OK != rc || exists;
+}
+
+/**
+* Key a database: read its codec header and derive the key for it.
+* @param db database connection, its mutex held.
+* @param nDb index of the database in db->aDb.
+* @param zKey password.
+* @param nKey length of the password.
+* @param isAsync if the key is derived on a background thread, see
+* codecDeriveKeyAsync. The codec is installed right away, and the pager
+* waits for the key on its first page.
+* @param isRaw if zKey is a raw key given as x'<hex>', see sqlite3_key_raw.
+* Holds for this key only, later keys are passwords unless the "raw_key"
+* parameter is set.
+* @return SQLite error code.
+*/
+static int codecAttachKey(sqlite3* db, int nDb, const void* zKey, int nKey,
+                          int isAsync, int isRaw)
+{
+    // Parameters set on an unkeyed codec through sqlite3_codec_config carry
+    // over
+    void* pConfigCodec = sqlite3PagerGetCodec(
+        sqlite3BtreePager(db->aDb[nDb].pBt));
+    void* pCodec;
+    int rc;
+
+    if (NULL != pConfigCodec && !hasReadKey(pConfigCodec))
+    {
+        pCodec = initializeFromOtherCodec(pConfigCodec, db);
+    }
+    else
+    {
+        pCodec = initializeNewCodec(db);
+    }
+
+    rc = codecApplyUriParameters(db, nDb, pCodec);
+    if (SQLITE_OK == rc)
+    {
+        rc = codecLoadHeader(db, nDb, pCodec);
+    }
+
+    if (SQLITE_OK == rc &&
+        !(isAsync ? codecDeriveKeyAsync(pCodec, (const char*) zKey, nKey) :
+          isRaw ? codecGenerateRawWriteKey(pCodec, (const char*) zKey, nKey) :
+                  generateWriteKey(pCodec, (const char*) zKey, nKey)))
+    {
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "%s",
+                            "Cipher suite not supported by this build");
+        rc = SQLITE_ERROR;
+    }
+
+    // Page 1 names its key in plaintext, so a wrong key fails here instead
+    // of when its first page decrypts to garbage. Asynchronous keys are not
+    // waited for, nor is the rollback of a hot journal: after a crash
+    // during sqlite3_rekey, page 1 may have the new key until then.
+    if (SQLITE_OK == rc && !isAsync && codecIsWrongKey(pCodec) &&
+        !codecHasJournal(db, nDb))
+    {
+        sqlite3ErrorWithMsg(db, SQLITE_NOTADB_WRONGKEY, "%s",
+                            "Wrong key for this database");
+        rc = SQLITE_NOTADB_WRONGKEY;
+    }
+
+    if (SQLITE_OK == rc)
+    {
+        if (!isAsync)
+        {
+            setReadIsWrite(pCodec);
+        }
+        codecInstall(db, nDb, pCodec);
+    }
+    else
+    {
+        deleteCodec(pCodec);
+    }
+
+    return rc;
+}
+
 int sqlite3CodecAttach(sqlite3* db, int nDb, const void* zKey, int nKey)
 {
     void* pCodec;
+    int rc = SQLITE_OK;
+
+    sqlite3_mutex_enter(db->mutex);
 
     if (NULL == zKey || nKey <= 0)
     {
@@ -107,34 +409,34 @@ int sqlite3CodecAttach(sqlite3* db, int nDb, const void* zKey, int nKey)
         if (0 != nDb && nKey < 0)
         {
             //Is an attached database, therefore use the key of main database,
-            // if main database is encrypted
+            // if main database is encrypted. The keys are derived with the
+            // main database's salt, so this is for new files (like VACUUM's
+            // temp database) or files created the same way.
             void* pMainCodec = sqlite3PagerGetCodec(
                 sqlite3BtreePager(db->aDb[0].pBt));
 
-            if (NULL != pMainCodec)
+            if (NULL != pMainCodec && hasReadKey(pMainCodec))
             {
                 pCodec = initializeFromOtherCodec(pMainCodec, db);
-                sqlite3PagerSetCodec(sqlite3BtreePager(db->aDb[nDb].pBt),
-                                     sqlite3Codec,
-                                     sqlite3CodecSizeChange,
-                                     sqlite3PagerFreeCodec,
-                                     pCodec);
+
+                // Make room for the header extension in a new file, an
+                // existing file has its page layout fixed already
+                sqlite3BtreeSetPageSize(db->aDb[nDb].pBt, -1,
+                                        codecGetReserve(pCodec), 0);
+                codecInstall(db, nDb, pCodec);
             }
         }
     }
     else
     {
-        // Key specified, setup encryption key for database
-        pCodec = initializeNewCodec(db);
-        generateWriteKey(pCodec, (const char*) zKey, nKey);
-        setReadIsWrite(pCodec);
-        sqlite3PagerSetCodec(sqlite3BtreePager(db->aDb[nDb].pBt),
-                             sqlite3Codec,
-                             sqlite3CodecSizeChange,
-                             sqlite3PagerFreeCodec, pCodec);
+        // Key specified, setup encryption key for database. The key is
+        // derived before the pager is locked.
+        rc = codecAttachKey(db, nDb, zKey, nKey, 0, 0);
     }
 
-    return SQLITE_OK;
+    sqlite3_mutex_leave(db->mutex);
+
+    return rc;
 }
 
 void sqlite3CodecGetKey(sqlite3* db, int nDb, void** zKey, int* nKey)
@@ -147,16 +449,152 @@ void sqlite3CodecGetKey(sqlite3* db, int nDb, void** zKey, int* nKey)
 
 int sqlite3_key_v2(sqlite3* db, const char* zDbName, const void* zKey, int nKey)
 {
-    //We don't use zDbName (though maybe we could...). Pass-through to the old
-    // sqlite_key
-    return sqlite3_key(db, zKey, nKey);
+    int rc = SQLITE_ERROR;
+    int nDb;
+
+    sqlite3_mutex_enter(db->mutex);
+
+    // Like sqlite3_key, the temp database is never keyed
+    nDb = sqlite3FindDbName(db, NULL != zDbName ? zDbName : "main");
+    if (nDb < 0 || 1 == nDb || NULL == db->aDb[nDb].pBt)
+    {
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "Unknown database %s", zDbName);
+    }
+    else
+    {
+        rc = sqlite3CodecAttach(db, nDb, zKey, nKey);
+    }
+
+    sqlite3_mutex_leave(db->mutex);
+
+    return rc;
+}
+
+int sqlite3_key_async(sqlite3* db, const char* zDbName, const void* zKey,
+                      int nKey)
+{
+    int rc = SQLITE_ERROR;
+    int nDb;
+
+    sqlite3_mutex_enter(db->mutex);
+
+    nDb = sqlite3FindDbName(db, NULL != zDbName ? zDbName : "main");
+    if (nDb < 0 || 1 == nDb || NULL == db->aDb[nDb].pBt)
+    {
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "Unknown database %s", zDbName);
+    }
+    else if (NULL == zKey || nKey <= 0)
+    {
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "%s", "No key given");
+    }
+    else
+    {
+        rc = codecAttachKey(db, nDb, zKey, nKey, 1, 0);
+    }
+
+    sqlite3_mutex_leave(db->mutex);
+
+    return rc;
 }
 
 int sqlite3_rekey_v2(sqlite3* db, const char* zDbName, const void* zKey, int nKey)
 {
-    //We don't use zDbName (though maybe we could...). Pass-through to the old
-    // sqlite_rekey
-    return sqlite3_rekey(db, zKey, nKey);
+    return sqlite3_rekey_v3(db, zDbName, zKey, nKey, 0, NULL, NULL);
+}
+
+int sqlite3_codec_config(sqlite3* db, const char* zDbName, const char* zParam,
+                         const char* zValue)
+{
+    int rc = SQLITE_OK;
+    int nDb;
+
+    sqlite3_mutex_enter(db->mutex);
+
+    nDb = sqlite3FindDbName(db, NULL != zDbName ? zDbName : "main");
+    if (nDb < 0 || NULL == db->aDb[nDb].pBt)
+    {
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "Unknown database %s", zDbName);
+        rc = SQLITE_ERROR;
+    }
+    else
+    {
+        Btree* pBt = db->aDb[nDb].pBt;
+        void* pCodec = sqlite3PagerGetCodec(sqlite3BtreePager(pBt));
+
+        if (NULL == pCodec)
+        {
+            // Unkeyed codec, passes pages through until the database is keyed
+            pCodec = initializeNewCodec(db);
+            codecInstall(db, nDb, pCodec);
+        }
+
+        sqlite3BtreeEnter(pBt);
+        if (NULL == zParam || NULL == zValue ||
+            !codecSetParameter(pCodec, zParam, zValue))
+        {
+            sqlite3ErrorWithMsg(db, SQLITE_ERROR, "Invalid codec parameter %s=%s",
+                                zParam, zValue);
+            rc = SQLITE_ERROR;
+        }
+        sqlite3BtreeLeave(pBt);
+    }
+
+    sqlite3_mutex_leave(db->mutex);
+
+    return rc;
+}
+
+int sqlite3_codec_status(sqlite3* db, const char* zDbName, int op,
+                         sqlite3_int64* pCurrent, int resetFlag)
+{
+    int rc = SQLITE_OK;
+    int nDb;
+
+    sqlite3_mutex_enter(db->mutex);
+
+    nDb = sqlite3FindDbName(db, NULL != zDbName ? zDbName : "main");
+    if (nDb < 0 || NULL == db->aDb[nDb].pBt)
+    {
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "Unknown database %s", zDbName);
+        rc = SQLITE_ERROR;
+    }
+    else
+    {
+        Btree* pBt = db->aDb[nDb].pBt;
+        void* pCodec;
+
+        // Counters are updated by whichever connection shares the pager
+        sqlite3BtreeEnter(pBt);
+        pCodec = sqlite3PagerGetCodec(sqlite3BtreePager(pBt));
+
+        switch (op)
+        {
+            case SQLITE_CODECSTATUS_IV_CACHE_HIT:
+                *pCurrent = NULL != pCodec ? codecIvCacheHits(pCodec) : 0;
+                break;
+            case SQLITE_CODECSTATUS_IV_CACHE_MISS:
+                *pCurrent = NULL != pCodec ? codecIvCacheMisses(pCodec) : 0;
+                break;
+            case SQLITE_CODECSTATUS_REKEY_WATERMARK:
+                *pCurrent = NULL != pCodec && codecHasPendingKey(pCodec) ?
+                            codecRekeyWatermark(pCodec) : 0;
+                break;
+            default:
+                sqlite3ErrorWithMsg(db, SQLITE_ERROR, "Unknown codec status %d", op);
+                rc = SQLITE_ERROR;
+                break;
+        }
+
+        if (SQLITE_OK == rc && resetFlag && NULL != pCodec)
+        {
+            codecResetStats(pCodec);
+        }
+        sqlite3BtreeLeave(pBt);
+    }
+
+    sqlite3_mutex_leave(db->mutex);
+
+    return rc;
 }
 
 int sqlite3_key(sqlite3* db, const void* zKey, int nKey)
@@ -165,28 +603,176 @@ int sqlite3_key(sqlite3* db, const void* zKey, int nKey)
     return sqlite3CodecAttach(db, 0, zKey, nKey);
 }
 
-int sqlite3_rekey(sqlite3* db, const void* zKey, int nKey)
+/**
+* Read pages straight from the database file and decrypt them in one batch,
+* ahead of the pager loading them one by one. This is only a shortcut: any
+* page that can't be read here is decrypted by the pager as usual.
+* @param pPager pager of the database.
+* @param pCodec codec of the database, with a read key.
+* @param nFirst first page to read.
+* @param nCount number of pages to read.
+* @param nPageSize page size of the database.
+* @param pBuffer room for nCount pages.
+*/
+static void codecPreparePageBatch(Pager* pPager, void* pCodec, Pgno nFirst,
+                                  int nCount, int nPageSize,
+                                  unsigned char* pBuffer)
+{
+    int rc = sqlite3OsRead(sqlite3PagerFile(pPager), pBuffer, nPageSize * nCount,
+                           (i64) (nFirst - 1) * nPageSize);
+
+    // A short read is zero filled, those pages won't match what the pager
+    // reads and are decrypted the regular way
+    if (SQLITE_OK == rc || SQLITE_IOERR_SHORT_READ == rc)
+    {
+        codecPreparePages(pCodec, (int) nFirst, pBuffer, nCount);
+    }
+}
+
+/**
+* Change a key slot of an envelope database, or rotate the key lazily,
+* rewriting only page 1. The page is journalled with the old header and
+* written with the new one on commit.
+* @param db database connection, with its mutex held.
+* @param nDb index of the database in db->aDb.
+* @param pCodec codec of the database.
+* @param op CODEC_KEY_* change.
+* @param zKey password of the slot, or key to rotate to.
+* @param nKey length of the password.
+* @return SQLite error code.
+*/
+static int codecRewritePage1(sqlite3* db, int nDb, void* pCodec, int op,
+                             const void* zKey, int nKey)
+{
+    Btree* pBt = db->aDb[nDb].pBt;
+    Pager* pPager = sqlite3BtreePager(pBt);
+    DbPage* pPage;
+    int rc;
+
+    sqlite3BtreeEnter(pBt);
+
+    rc = sqlite3BtreeBeginTrans(pBt, 1);
+    if (SQLITE_OK == rc)
+    {
+        rc = sqlite3PagerGet(pPager, 1, &pPage, 0);
+        if (SQLITE_OK == rc)
+        {
+            rc = sqlite3PagerWrite(pPage);
+            sqlite3PagerUnref(pPage);
+        }
+
+        if (SQLITE_OK == rc &&
+            !codecChangeKey(pCodec, op, (const char*) zKey, nKey))
+        {
+            sqlite3ErrorWithMsg(db, SQLITE_ERROR, "%s",
+                                CODEC_KEY_SLOT_ADD == op ? "No free key slot" :
+                                CODEC_KEY_SLOT_REMOVE == op ?
+                                "No other key slot opens the database" :
+                                CODEC_KEY_SLOT_REPLACE == op ?
+                                "Key slot of the current key not found" :
+                                "Key rotation needs a database with a codec "
+                                "header extension, no key slots, no rekey in "
+                                "progress and a new key");
+            rc = SQLITE_ERROR;
+        }
+        else if (SQLITE_OK == rc)
+        {
+            rc = sqlite3BtreeCommit(pBt);
+            codecEndHeaderChange(pCodec, SQLITE_OK == rc);
+        }
+
+        if (SQLITE_OK != rc)
+        {
+            sqlite3BtreeRollback(pBt, rc, 1);
+        }
+    }
+    else
+    {
+        sqlite3ErrorWithMsg(db, rc, "%s",
+                            "Error beginning key change transaction. "
+                            "Make sure that the current encryption key is "
+                            "correct.");
+    }
+
+    sqlite3BtreeLeave(pBt);
+
+    return rc;
+}
+
+/**
+* Change the encryption key of a database, rewriting every page in one
+* transaction.
+* @param db database connection.
+* @param nDb index of the database in db->aDb.
+* @param zKey new key, NULL to decrypt the database.
+* @param nKey length of the new key.
+* @param nStep pages between calls of xProgress.
+* @param xProgress progress callback, NULL for none, see sqlite3_rekey_v3.
+* @param pArg first argument of xProgress.
+* @return SQLite error code.
+*/
+static int codecRekey(sqlite3* db, int nDb, const void* zKey, int nKey,
+                      int nStep, int (*xProgress)(void*, int, int), void* pArg)
 {
     // Changes the encryption key for an existing database.
     int rc = SQLITE_ERROR;
-    Btree* pbt = db->aDb[0].pBt;
+    Btree* pbt = db->aDb[nDb].pBt;
     Pager* pPager = sqlite3BtreePager(pbt);
     void* pCodec = sqlite3PagerGetCodec(pPager);
 
-    if ((NULL == zKey || 0 == nKey) && NULL == pCodec)
+    // A codec without a read key only holds parameters, the database itself
+    // is not encrypted
+    int isEncrypted = NULL != pCodec && hasReadKey(pCodec);
+
+    if ((NULL == zKey || 0 == nKey) && !isEncrypted)
     {
         // Database not encrypted and key not specified. Do nothing
         return SQLITE_OK;
     }
 
-    if (NULL == pCodec)
+    if (isEncrypted &&
+        (codecHasPendingKey(pCodec) || codecRekeyInProgress(pCodec)))
     {
-        // Database not encrypted, but key specified. Encrypt database
-        pCodec = initializeNewCodec(db);
-        generateWriteKey(pCodec, (const char*) zKey, nKey);
+        // Pages are encrypted with two keys until sqlite3_rekey_step is done
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "%s",
+                            "Incremental rekey in progress. "
+                            "Finish it with sqlite3_rekey_step.");
+        return SQLITE_ERROR;
+    }
+
+    if (isEncrypted && NULL != zKey && 0 != nKey && codecIsEnvelope(pCodec))
+    {
+        // Pages keep the data key, only its wrapping for the password changes
+        sqlite3_mutex_enter(db->mutex);
+        rc = codecRewritePage1(db, nDb, pCodec, CODEC_KEY_SLOT_REPLACE, zKey,
+                               nKey);
+        sqlite3_mutex_leave(db->mutex);
+        return rc;
+    }
+
+    // Other shared cache connections must not run pages through the codec
+    // while its keys are being swapped
+    sqlite3_mutex_enter(db->mutex);
+    sqlite3BtreeEnter(pbt);
+
+    if (!isEncrypted)
+    {
+        // Database not encrypted, but key specified. Encrypt database. Its
+        // pages are laid out already, leaving no room for a header extension
+        pCodec = NULL != pCodec ? initializeFromOtherCodec(pCodec, db) :
+                                  initializeNewCodec(db);
+        codecCreateHeader(pCodec, 0);
+        if (!generateWriteKey(pCodec, (const char*) zKey, nKey))
+        {
+            sqlite3ErrorWithMsg(db, SQLITE_ERROR, "%s",
+                                "Cipher suite not supported by this build");
+            deleteCodec(pCodec);
+            sqlite3BtreeLeave(pbt);
+            sqlite3_mutex_leave(db->mutex);
+            return SQLITE_ERROR;
+        }
 
-        sqlite3PagerSetCodec(pPager, sqlite3Codec, sqlite3CodecSizeChange,
-                             sqlite3PagerFreeCodec, pCodec);
+        codecInstall(db, nDb, pCodec);
     }
     else if (NULL == zKey || 0 == nKey)
     {
@@ -198,7 +784,14 @@ int sqlite3_rekey(sqlite3* db, const void* zKey, int nKey)
     {
         // Database encrypted and key specified. Re-encrypt database with new key
         // Keep read key, change write key to new key
-        generateWriteKey(pCodec, (const char*) zKey, nKey);
+        if (!generateWriteKey(pCodec, (const char*) zKey, nKey))
+        {
+            sqlite3ErrorWithMsg(db, SQLITE_ERROR, "%s",
+                                "Cipher suite not supported by this build");
+            sqlite3BtreeLeave(pbt);
+            sqlite3_mutex_leave(db->mutex);
+            return SQLITE_ERROR;
+        }
     }
 
     // Start transaction
@@ -213,28 +806,89 @@ int sqlite3_rekey(sqlite3* db, const void* zKey, int nKey)
         Pgno nSkip = PAGER_MJ_PGNO(pPager);
         DbPage *pPage;
 
-        Pgno n;
+        // Encrypted pages are read and decrypted in batches ahead of the
+        // pager. Without memory for a batch, pages go one by one.
+        int nPageSize = sqlite3BtreeGetPageSize(pbt);
+
+        // With worker threads, batches are also encrypted with the new key
+        // ahead of the pager. Each batch is then written out, as a cache
+        // spill would, while its encrypted pages are still prepared. The
+        // pager still journals and writes every page itself, in order.
+        int nThreads = codecStartWorkers(pCodec);
+        int isParallel = nThreads > 1 && hasWriteKey(pCodec);
+        int nBatchPages = REKEY_BATCH_PAGES;
+        unsigned char* pBatch;
+
+        if (isParallel && REKEY_PARALLEL_BATCH_BYTES / nPageSize > nBatchPages)
+        {
+            nBatchPages = REKEY_PARALLEL_BATCH_BYTES / nPageSize;
+        }
+        pBatch = isEncrypted || isParallel ?
+            sqlite3_malloc64((sqlite3_uint64) nPageSize * nBatchPages) : NULL;
+
+        Pgno n;
         for (n = 1; rc == SQLITE_OK && n <= nPage; ++n)
         {
-            if (n == nSkip)
+            if (NULL != pBatch && 1 == n % nBatchPages)
             {
-                continue;
+                Pgno nLeft = nPage - n + 1;
+                codecPreparePageBatch(pPager, pCodec, n,
+                                      nLeft < (Pgno) nBatchPages ? (int) nLeft :
+                                                                   nBatchPages,
+                                      nPageSize, pBatch);
             }
 
-            rc = sqlite3PagerGet(pPager, n, &pPage, 0);
+            if (n != nSkip)
+            {
+                rc = sqlite3PagerGet(pPager, n, &pPage, 0);
 
-            if (!rc)
+                if (!rc)
+                {
+                    rc = sqlite3PagerWrite(pPage);
+                    sqlite3PagerUnref(pPage);
+                }
+                else
+                {
+                    sqlite3ErrorWithMsg(db, SQLITE_ERROR, "%s", 
+                                        "Error while rekeying database page. "
+                                        "Transaction Canceled.");
+                }
+            }
+
+            if (rc == SQLITE_OK && isParallel && NULL != pBatch &&
+                (0 == n % nBatchPages || n == nPage))
             {
-                rc = sqlite3PagerWrite(pPage);
-                sqlite3PagerUnref(pPage);
+                rc = sqlite3PagerFlush(pPager);
+                if (rc != SQLITE_OK)
+                {
+                    sqlite3ErrorWithMsg(db, SQLITE_ERROR, "%s",
+                                        "Error while writing rekeyed pages. "
+                                        "Transaction Canceled.");
+                }
             }
-            else
+
+            if (rc == SQLITE_OK && NULL != xProgress &&
+                (0 == n % nStep || n == nPage))
             {
-                sqlite3ErrorWithMsg(db, SQLITE_ERROR, "%s", 
-                                    "Error while rekeying database page. "
-                                    "Transaction Canceled.");
+                // Aborting rolls back like any failed page. No pausing here:
+                // the write lock is held, pausing would only hold it longer,
+                // so pacing is done between sqlite3_rekey_step calls.
+                if (xProgress(pArg, (int) n, nPageCount) < 0)
+                {
+                    rc = SQLITE_INTERRUPT;
+                    sqlite3ErrorWithMsg(db, rc, "%s",
+                                        "Rekey aborted by its progress "
+                                        "callback. Transaction Canceled.");
+                }
             }
         }
+
+        if (NULL != pBatch)
+        {
+            codecClearPreparedPages(pCodec);
+            sqlite3_free(pBatch);
+        }
+        codecStopWorkers(pCodec);
     }
     else
     {
@@ -258,7 +912,7 @@ int sqlite3_rekey(sqlite3* db, const void* zKey, int nKey)
             }
             else //No write key == no longer encrypted
             {
-                sqlite3PagerSetCodec(pPager, NULL, NULL, NULL, NULL);
+                codecInstall(db, nDb, NULL);
             }
         }
         else
@@ -281,10 +935,891 @@ int sqlite3_rekey(sqlite3* db, const void* zKey, int nKey)
         }
         else //Database wasn't encrypted to start with
         {
-            sqlite3PagerSetCodec(pPager, NULL, NULL, NULL, NULL);
+            codecInstall(db, nDb, NULL);
+        }
+    }
+
+    sqlite3BtreeLeave(pbt);
+    sqlite3_mutex_leave(db->mutex);
+
+    return rc;
+}
+
+int sqlite3_rekey(sqlite3* db, const void* zKey, int nKey)
+{
+    return codecRekey(db, 0, zKey, nKey, 0, NULL, NULL);
+}
+
+int sqlite3_rekey_v3(sqlite3* db, const char* zDbName, const void* zKey,
+                     int nKey, int nStep, int (*xProgress)(void*, int, int),
+                     void* pArg)
+{
+    int rc = SQLITE_ERROR;
+    int nDb;
+
+    sqlite3_mutex_enter(db->mutex);
+
+    // Like sqlite3_key_v2, the temp database is never keyed
+    nDb = sqlite3FindDbName(db, NULL != zDbName ? zDbName : "main");
+    if (nDb < 0 || 1 == nDb || NULL == db->aDb[nDb].pBt)
+    {
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "Unknown database %s", zDbName);
+    }
+    else
+    {
+        rc = codecRekey(db, nDb, zKey, nKey, nStep > 0 ? nStep : 1, xProgress,
+                        pArg);
+    }
+
+    sqlite3_mutex_leave(db->mutex);
+
+    return rc;
+}
+
+/**
+* Find the codec of a database by schema name, for the functions that work
+* on one keyed database.
+* @param db database connection, with its mutex held.
+* @param zDbName schema name, NULL for "main".
+* @param pnDb receives the index of the database in db->aDb.
+* @return the codec, NULL with the error set on db if the database is
+* unknown or not encrypted.
+*/
+static void* codecFindKeyed(sqlite3* db, const char* zDbName, int* pnDb)
+{
+    void* pCodec = NULL;
+    int nDb = sqlite3FindDbName(db, NULL != zDbName ? zDbName : "main");
+
+    if (nDb < 0 || NULL == db->aDb[nDb].pBt)
+    {
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "Unknown database %s", zDbName);
+        return NULL;
+    }
+
+    pCodec = sqlite3PagerGetCodec(sqlite3BtreePager(db->aDb[nDb].pBt));
+    if (NULL == pCodec || !hasReadKey(pCodec))
+    {
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "%s", "Database is not encrypted");
+        return NULL;
+    }
+
+    *pnDb = nDb;
+    return pCodec;
+}
+
+int sqlite3_rekey_begin(sqlite3* db, const char* zDbName, const void* zKey,
+                        int nKey)
+{
+    int rc = SQLITE_ERROR;
+    int nDb = 0;
+    void* pCodec;
+
+    sqlite3_mutex_enter(db->mutex);
+
+    pCodec = codecFindKeyed(db, zDbName, &nDb);
+    if (NULL != pCodec && (NULL == zKey || nKey <= 0))
+    {
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "%s",
+                            "Incremental rekey needs a key to rekey to");
+    }
+    else if (NULL != pCodec)
+    {
+        Btree* pBt = db->aDb[nDb].pBt;
+        int isInTrans = sqlite3BtreeIsInReadTrans(pBt);
+
+        // The pending key goes in before any page is read: when resuming,
+        // page 1 is below the watermark and already uses it. The rekey state
+        // to check it against was read with the plaintext header extension
+        // when the database was keyed, reading page 1 brings it up to date.
+        sqlite3BtreeEnter(pBt);
+        if (!codecSetPendingKey(pCodec, (const char*) zKey, nKey))
+        {
+            sqlite3ErrorWithMsg(db, SQLITE_ERROR, "%s",
+                                "Incremental rekey needs a database with a "
+                                "codec header extension, and no rekey to "
+                                "another key in progress");
+        }
+        else
+        {
+            rc = isInTrans ? SQLITE_OK : sqlite3BtreeBeginTrans(pBt, 0);
+            if (SQLITE_OK == rc && !isInTrans)
+            {
+                sqlite3BtreeCommit(pBt);
+            }
+        }
+        sqlite3BtreeLeave(pBt);
+    }
+
+    sqlite3_mutex_leave(db->mutex);
+
+    return rc;
+}
+
+int sqlite3_key_slot_add(sqlite3* db, const char* zDbName, const void* zKey,
+                         int nKey)
+{
+    int rc = SQLITE_ERROR;
+    int nDb = 0;
+    void* pCodec;
+
+    sqlite3_mutex_enter(db->mutex);
+
+    pCodec = codecFindKeyed(db, zDbName, &nDb);
+    if (NULL != pCodec && (!codecIsEnvelope(pCodec) || NULL == zKey || nKey <= 0))
+    {
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "%s",
+                            "Key slots need an envelope database and a key");
+    }
+    else if (NULL != pCodec)
+    {
+        rc = codecRewritePage1(db, nDb, pCodec, CODEC_KEY_SLOT_ADD, zKey, nKey);
+    }
+
+    sqlite3_mutex_leave(db->mutex);
+
+    return rc;
+}
+
+int sqlite3_key_slot_remove(sqlite3* db, const char* zDbName, const void* zKey,
+                            int nKey)
+{
+    int rc = SQLITE_ERROR;
+    int nDb = 0;
+    void* pCodec;
+
+    sqlite3_mutex_enter(db->mutex);
+
+    pCodec = codecFindKeyed(db, zDbName, &nDb);
+    if (NULL != pCodec && (!codecIsEnvelope(pCodec) || NULL == zKey || nKey <= 0))
+    {
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "%s",
+                            "Key slots need an envelope database and a key");
+    }
+    else if (NULL != pCodec)
+    {
+        rc = codecRewritePage1(db, nDb, pCodec, CODEC_KEY_SLOT_REMOVE, zKey,
+                               nKey);
+    }
+
+    sqlite3_mutex_leave(db->mutex);
+
+    return rc;
+}
+
+int sqlite3_rekey_lazy(sqlite3* db, const char* zDbName, const void* zKey,
+                       int nKey)
+{
+    int rc = SQLITE_ERROR;
+    int nDb = 0;
+    void* pCodec;
+
+    sqlite3_mutex_enter(db->mutex);
+
+    pCodec = codecFindKeyed(db, zDbName, &nDb);
+    if (NULL != pCodec && (NULL == zKey || nKey <= 0))
+    {
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "%s",
+                            "Key rotation needs a key to rotate to");
+    }
+    else if (NULL != pCodec)
+    {
+        rc = codecRewritePage1(db, nDb, pCodec, CODEC_KEY_ROTATE, zKey, nKey);
+    }
+
+    sqlite3_mutex_leave(db->mutex);
+
+    return rc;
+}
+
+int sqlite3_keyring_add(sqlite3* db, const char* zDbName, const void* zKey,
+                        int nKey)
+{
+    int rc = SQLITE_ERROR;
+    int nDb = 0;
+    void* pCodec;
+
+    sqlite3_mutex_enter(db->mutex);
+
+    pCodec = codecFindKeyed(db, zDbName, &nDb);
+    if (NULL != pCodec)
+    {
+        Btree* pBt = db->aDb[nDb].pBt;
+
+        sqlite3BtreeEnter(pBt);
+        if (NULL != zKey && nKey > 0 &&
+            codecAddKeyringKey(pCodec, (const char*) zKey, nKey))
+        {
+            rc = SQLITE_OK;
+        }
+        else
+        {
+            sqlite3ErrorWithMsg(db, SQLITE_ERROR, "%s",
+                                "Keyring needs a database with a codec header "
+                                "extension, no key slots, and a key");
+        }
+        sqlite3BtreeLeave(pBt);
+    }
+
+    sqlite3_mutex_leave(db->mutex);
+
+    return rc;
+}
+
+int sqlite3_rekey_sweep(sqlite3* db, const char* zDbName, int nPage)
+{
+    int rc = SQLITE_ERROR;
+    int nDb = 0;
+    void* pCodec;
+
+    sqlite3_mutex_enter(db->mutex);
+
+    pCodec = codecFindKeyed(db, zDbName, &nDb);
+    if (NULL != pCodec)
+    {
+        Btree* pBt = db->aDb[nDb].pBt;
+        Pager* pPager = sqlite3BtreePager(pBt);
+        int nPageSize = sqlite3BtreeGetPageSize(pBt);
+        unsigned char* pBatch = sqlite3_malloc64((sqlite3_uint64) nPageSize *
+                                                 REKEY_BATCH_PAGES);
+
+        sqlite3BtreeEnter(pBt);
+
+        rc = NULL != pBatch ? sqlite3BtreeBeginTrans(pBt, 1) : SQLITE_NOMEM;
+        if (SQLITE_OK == rc)
+        {
+            int nPageCount = -1;
+            Pgno nSkip = PAGER_MJ_PGNO(pPager);
+            Pgno n = (Pgno) codecSweepPage(pCodec);
+            Pgno nBatchFirst = 0;
+            int nDone = 0;
+            DbPage* pPage;
+
+            sqlite3PagerPagecount(pPager, &nPageCount);
+
+            // Page tags are read straight from the file. Pages the file
+            // has no current copy of (written since, or in the WAL) may be
+            // rewritten for nothing, but pages using an older key are all
+            // in the file.
+            while (SQLITE_OK == rc && n <= (Pgno) nPageCount &&
+                   (nPage < 0 || nDone < nPage))
+            {
+                unsigned char* pData;
+
+                if (0 == nBatchFirst || n >= nBatchFirst + REKEY_BATCH_PAGES)
+                {
+                    Pgno nLeft = (Pgno) nPageCount - n + 1;
+                    int nCount = nLeft < REKEY_BATCH_PAGES ? (int) nLeft :
+                                                             REKEY_BATCH_PAGES;
+
+                    // A short read is zero filled: untagged, so rewritten
+                    rc = sqlite3OsRead(sqlite3PagerFile(pPager), pBatch,
+                                       nPageSize * nCount,
+                                       (i64) (n - 1) * nPageSize);
+                    if (SQLITE_IOERR_SHORT_READ == rc)
+                    {
+                        rc = SQLITE_OK;
+                    }
+                    nBatchFirst = n;
+                }
+                pData = pBatch + (size_t) (n - nBatchFirst) * nPageSize;
+
+                if (SQLITE_OK == rc && n != nSkip &&
+                    !codecIsCurrentPage(pCodec, pData))
+                {
+                    rc = sqlite3PagerGet(pPager, n, &pPage, 0);
+                    if (SQLITE_OK == rc)
+                    {
+                        rc = sqlite3PagerWrite(pPage);
+                        sqlite3PagerUnref(pPage);
+                    }
+                    ++nDone;
+                }
+                ++n;
+            }
+
+            if (SQLITE_OK == rc)
+            {
+                rc = sqlite3BtreeCommit(pBt);
+            }
+
+            if (SQLITE_OK == rc)
+            {
+                // Once a sweep went through all pages, every page uses the
+                // write key
+                codecEndSweep(pCodec, n > (Pgno) nPageCount ? 0 : n);
+                rc = n > (Pgno) nPageCount ? SQLITE_DONE : SQLITE_OK;
+            }
+            else
+            {
+                sqlite3ErrorWithMsg(db, rc, "%s",
+                                    "Error while rewriting database pages. "
+                                    "Sweep Canceled.");
+                sqlite3BtreeRollback(pBt, rc, 1);
+            }
+        }
+        else
+        {
+            sqlite3ErrorWithMsg(db, rc, "%s",
+                                "Error beginning sweep transaction. "
+                                "Make sure that the current encryption key is "
+                                "correct.");
+        }
+
+        sqlite3BtreeLeave(pBt);
+        sqlite3_free(pBatch);
+    }
+
+    sqlite3_mutex_leave(db->mutex);
+
+    return rc;
+}
+
+int sqlite3_rekey_step(sqlite3* db, const char* zDbName, int nPage)
+{
+    int rc = SQLITE_ERROR;
+    int nDb = 0;
+    void* pCodec;
+
+    sqlite3_mutex_enter(db->mutex);
+
+    pCodec = codecFindKeyed(db, zDbName, &nDb);
+    if (NULL != pCodec && !codecHasPendingKey(pCodec))
+    {
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "%s",
+                            "No incremental rekey begun, see sqlite3_rekey_begin");
+    }
+    else if (NULL != pCodec)
+    {
+        Btree* pBt = db->aDb[nDb].pBt;
+        Pager* pPager = sqlite3BtreePager(pBt);
+
+        sqlite3BtreeEnter(pBt);
+
+        // Reading page 1 picks up steps taken by other connections, up to
+        // the last one, which leaves nothing pending
+        rc = sqlite3BtreeBeginTrans(pBt, 1);
+        if (SQLITE_OK == rc && !codecHasPendingKey(pCodec))
+        {
+            rc = sqlite3BtreeCommit(pBt);
+            if (SQLITE_OK == rc)
+            {
+                rc = SQLITE_DONE;
+            }
+        }
+        else if (SQLITE_OK == rc)
+        {
+            int nPageCount = -1;
+            Pgno nFirst = (Pgno) codecRekeyWatermark(pCodec);
+            Pgno nLast;
+            Pgno nSkip = PAGER_MJ_PGNO(pPager);
+            Pgno n;
+            u8 doNotSpill = pPager->doNotSpill;
+            DbPage* pPage;
+
+            sqlite3PagerPagecount(pPager, &nPageCount);
+            nLast = (Pgno) nPageCount;
+            if (nPage >= 0 && nFirst + (Pgno) nPage - 1 < nLast)
+            {
+                nLast = nFirst + (Pgno) nPage - 1;
+            }
+
+            // Pages of the step are journalled under the old watermark, and
+            // written under the new one on commit. A spill would write them
+            // in between, so the cache holds the whole step instead.
+            pPager->doNotSpill |= SPILLFLAG_OFF;
+
+            // Page 1 carries the watermark, the step always rewrites it
+            for (n = 1; SQLITE_OK == rc && n <= nLast; n = n < nFirst ? nFirst : n + 1)
+            {
+                if (n == nSkip)
+                {
+                    continue;
+                }
+
+                rc = sqlite3PagerGet(pPager, n, &pPage, 0);
+                if (SQLITE_OK == rc)
+                {
+                    rc = sqlite3PagerWrite(pPage);
+                    sqlite3PagerUnref(pPage);
+                }
+            }
+
+            pPager->doNotSpill = doNotSpill;
+
+            if (SQLITE_OK == rc)
+            {
+                codecBeginRekeyStep(pCodec, nLast < (Pgno) nPageCount ?
+                                            nLast + 1 : 0);
+                rc = sqlite3BtreeCommit(pBt);
+                codecEndHeaderChange(pCodec, SQLITE_OK == rc);
+
+                if (SQLITE_OK == rc && !codecHasPendingKey(pCodec))
+                {
+                    rc = SQLITE_DONE;
+                }
+            }
+
+            if (SQLITE_OK != rc && SQLITE_DONE != rc)
+            {
+                sqlite3ErrorWithMsg(db, rc, "%s",
+                                    "Error while rekeying database pages. "
+                                    "Step Canceled.");
+                sqlite3BtreeRollback(pBt, rc, 1);
+            }
+        }
+        else
+        {
+            sqlite3ErrorWithMsg(db, rc, "%s",
+                                "Error beginning rekey transaction. "
+                                "Make sure that the current encryption key is "
+                                "correct.");
         }
+
+        sqlite3BtreeLeave(pBt);
+    }
+
+    sqlite3_mutex_leave(db->mutex);
+
+    return rc;
+}
+
+/**
+* Replace a database file with a copy of it, for sqlite3_rekey_copy. The
+* replacement is durable once this returns SQLITE_OK: on POSIX systems the
+* directory holding the file is synced after the rename, which a crash
+* could undo otherwise.
+* @param zCopy copy to rename.
+* @param zPath database file to replace.
+* @return SQLITE_OK, SQLITE_IOERR if the copy could not be renamed, or
+* SQLITE_IOERR_DIR_FSYNC if the rename could not be synced.
+*/
+static int codecReplaceFile(const char* zCopy, const char* zPath)
+{
+#if SQLITE_OS_WIN
+    return MoveFileExA(zCopy, zPath, MOVEFILE_REPLACE_EXISTING |
+                                     MOVEFILE_WRITE_THROUGH) ?
+           SQLITE_OK : SQLITE_IOERR;
+#else
+    const char* zSlash = strrchr(zPath, '/');
+    char* zDir;
+    int fd;
+    int rc;
+
+    if (0 != rename(zCopy, zPath))
+    {
+        return SQLITE_IOERR;
+    }
+
+    // The directory of a file in the current one is "."
+    zDir = NULL != zSlash ? sqlite3_mprintf("%.*s", (int) (zSlash - zPath) + 1, zPath) :
+                            sqlite3_mprintf(".");
+    if (NULL == zDir)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    fd = open(zDir, O_RDONLY);
+    rc = fd >= 0 && 0 == fsync(fd) ? SQLITE_OK : SQLITE_IOERR_DIR_FSYNC;
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    sqlite3_free(zDir);
+    return rc;
+#endif
+}
+
+/**
+* Copy every page of the main database into a new file, encrypted with the
+* write key, then put the copy in place of the database. The caller holds
+* a write transaction on the database, so no page changes meanwhile.
+* @param db database connection, with its mutex held.
+* @param pCodec codec of the main database, with the new write key.
+* @return SQLite error code.
+*/
+// Connections that opened the database before it was replaced still have
+// the old file open. Its page 1 is zeroed, while the exclusive lock is
+// held, so that they see a changed file and fail with SQLITE_NOTADB on
+// their next transaction instead of reading or writing a file nobody opens.
+static int codecPoisonOldFile(Pager* pPager, int nPageSize)
+{
+    sqlite3_file* pFile = sqlite3PagerFile(pPager);
+    void* pZero = sqlite3MallocZero(nPageSize);
+    int rc;
+
+    if (NULL == pZero)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    rc = sqlite3OsWrite(pFile, pZero, nPageSize, 0);
+    if (SQLITE_OK == rc)
+    {
+        rc = sqlite3OsSync(pFile, SQLITE_SYNC_NORMAL);
+    }
+    sqlite3_free(pZero);
+
+    return rc;
+}
+
+static int codecCopyRekeyed(sqlite3* db, void* pCodec)
+{
+    Btree* pBt = db->aDb[0].pBt;
+    Pager* pPager = sqlite3BtreePager(pBt);
+    sqlite3_vfs* pVfs = db->pVfs;
+    const char* zPath = sqlite3PagerFilename(pPager, 1);
+    int nPath = sqlite3Strlen30(zPath);
+    int nPageSize = sqlite3BtreeGetPageSize(pBt);
+    int nPageCount = -1;
+    int nThreads = codecStartWorkers(pCodec);
+    int nBatchPages = REKEY_BATCH_PAGES;
+    unsigned char* pBatch;
+    sqlite3_file* pCopy = NULL;
+    Pgno n;
+    int rc;
+
+    // Double nul terminated, VFSs look for URI parameters past the name
+    char* zCopy = sqlite3MallocZero(nPath + 8);
+
+    if (nThreads > 1 && REKEY_PARALLEL_BATCH_BYTES / nPageSize > nBatchPages)
+    {
+        nBatchPages = REKEY_PARALLEL_BATCH_BYTES / nPageSize;
+    }
+    pBatch = sqlite3_malloc64((sqlite3_uint64) nPageSize * nBatchPages);
+
+    sqlite3PagerPagecount(pPager, &nPageCount);
+
+    if (NULL == zCopy || NULL == pBatch)
+    {
+        rc = SQLITE_NOMEM;
+    }
+    else
+    {
+        memcpy(zCopy, zPath, nPath);
+        memcpy(zCopy + nPath, "-rekey", 6);
+
+        // A copy left behind by an earlier attempt is overwritten
+        rc = sqlite3OsOpenMalloc(pVfs, zCopy, &pCopy,
+                                 SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                                 SQLITE_OPEN_MAIN_DB, NULL);
+        if (SQLITE_OK == rc)
+        {
+            rc = sqlite3OsTruncate(pCopy, 0);
+        }
+    }
+
+    // Pages are read straight from the file: in rollback journal mode,
+    // with the write lock held, it has the current version of every page
+    for (n = 1; SQLITE_OK == rc && n <= (Pgno) nPageCount; n += nBatchPages)
+    {
+        Pgno nLeft = (Pgno) nPageCount - n + 1;
+        int nCount = nLeft < (Pgno) nBatchPages ? (int) nLeft : nBatchPages;
+        i64 iOffset = (i64) (n - 1) * nPageSize;
+
+        rc = sqlite3OsRead(sqlite3PagerFile(pPager), pBatch,
+                           nPageSize * nCount, iOffset);
+        if (SQLITE_OK == rc)
+        {
+            codecReencryptPages(pCodec, (int) n, pBatch, nCount);
+            rc = sqlite3OsWrite(pCopy, pBatch, nPageSize * nCount, iOffset);
+        }
+    }
+
+    codecStopWorkers(pCodec);
+    sqlite3_free(pBatch);
+
+    if (SQLITE_OK == rc)
+    {
+        rc = sqlite3OsSync(pCopy, SQLITE_SYNC_NORMAL);
+    }
+    if (NULL != pCopy)
+    {
+        sqlite3OsCloseFree(pCopy);
+    }
+
+    // Readers of other connections keep the old file until they are gone
+    if (SQLITE_OK == rc)
+    {
+        rc = sqlite3PagerExclusiveLock(pPager);
+    }
+    if (SQLITE_OK == rc)
+    {
+        rc = codecReplaceFile(zCopy, zPath);
+        if (SQLITE_OK != rc)
+        {
+            sqlite3OsDelete(pVfs, zCopy, 0);
+        }
+        else
+        {
+            rc = codecPoisonOldFile(pPager, nPageSize);
+            if (SQLITE_OK != rc)
+            {
+                sqlite3ErrorWithMsg(db, rc, "%s",
+                                    "Database rekeyed, but connections that "
+                                    "have the old file open were not stopped");
+            }
+            sqlite3_free(zCopy);
+            return rc;
+        }
+    }
+    else if (NULL != zCopy)
+    {
+        sqlite3OsDelete(pVfs, zCopy, 0);
+    }
+    sqlite3_free(zCopy);
+
+    if (SQLITE_OK != rc)
+    {
+        sqlite3ErrorWithMsg(db, rc, "%s",
+                            "Error while copying database pages. "
+                            "Rekey Canceled.");
+    }
+
+    return rc;
+}
+
+int sqlite3_rekey_copy(const char* zFilename, const void* zKey, int nKey,
+                       const void* zNewKey, int nNewKey, char** pzErrMsg)
+{
+    sqlite3* db = NULL;
+    void* pCodec = NULL;
+    int nDb = 0;
+    int rc;
+
+    if (NULL != pzErrMsg)
+    {
+        *pzErrMsg = NULL;
+    }
+
+    rc = sqlite3_open_v2(zFilename, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_URI,
+                         NULL);
+    if (SQLITE_OK == rc)
+    {
+        sqlite3_busy_timeout(db, REKEY_COPY_BUSY_TIMEOUT);
+        rc = sqlite3_key(db, zKey, nKey);
+    }
+
+    if (SQLITE_OK == rc)
+    {
+        sqlite3_mutex_enter(db->mutex);
+
+        pCodec = codecFindKeyed(db, "main", &nDb);
+        if (NULL == pCodec)
+        {
+            rc = SQLITE_ERROR;
+        }
+        else if (NULL == zNewKey || nNewKey <= 0 || codecIsEnvelope(pCodec) ||
+                 codecHasPendingKey(pCodec) || codecRekeyInProgress(pCodec))
+        {
+            sqlite3ErrorWithMsg(db, SQLITE_ERROR, "%s",
+                                "Rekey by copy needs a new key, and a database "
+                                "without key slots or an incremental rekey in "
+                                "progress");
+            rc = SQLITE_ERROR;
+        }
+        else
+        {
+            Btree* pBt = db->aDb[0].pBt;
+
+            sqlite3BtreeEnter(pBt);
+
+            // Writers wait until the copy is in place, readers go on
+            rc = sqlite3BtreeBeginTrans(pBt, 1);
+            if (SQLITE_OK != rc)
+            {
+                sqlite3ErrorWithMsg(db, rc, "%s",
+                                    "Error beginning rekey transaction. "
+                                    "Make sure that the current encryption key "
+                                    "is correct.");
+            }
+            else if (PAGER_JOURNALMODE_WAL ==
+                    sqlite3PagerGetJournalMode(sqlite3BtreePager(pBt)))
+            {
+                sqlite3ErrorWithMsg(db, SQLITE_ERROR, "%s",
+                                    "Rekey by copy needs a database in "
+                                    "rollback journal mode");
+                rc = SQLITE_ERROR;
+            }
+            else if (!generateWriteKey(pCodec, (const char*) zNewKey, nNewKey))
+            {
+                sqlite3ErrorWithMsg(db, SQLITE_ERROR, "%s",
+                                    "Cipher suite not supported by this build");
+                rc = SQLITE_ERROR;
+            }
+            else
+            {
+                rc = codecCopyRekeyed(db, pCodec);
+                setWriteIsRead(pCodec);
+            }
+
+            // Nothing was written to the database itself
+            sqlite3BtreeRollback(pBt, SQLITE_OK, 0);
+            sqlite3BtreeLeave(pBt);
+        }
+
+        sqlite3_mutex_leave(db->mutex);
+    }
+
+    if (SQLITE_OK != rc && NULL != pzErrMsg && NULL != db)
+    {
+        *pzErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    }
+    sqlite3_close(db);
+
+    return rc;
+}
+
+int sqlite3_codec_kdf_cache(int nEntries)
+{
+    if (nEntries < 0)
+    {
+        return SQLITE_ERROR;
+    }
+
+    codecSetKdfCacheCapacity((unsigned int) nEntries);
+    return SQLITE_OK;
+}
+
+int sqlite3_key_handle_create(sqlite3* db, const char* zDbName,
+                              sqlite3_key_handle** ppHandle)
+{
+    int rc = SQLITE_ERROR;
+    int nDb = 0;
+    void* pCodec;
+
+    *ppHandle = NULL;
+
+    sqlite3_mutex_enter(db->mutex);
+
+    pCodec = codecFindKeyed(db, zDbName, &nDb);
+    if (NULL != pCodec)
+    {
+        Btree* pBt = db->aDb[nDb].pBt;
+
+        // A copy of the codec, with keys and parameters but no connection
+        sqlite3BtreeEnter(pBt);
+        *ppHandle = (sqlite3_key_handle*) initializeFromOtherCodec(pCodec, NULL);
+        sqlite3BtreeLeave(pBt);
+        rc = SQLITE_OK;
+    }
+
+    sqlite3_mutex_leave(db->mutex);
+
+    return rc;
+}
+
+int sqlite3_key_handle_apply(sqlite3* db, const char* zDbName,
+                             sqlite3_key_handle* pHandle)
+{
+    int rc = SQLITE_ERROR;
+    int nDb;
+
+    sqlite3_mutex_enter(db->mutex);
+
+    nDb = sqlite3FindDbName(db, NULL != zDbName ? zDbName : "main");
+    if (nDb < 0 || 1 == nDb || NULL == db->aDb[nDb].pBt)
+    {
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "Unknown database %s", zDbName);
+    }
+    else if (NULL != pHandle)
+    {
+        void* pCodec = initializeFromOtherCodec(pHandle, db);
+
+        // The keys were derived with the salt of the database the handle
+        // was made from, which must be this one
+        rc = codecLoadHeader(db, nDb, pCodec);
+        if (SQLITE_OK == rc && !codecKeyMatchesHeader(pCodec))
+        {
+            sqlite3ErrorWithMsg(db, SQLITE_ERROR, "%s",
+                                "Key handle was made for another database");
+            rc = SQLITE_ERROR;
+        }
+
+        if (SQLITE_OK == rc)
+        {
+            codecInstall(db, nDb, pCodec);
+        }
+        else
+        {
+            deleteCodec(pCodec);
+        }
+    }
+
+    sqlite3_mutex_leave(db->mutex);
+
+    return rc;
+}
+
+void sqlite3_key_handle_free(sqlite3_key_handle* pHandle)
+{
+    if (NULL != pHandle)
+    {
+        deleteCodec(pHandle);
+    }
+}
+
+
+int sqlite3_key_raw(sqlite3* db, const char* zDbName, const void* pKey, int nKey)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char* key = (const unsigned char*) pKey;
+    int nLiteral;
+    char* zLiteral;
+    int rc = SQLITE_ERROR;
+    int nDb;
+    int i;
+
+    // Shorter keys are passwords, see parseRawKey
+    if (nKey < CODEC_MIN_RAW_KEY_SIZE)
+    {
+        sqlite3_mutex_enter(db->mutex);
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "Raw keys have at least %d bytes",
+                            CODEC_MIN_RAW_KEY_SIZE);
+        sqlite3_mutex_leave(db->mutex);
+        return SQLITE_ERROR;
+    }
+
+    // The hex literal has to fit in an int, like any SQLite string
+    if (nKey > (SQLITE_MAX_LENGTH - 3) / 2)
+    {
+        sqlite3_mutex_enter(db->mutex);
+        sqlite3ErrorWithMsg(db, SQLITE_TOOBIG, "%s", "Raw key too long");
+        sqlite3_mutex_leave(db->mutex);
+        return SQLITE_TOOBIG;
+    }
+
+    nLiteral = 2 * nKey + 3;
+    zLiteral = (char*) sqlite3_malloc(nLiteral);
+    if (NULL == zLiteral)
+    {
+        return SQLITE_NOMEM;
+    }
+
+    // Passed on as x'<hex>', the form the codec takes raw keys in
+    zLiteral[0] = 'x';
+    zLiteral[1] = '\'';
+    for (i = 0; i < nKey; ++i)
+    {
+        zLiteral[2 + 2 * i] = hex[key[i] >> 4];
+        zLiteral[3 + 2 * i] = hex[key[i] & 0x0f];
+    }
+    zLiteral[nLiteral - 1] = '\'';
+
+    // Like sqlite3_key_v2, with the raw key form for this key only
+    sqlite3_mutex_enter(db->mutex);
+    nDb = sqlite3FindDbName(db, NULL != zDbName ? zDbName : "main");
+    if (nDb < 0 || 1 == nDb || NULL == db->aDb[nDb].pBt)
+    {
+        sqlite3ErrorWithMsg(db, SQLITE_ERROR, "Unknown database %s", zDbName);
+    }
+    else
+    {
+        rc = codecAttachKey(db, nDb, zLiteral, nLiteral, 0, 1);
     }
+    sqlite3_mutex_leave(db->mutex);
 
+    memset(zLiteral, 0, nLiteral);
+    sqlite3_free(zLiteral);
     return rc;
 }
 
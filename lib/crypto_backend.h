@@ -0,0 +1,210 @@
+/*
+ * Crypto backend interface for SQLite3 encryption codec.
+ * (C) 2010 Olivier de Gaalon
+ * (C) 2016 Archibald Neil MacDonald
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#ifndef CRYPTO_BACKEND_H_
+#define CRYPTO_BACKEND_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cipher_suite.h"
+
+using namespace std;
+
+/*The codec only talks to the crypto library through this interface, so it
+ *can be built against different libraries. Exactly one backend is compiled
+ *in, chosen with BOTANSQLITE3_CRYPTO_BACKEND in lib/CMakeLists.txt:
+ *  botan    crypto_backend_botan.cpp, supports every suite
+ *  openssl  crypto_backend_openssl.cpp, libcrypto, AES suites only
+ *
+ *A backend provides the page cipher, the MAC used to derive the IV of each
+ *page, the KDF and its PRF, AES key wrap and random numbers. Objects it creates are keyed once and
+ *then process pages without allocating.*/
+
+/**
+* Allocator that wipes memory before releasing it, for key material.
+*/
+template<typename T>
+struct SecureAllocator
+{
+    typedef T value_type;
+
+    SecureAllocator() { }
+    template<typename U> SecureAllocator(const SecureAllocator<U>&) { }
+
+    T* allocate(size_t n)
+    {
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        volatile unsigned char* bytes = reinterpret_cast<volatile unsigned char*>(p);
+        for (size_t i = 0; i < n * sizeof(T); ++i)
+        {
+            bytes[i] = 0;
+        }
+        ::operator delete(p);
+    }
+};
+
+template<typename T, typename U>
+bool operator==(const SecureAllocator<T>&, const SecureAllocator<U>&) { return true; }
+
+template<typename T, typename U>
+bool operator!=(const SecureAllocator<T>&, const SecureAllocator<U>&) { return false; }
+
+typedef std::vector<uint8_t, SecureAllocator<uint8_t>> SecureBytes;
+
+namespace CryptoBackend
+{
+    /**
+    * Block cipher mode for a single key, e.g. AES-256/XTS.
+    */
+    class Cipher
+    {
+    public:
+        virtual ~Cipher() { }
+
+        /**
+        * Encrypt data in place.
+        * @param iv IV, or tweak, of ivLength() bytes.
+        * @param data data to encrypt.
+        * @param length number of bytes, at least one cipher block.
+        */
+        virtual void encrypt(const uint8_t* iv, uint8_t* data, size_t length) = 0;
+        virtual void decrypt(const uint8_t* iv, uint8_t* data, size_t length) = 0;
+
+        /**
+        * Encrypt several buffers of the same length in place, each with its
+        * own IV. Backends with multi-buffer implementations interleave the
+        * buffers, others process them one after the other.
+        * @param ivs count IVs of ivLength() bytes, back to back.
+        * @param data count buffers.
+        * @param length length of each buffer.
+        * @param count number of buffers.
+        */
+        virtual void encryptBatch(const uint8_t* ivs, uint8_t* const* data,
+                                  size_t length, size_t count)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                encrypt(ivs + i * ivLength(), data[i], length);
+            }
+        }
+
+        virtual void decryptBatch(const uint8_t* ivs, uint8_t* const* data,
+                                  size_t length, size_t count)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                decrypt(ivs + i * ivLength(), data[i], length);
+            }
+        }
+
+        virtual size_t ivLength() const = 0;
+
+        /**
+        * Implementation picked for this CPU, e.g. "aesni" or "base".
+        */
+        virtual string provider() const = 0;
+    };
+
+    /**
+    * Message authentication code for a single key, e.g. CMAC(AES-256).
+    */
+    class Mac
+    {
+    public:
+        virtual ~Mac() { }
+
+        /**
+        * @param data message.
+        * @param length length of the message.
+        * @param out receives outputLength() bytes.
+        */
+        virtual void compute(const uint8_t* data, size_t length, uint8_t* out) = 0;
+
+        virtual size_t outputLength() const = 0;
+    };
+
+    /**
+    * Name of the compiled in backend.
+    */
+    const char* name();
+
+    /**
+    * Whether the backend has the cipher and MAC of a suite.
+    */
+    bool supports(const CipherSuite& suite);
+
+    bool supports(const KdfAlgorithm& kdf);
+
+    /**
+    * Whether the CPU has instructions for AES that the backend uses.
+    */
+    bool hasHardwareAes();
+
+    /**
+    * @return the keyed cipher of the suite, nullptr if not supported.
+    */
+    std::unique_ptr<Cipher> createCipher(const CipherSuite& suite,
+                                         const uint8_t* key, size_t keyLength);
+
+    /**
+    * @return the keyed IV derivation MAC of the suite, nullptr if not supported.
+    */
+    std::unique_ptr<Mac> createMac(const CipherSuite& suite,
+                                   const uint8_t* key, size_t keyLength);
+
+    /**
+    * @return the PRF of a KDF (KdfAlgorithm::prf) keyed with a passphrase,
+    * nullptr if not supported or the KDF has none.
+    */
+    std::unique_ptr<Mac> createKdfPrf(const KdfAlgorithm& kdf,
+                                      const char* password,
+                                      size_t passwordLength);
+
+    /**
+    * Derive key material from a passphrase.
+    * @return false if the KDF is not supported, or its cost is out of the
+    * range it takes.
+    */
+    bool deriveKey(const KdfAlgorithm& kdf,
+                   const char* password, size_t passwordLength,
+                   const uint8_t* salt, size_t saltLength,
+                   const KdfCost& cost,
+                   uint8_t* out, size_t outLength);
+
+    /**
+    * Wrap a key with AES key wrap (RFC 3394).
+    * @param kek key encryption key, 16, 24 or 32 bytes.
+    * @param key key to wrap, a multiple of 8 bytes, at least 16.
+    * @param out receives keyLength + 8 bytes.
+    */
+    void wrapKey(const uint8_t* kek, size_t kekLength,
+                 const uint8_t* key, size_t keyLength, uint8_t* out);
+
+    /**
+    * Unwrap a key wrapped by wrapKey.
+    * @param out receives wrappedLength - 8 bytes.
+    * @return false if the key encryption key does not match.
+    */
+    bool unwrapKey(const uint8_t* kek, size_t kekLength,
+                   const uint8_t* wrapped, size_t wrappedLength, uint8_t* out);
+
+    /**
+    * Fill a buffer with cryptographically secure random bytes.
+    */
+    void randomize(uint8_t* out, size_t length);
+}
+
+#endif
@@ -0,0 +1,282 @@
+/*
+ * Botan crypto backend for SQLite3 encryption codec.
+ * (C) 2010 Olivier de Gaalon
+ * (C) 2016 Archibald Neil MacDonald
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#include "crypto_backend.h"
+#include "xts_kernel.h"
+
+#include <botan/botan.h>
+#include <botan/auto_rng.h>
+#include <botan/cipher_mode.h>
+#include <botan/cpuid.h>
+#include <botan/mac.h>
+#include <botan/pbkdf.h>
+#if defined(BOTAN_HAS_ARGON2)
+    #include <botan/pwdhash.h>
+#endif
+#include <botan/rfc3394.h>
+#include <cstring>
+
+namespace
+{
+    class BotanCipher : public CryptoBackend::Cipher
+    {
+    public:
+        BotanCipher(const CipherSuite& suite, const uint8_t* key, size_t keyLength) :
+            m_encipher(Botan::get_cipher_mode(suite.cipher, Botan::ENCRYPTION)),
+            m_decipher(Botan::get_cipher_mode(suite.cipher, Botan::DECRYPTION))
+        {
+            m_encipher->set_key(key, keyLength);
+            m_decipher->set_key(key, keyLength);
+
+            if (CIPHER_SUITE_AES_XTS == suite.id)
+            {
+                m_kernel = AesXtsKernel::create(key, keyLength);
+            }
+
+            m_tail.reserve(m_encipher->update_granularity() +
+                           m_encipher->minimum_final_size());
+        }
+
+        void encrypt(const uint8_t* iv, uint8_t* data, size_t length) override
+        {
+            process(*m_encipher, iv, data, length);
+        }
+
+        void decrypt(const uint8_t* iv, uint8_t* data, size_t length) override
+        {
+            process(*m_decipher, iv, data, length);
+        }
+
+        void encryptBatch(const uint8_t* ivs, uint8_t* const* data,
+                          size_t length, size_t count) override
+        {
+            // The kernel has no ciphertext stealing for partial blocks
+            if (m_kernel && 0 == length % 16)
+            {
+                m_kernel->encrypt(ivs, data, length, count);
+            }
+            else
+            {
+                CryptoBackend::Cipher::encryptBatch(ivs, data, length, count);
+            }
+        }
+
+        void decryptBatch(const uint8_t* ivs, uint8_t* const* data,
+                          size_t length, size_t count) override
+        {
+            if (m_kernel && 0 == length % 16)
+            {
+                m_kernel->decrypt(ivs, data, length, count);
+            }
+            else
+            {
+                CryptoBackend::Cipher::decryptBatch(ivs, data, length, count);
+            }
+        }
+
+        size_t ivLength() const override
+        {
+            return m_encipher->default_nonce_length();
+        }
+
+        string provider() const override
+        {
+            return m_kernel ? m_encipher->provider() + "+" + m_kernel->name() :
+                              m_encipher->provider();
+        }
+
+    private:
+        void process(Botan::Cipher_Mode& mode, const uint8_t* iv, uint8_t* data,
+                     size_t length)
+        {
+            mode.start(iv, ivLength());
+
+            // Bulk of the page is processed in place, only the tail goes
+            // through finish(). XTS steals ciphertext from the last full
+            // block, so the tail keeps at least minimum_final_size() bytes
+            // besides a partial block, as on page 1 of envelope databases
+            // with an odd number of key slots.
+            const size_t granularity = mode.update_granularity();
+            const size_t minimumFinal = mode.minimum_final_size();
+            const size_t bulk = length > minimumFinal ?
+                (length - minimumFinal) / granularity * granularity : 0;
+            mode.process(data, bulk);
+
+            if (bulk < length)
+            {
+                m_tail.assign(data + bulk, data + length);
+                mode.finish(m_tail);
+                memcpy(data + bulk, m_tail.data(), m_tail.size());
+            }
+        }
+
+    private:
+        std::unique_ptr<Botan::Cipher_Mode> m_encipher;
+        std::unique_ptr<Botan::Cipher_Mode> m_decipher;
+
+        // Multi-buffer AES-XTS for batches, nullptr if the CPU has none
+        std::unique_ptr<AesXtsKernel> m_kernel;
+
+        // Reserved on construction, so processing a page never allocates
+        Botan::secure_vector<uint8_t> m_tail;
+    };
+
+    class BotanMac : public CryptoBackend::Mac
+    {
+    public:
+        BotanMac(const string& name, const uint8_t* key, size_t keyLength) :
+            m_mac(Botan::MessageAuthenticationCode::create(name))
+        {
+            m_mac->set_key(key, keyLength);
+        }
+
+        void compute(const uint8_t* data, size_t length, uint8_t* out) override
+        {
+            m_mac->update(data, length);
+            m_mac->final(out);
+        }
+
+        size_t outputLength() const override
+        {
+            return m_mac->output_length();
+        }
+
+    private:
+        std::unique_ptr<Botan::MessageAuthenticationCode> m_mac;
+    };
+}
+
+const char* CryptoBackend::name()
+{
+    return "botan";
+}
+
+bool CryptoBackend::supports(const CipherSuite& suite)
+{
+    return true;
+}
+
+bool CryptoBackend::supports(const KdfAlgorithm& kdf)
+{
+    // Argon2 came with Botan 2.11
+#if defined(BOTAN_HAS_ARGON2)
+    return true;
+#else
+    return !kdf.isMemoryHard();
+#endif
+}
+
+bool CryptoBackend::hasHardwareAes()
+{
+    // Botan picks the AES implementation at runtime from CPUID: AES-NI (or
+    // VAES where the library supports it), then SSSE3, then portable code
+#if defined(BOTAN_TARGET_CPU_IS_X86_FAMILY)
+    return Botan::CPUID::has_aes_ni();
+#elif defined(BOTAN_TARGET_CPU_IS_ARM_FAMILY)
+    return Botan::CPUID::has_arm_aes();
+#else
+    return false;
+#endif
+}
+
+std::unique_ptr<CryptoBackend::Cipher> CryptoBackend::createCipher(
+    const CipherSuite& suite, const uint8_t* key, size_t keyLength)
+{
+    return std::unique_ptr<Cipher>(new BotanCipher(suite, key, keyLength));
+}
+
+std::unique_ptr<CryptoBackend::Mac> CryptoBackend::createMac(
+    const CipherSuite& suite, const uint8_t* key, size_t keyLength)
+{
+    return std::unique_ptr<Mac>(new BotanMac(suite.mac, key, keyLength));
+}
+
+std::unique_ptr<CryptoBackend::Mac> CryptoBackend::createKdfPrf(
+    const KdfAlgorithm& kdf, const char* password, size_t passwordLength)
+{
+    if (kdf.prf.empty())
+    {
+        return nullptr;
+    }
+    return std::unique_ptr<Mac>(new BotanMac(kdf.prf,
+                                             reinterpret_cast<const uint8_t*>(password),
+                                             passwordLength));
+}
+
+bool CryptoBackend::deriveKey(const KdfAlgorithm& kdf,
+                              const char* password, size_t passwordLength,
+                              const uint8_t* salt, size_t saltLength,
+                              const KdfCost& cost,
+                              uint8_t* out, size_t outLength)
+{
+    if (kdf.isMemoryHard())
+    {
+#if defined(BOTAN_HAS_ARGON2)
+        std::unique_ptr<Botan::PasswordHashFamily> family(
+            Botan::PasswordHashFamily::create(kdf.pbkdf));
+        if (!family || 0 == cost.lanes || cost.memory < 8 * cost.lanes)
+        {
+            return false;
+        }
+
+        std::unique_ptr<Botan::PasswordHash> hash(
+            family->from_params(cost.memory, cost.iterations, cost.lanes));
+        hash->derive_key(out, outLength, password, passwordLength,
+                         salt, saltLength);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    std::unique_ptr<Botan::PBKDF> pbkdf(Botan::PBKDF::create(kdf.pbkdf));
+    if (!pbkdf)
+    {
+        return false;
+    }
+
+    Botan::SymmetricKey key = pbkdf->derive_key(outLength,
+                                                std::string(password, passwordLength),
+                                                salt, saltLength, cost.iterations);
+    memcpy(out, key.begin(), outLength);
+    return true;
+}
+
+void CryptoBackend::wrapKey(const uint8_t* kek, size_t kekLength,
+                            const uint8_t* key, size_t keyLength, uint8_t* out)
+{
+    Botan::secure_vector<uint8_t> wrapped = Botan::rfc3394_keywrap(
+        Botan::secure_vector<uint8_t>(key, key + keyLength),
+        Botan::SymmetricKey(kek, kekLength));
+    memcpy(out, wrapped.data(), wrapped.size());
+}
+
+bool CryptoBackend::unwrapKey(const uint8_t* kek, size_t kekLength,
+                              const uint8_t* wrapped, size_t wrappedLength,
+                              uint8_t* out)
+{
+    try
+    {
+        Botan::secure_vector<uint8_t> key = Botan::rfc3394_keyunwrap(
+            Botan::secure_vector<uint8_t>(wrapped, wrapped + wrappedLength),
+            Botan::SymmetricKey(kek, kekLength));
+        memcpy(out, key.data(), key.size());
+        return true;
+    }
+    catch (const Botan::Exception&)
+    {
+        // Integrity check failed: another key encryption key
+        return false;
+    }
+}
+
+void CryptoBackend::randomize(uint8_t* out, size_t length)
+{
+    Botan::AutoSeeded_RNG rng;
+    rng.randomize(out, length);
+}
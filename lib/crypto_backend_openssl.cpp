@@ -0,0 +1,495 @@
+/*
+ * OpenSSL libcrypto backend for SQLite3 encryption codec.
+ * (C) 2010 Olivier de Gaalon
+ * (C) 2016 Archibald Neil MacDonald
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#include "crypto_backend.h"
+#include "xts_kernel.h"
+
+#include <openssl/evp.h>
+#include <openssl/opensslv.h>
+#include <openssl/rand.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    #include <openssl/core_names.h>
+    #include <openssl/kdf.h>
+    #include <openssl/params.h>
+#else
+    #include <openssl/cmac.h>
+    #include <openssl/hmac.h>
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x30200000L
+    #include <openssl/thread.h>
+#endif
+
+#include <stdexcept>
+
+/*libcrypto has no Twofish, so only the AES suites are available, and it
+ *has Argon2id from OpenSSL 3.2 on. OpenSSL dispatches AES at runtime from
+ *CPUID itself (AES-NI, VAES, ARMv8, or its portable code).*/
+
+namespace
+{
+    const size_t AES_BLOCK_SIZE = 16;
+    const size_t SHA256_SIZE = 32;
+
+    class OpenSslCipher : public CryptoBackend::Cipher
+    {
+    public:
+        OpenSslCipher(const uint8_t* key, size_t keyLength) :
+            m_encipher(EVP_CIPHER_CTX_new()),
+            m_decipher(EVP_CIPHER_CTX_new()),
+            m_kernel(AesXtsKernel::create(key, keyLength))
+        {
+            if (nullptr == m_encipher || nullptr == m_decipher ||
+                64 != keyLength ||
+                1 != EVP_EncryptInit_ex(m_encipher, EVP_aes_256_xts(), nullptr, key, nullptr) ||
+                1 != EVP_DecryptInit_ex(m_decipher, EVP_aes_256_xts(), nullptr, key, nullptr))
+            {
+                EVP_CIPHER_CTX_free(m_encipher);
+                EVP_CIPHER_CTX_free(m_decipher);
+                throw std::runtime_error("Cannot key AES-256/XTS");
+            }
+        }
+
+        ~OpenSslCipher()
+        {
+            EVP_CIPHER_CTX_free(m_encipher);
+            EVP_CIPHER_CTX_free(m_decipher);
+        }
+
+        void encrypt(const uint8_t* iv, uint8_t* data, size_t length) override
+        {
+            // XTS takes each data unit in a single update, keyed contexts
+            // only need the new tweak
+            int outLength = 0;
+            EVP_EncryptInit_ex(m_encipher, nullptr, nullptr, nullptr, iv);
+            EVP_EncryptUpdate(m_encipher, data, &outLength, data, (int) length);
+        }
+
+        void decrypt(const uint8_t* iv, uint8_t* data, size_t length) override
+        {
+            int outLength = 0;
+            EVP_DecryptInit_ex(m_decipher, nullptr, nullptr, nullptr, iv);
+            EVP_DecryptUpdate(m_decipher, data, &outLength, data, (int) length);
+        }
+
+        void encryptBatch(const uint8_t* ivs, uint8_t* const* data,
+                          size_t length, size_t count) override
+        {
+            // The kernel has no ciphertext stealing for partial blocks
+            if (m_kernel && 0 == length % AES_BLOCK_SIZE)
+            {
+                m_kernel->encrypt(ivs, data, length, count);
+            }
+            else
+            {
+                CryptoBackend::Cipher::encryptBatch(ivs, data, length, count);
+            }
+        }
+
+        void decryptBatch(const uint8_t* ivs, uint8_t* const* data,
+                          size_t length, size_t count) override
+        {
+            if (m_kernel && 0 == length % AES_BLOCK_SIZE)
+            {
+                m_kernel->decrypt(ivs, data, length, count);
+            }
+            else
+            {
+                CryptoBackend::Cipher::decryptBatch(ivs, data, length, count);
+            }
+        }
+
+        size_t ivLength() const override
+        {
+            return AES_BLOCK_SIZE;
+        }
+
+        string provider() const override
+        {
+            return m_kernel ? string("libcrypto+") + m_kernel->name() : "libcrypto";
+        }
+
+    private:
+        OpenSslCipher(const OpenSslCipher&);
+        OpenSslCipher& operator=(const OpenSslCipher&);
+
+        EVP_CIPHER_CTX* m_encipher;
+        EVP_CIPHER_CTX* m_decipher;
+
+        // Multi-buffer AES-XTS for batches, nullptr if the CPU has none
+        std::unique_ptr<AesXtsKernel> m_kernel;
+    };
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    class OpenSslMac : public CryptoBackend::Mac
+    {
+    public:
+        OpenSslMac(const uint8_t* key, size_t keyLength) :
+            m_mac(EVP_MAC_fetch(nullptr, "CMAC", nullptr)),
+            m_ctx(nullptr)
+        {
+            char cipherName[] = "AES-256-CBC";
+            OSSL_PARAM params[] =
+            {
+                OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_CIPHER, cipherName, 0),
+                OSSL_PARAM_construct_end()
+            };
+
+            if (nullptr == m_mac ||
+                nullptr == (m_ctx = EVP_MAC_CTX_new(m_mac)) ||
+                1 != EVP_MAC_init(m_ctx, key, keyLength, params))
+            {
+                EVP_MAC_CTX_free(m_ctx);
+                EVP_MAC_free(m_mac);
+                throw std::runtime_error("Cannot key CMAC(AES-256)");
+            }
+        }
+
+        ~OpenSslMac()
+        {
+            EVP_MAC_CTX_free(m_ctx);
+            EVP_MAC_free(m_mac);
+        }
+
+        void compute(const uint8_t* data, size_t length, uint8_t* out) override
+        {
+            // Restarting with a NULL key reuses the key schedule
+            size_t outLength = 0;
+            EVP_MAC_init(m_ctx, nullptr, 0, nullptr);
+            EVP_MAC_update(m_ctx, data, length);
+            EVP_MAC_final(m_ctx, out, &outLength, AES_BLOCK_SIZE);
+        }
+
+        size_t outputLength() const override
+        {
+            return AES_BLOCK_SIZE;
+        }
+
+    private:
+        OpenSslMac(const OpenSslMac&);
+        OpenSslMac& operator=(const OpenSslMac&);
+
+        EVP_MAC* m_mac;
+        EVP_MAC_CTX* m_ctx;
+    };
+
+    class OpenSslHmac : public CryptoBackend::Mac
+    {
+    public:
+        OpenSslHmac(const uint8_t* key, size_t keyLength) :
+            m_mac(EVP_MAC_fetch(nullptr, "HMAC", nullptr)),
+            m_ctx(nullptr)
+        {
+            char digestName[] = "SHA256";
+            OSSL_PARAM params[] =
+            {
+                OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digestName, 0),
+                OSSL_PARAM_construct_end()
+            };
+
+            if (nullptr == m_mac ||
+                nullptr == (m_ctx = EVP_MAC_CTX_new(m_mac)) ||
+                1 != EVP_MAC_init(m_ctx, key, keyLength, params))
+            {
+                EVP_MAC_CTX_free(m_ctx);
+                EVP_MAC_free(m_mac);
+                throw std::runtime_error("Cannot key HMAC(SHA-256)");
+            }
+        }
+
+        ~OpenSslHmac()
+        {
+            EVP_MAC_CTX_free(m_ctx);
+            EVP_MAC_free(m_mac);
+        }
+
+        void compute(const uint8_t* data, size_t length, uint8_t* out) override
+        {
+            // Restarting with a NULL key reuses the padded key states
+            size_t outLength = 0;
+            EVP_MAC_init(m_ctx, nullptr, 0, nullptr);
+            EVP_MAC_update(m_ctx, data, length);
+            EVP_MAC_final(m_ctx, out, &outLength, SHA256_SIZE);
+        }
+
+        size_t outputLength() const override
+        {
+            return SHA256_SIZE;
+        }
+
+    private:
+        OpenSslHmac(const OpenSslHmac&);
+        OpenSslHmac& operator=(const OpenSslHmac&);
+
+        EVP_MAC* m_mac;
+        EVP_MAC_CTX* m_ctx;
+    };
+#else
+    class OpenSslMac : public CryptoBackend::Mac
+    {
+    public:
+        OpenSslMac(const uint8_t* key, size_t keyLength) :
+            m_ctx(CMAC_CTX_new())
+        {
+            if (nullptr == m_ctx ||
+                1 != CMAC_Init(m_ctx, key, keyLength, EVP_aes_256_cbc(), nullptr))
+            {
+                CMAC_CTX_free(m_ctx);
+                throw std::runtime_error("Cannot key CMAC(AES-256)");
+            }
+        }
+
+        ~OpenSslMac()
+        {
+            CMAC_CTX_free(m_ctx);
+        }
+
+        void compute(const uint8_t* data, size_t length, uint8_t* out) override
+        {
+            // Restarting with a NULL key reuses the key schedule
+            size_t outLength = 0;
+            CMAC_Init(m_ctx, nullptr, 0, nullptr, nullptr);
+            CMAC_Update(m_ctx, data, length);
+            CMAC_Final(m_ctx, out, &outLength);
+        }
+
+        size_t outputLength() const override
+        {
+            return AES_BLOCK_SIZE;
+        }
+
+    private:
+        OpenSslMac(const OpenSslMac&);
+        OpenSslMac& operator=(const OpenSslMac&);
+
+        CMAC_CTX* m_ctx;
+    };
+
+    class OpenSslHmac : public CryptoBackend::Mac
+    {
+    public:
+        OpenSslHmac(const uint8_t* key, size_t keyLength) :
+            m_ctx(HMAC_CTX_new())
+        {
+            if (nullptr == m_ctx ||
+                1 != HMAC_Init_ex(m_ctx, key, (int) keyLength, EVP_sha256(), nullptr))
+            {
+                HMAC_CTX_free(m_ctx);
+                throw std::runtime_error("Cannot key HMAC(SHA-256)");
+            }
+        }
+
+        ~OpenSslHmac()
+        {
+            HMAC_CTX_free(m_ctx);
+        }
+
+        void compute(const uint8_t* data, size_t length, uint8_t* out) override
+        {
+            // Restarting with a NULL key reuses the padded key states
+            unsigned int outLength = 0;
+            HMAC_Init_ex(m_ctx, nullptr, 0, nullptr, nullptr);
+            HMAC_Update(m_ctx, data, length);
+            HMAC_Final(m_ctx, out, &outLength);
+        }
+
+        size_t outputLength() const override
+        {
+            return SHA256_SIZE;
+        }
+
+    private:
+        OpenSslHmac(const OpenSslHmac&);
+        OpenSslHmac& operator=(const OpenSslHmac&);
+
+        HMAC_CTX* m_ctx;
+    };
+#endif
+}
+
+const char* CryptoBackend::name()
+{
+    return "openssl";
+}
+
+bool CryptoBackend::supports(const CipherSuite& suite)
+{
+    return CIPHER_SUITE_AES_XTS == suite.id;
+}
+
+bool CryptoBackend::supports(const KdfAlgorithm& kdf)
+{
+    // Argon2 came with OpenSSL 3.2
+#if OPENSSL_VERSION_NUMBER >= 0x30200000L
+    return KDF_PBKDF2_SHA256 == kdf.id || KDF_ARGON2ID == kdf.id;
+#else
+    return KDF_PBKDF2_SHA256 == kdf.id;
+#endif
+}
+
+bool CryptoBackend::hasHardwareAes()
+{
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_cpu_supports("aes");
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
+    return true;
+#else
+    return false;
+#endif
+}
+
+std::unique_ptr<CryptoBackend::Cipher> CryptoBackend::createCipher(
+    const CipherSuite& suite, const uint8_t* key, size_t keyLength)
+{
+    if (!supports(suite))
+    {
+        return nullptr;
+    }
+    return std::unique_ptr<Cipher>(new OpenSslCipher(key, keyLength));
+}
+
+std::unique_ptr<CryptoBackend::Mac> CryptoBackend::createMac(
+    const CipherSuite& suite, const uint8_t* key, size_t keyLength)
+{
+    if (!supports(suite))
+    {
+        return nullptr;
+    }
+    return std::unique_ptr<Mac>(new OpenSslMac(key, keyLength));
+}
+
+std::unique_ptr<CryptoBackend::Mac> CryptoBackend::createKdfPrf(
+    const KdfAlgorithm& kdf, const char* password, size_t passwordLength)
+{
+    if (KDF_PBKDF2_SHA256 != kdf.id)
+    {
+        return nullptr;
+    }
+    return std::unique_ptr<Mac>(new OpenSslHmac(
+        reinterpret_cast<const uint8_t*>(password), passwordLength));
+}
+
+bool CryptoBackend::deriveKey(const KdfAlgorithm& kdf,
+                              const char* password, size_t passwordLength,
+                              const uint8_t* salt, size_t saltLength,
+                              const KdfCost& cost,
+                              uint8_t* out, size_t outLength)
+{
+    if (!supports(kdf))
+    {
+        return false;
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30200000L
+    if (KDF_ARGON2ID == kdf.id)
+    {
+        if (0 == cost.lanes || cost.memory < 8u * cost.lanes)
+        {
+            return false;
+        }
+
+        // A lane per thread. The thread limit is a setting of the library
+        // context, so each derivation gets a context of its own rather than
+        // changing the default one of the whole process. Where OpenSSL is
+        // built without threads the limit cannot be set, and the lanes are
+        // derived one after another on this thread: same output, more time.
+        std::unique_ptr<OSSL_LIB_CTX, void(*)(OSSL_LIB_CTX*)>
+            libctx(OSSL_LIB_CTX_new(), OSSL_LIB_CTX_free);
+        if (nullptr == libctx)
+        {
+            return false;
+        }
+        uint32_t threads = cost.lanes;
+        if (1 != OSSL_set_max_threads(libctx.get(), cost.lanes))
+        {
+            threads = 1;
+        }
+
+        std::unique_ptr<EVP_KDF, void(*)(EVP_KDF*)>
+            argon2(EVP_KDF_fetch(libctx.get(), "ARGON2ID", nullptr), EVP_KDF_free);
+        std::unique_ptr<EVP_KDF_CTX, void(*)(EVP_KDF_CTX*)>
+            ctx(EVP_KDF_CTX_new(argon2.get()), EVP_KDF_CTX_free);
+        uint32_t iterations = cost.iterations;
+        uint32_t memory = cost.memory;
+        uint32_t lanes = cost.lanes;
+        OSSL_PARAM params[] =
+        {
+            OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_PASSWORD,
+                                              const_cast<char*>(password),
+                                              passwordLength),
+            OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SALT,
+                                              const_cast<uint8_t*>(salt),
+                                              saltLength),
+            OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ITER, &iterations),
+            OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ARGON2_MEMCOST, &memory),
+            OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ARGON2_LANES, &lanes),
+            OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_THREADS, &threads),
+            OSSL_PARAM_construct_end()
+        };
+        return nullptr != ctx &&
+               1 == EVP_KDF_derive(ctx.get(), out, outLength, params);
+    }
+#endif
+
+    return 1 == PKCS5_PBKDF2_HMAC(password, (int) passwordLength,
+                                  salt, (int) saltLength, (int) cost.iterations,
+                                  EVP_sha256(), (int) outLength, out);
+}
+
+namespace
+{
+    const EVP_CIPHER* keyWrapCipher(size_t kekLength)
+    {
+        switch (kekLength)
+        {
+        case 16: return EVP_aes_128_wrap();
+        case 24: return EVP_aes_192_wrap();
+        default: return EVP_aes_256_wrap();
+        }
+    }
+
+    bool runKeyWrap(bool wrap, const uint8_t* kek, size_t kekLength,
+                    const uint8_t* in, size_t inLength, uint8_t* out)
+    {
+        std::unique_ptr<EVP_CIPHER_CTX, void(*)(EVP_CIPHER_CTX*)>
+            ctx(EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free);
+        int length = 0;
+
+        // Key wrap modes are refused unless asked for explicitly
+        EVP_CIPHER_CTX_set_flags(ctx.get(), EVP_CIPHER_CTX_FLAG_WRAP_ALLOW);
+        return 1 == EVP_CipherInit_ex(ctx.get(), keyWrapCipher(kekLength),
+                                      nullptr, kek, nullptr, wrap ? 1 : 0) &&
+               0 < EVP_CipherUpdate(ctx.get(), out, &length, in, (int) inLength);
+    }
+}
+
+void CryptoBackend::wrapKey(const uint8_t* kek, size_t kekLength,
+                            const uint8_t* key, size_t keyLength, uint8_t* out)
+{
+    if (!runKeyWrap(true, kek, kekLength, key, keyLength, out))
+    {
+        throw std::runtime_error("AES key wrap failed");
+    }
+}
+
+bool CryptoBackend::unwrapKey(const uint8_t* kek, size_t kekLength,
+                              const uint8_t* wrapped, size_t wrappedLength,
+                              uint8_t* out)
+{
+    // Fails the integrity check for another key encryption key
+    return runKeyWrap(false, kek, kekLength, wrapped, wrappedLength, out);
+}
+
+void CryptoBackend::randomize(uint8_t* out, size_t length)
+{
+    if (1 != RAND_bytes(out, (int) length))
+    {
+        throw std::runtime_error("No random numbers available");
+    }
+}
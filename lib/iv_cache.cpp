@@ -0,0 +1,73 @@
+/*
+ * Page IV cache for SQLite3 encryption codec.
+ * (C) 2010 Olivier de Gaalon
+ * (C) 2016 Archibald Neil MacDonald
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#include "iv_cache.h"
+
+#include <cstring>
+
+IvCache::IvCache(size_t entries, size_t ivLength) :
+    m_pages(entries, 0),
+    m_ivs(entries * ivLength),
+    m_ivLength(ivLength),
+    m_mask(entries - 1),
+
+    m_hits(0),
+    m_misses(0)
+{ }
+
+const uint8_t* IvCache::find(uint32_t page)
+{
+    const size_t home = homeSlot(page);
+    for (size_t i = 0; i < IV_CACHE_PROBES; ++i)
+    {
+        const size_t slot = (home + i) & m_mask;
+        if (m_pages[slot] == page)
+        {
+            ++m_hits;
+            return m_ivs.data() + slot * m_ivLength;
+        }
+        if (0 == m_pages[slot])
+        {
+            // Slots are never emptied, so the page can't be further on
+            break;
+        }
+    }
+
+    ++m_misses;
+    return nullptr;
+}
+
+void IvCache::insert(uint32_t page, const uint8_t* iv)
+{
+    const size_t home = homeSlot(page);
+    size_t slot = home;
+    for (size_t i = 0; i < IV_CACHE_PROBES; ++i)
+    {
+        const size_t probe = (home + i) & m_mask;
+        if (0 == m_pages[probe] || m_pages[probe] == page)
+        {
+            slot = probe;
+            break;
+        }
+    }
+
+    m_pages[slot] = page;
+    memcpy(m_ivs.data() + slot * m_ivLength, iv, m_ivLength);
+}
+
+void IvCache::resetStats()
+{
+    m_hits = 0;
+    m_misses = 0;
+}
+
+size_t IvCache::homeSlot(uint32_t page) const
+{
+    // Fibonacci hashing, spreads runs of consecutive pages over the table
+    return (size_t) ((page * 2654435761u) >> 16) & m_mask;
+}
@@ -0,0 +1,73 @@
+/*
+ * Page IV cache for SQLite3 encryption codec.
+ * (C) 2010 Olivier de Gaalon
+ * (C) 2016 Archibald Neil MacDonald
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#ifndef IV_CACHE_H_
+#define IV_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "crypto_backend.h"
+
+using namespace std;
+
+//IV_CACHE_ENTRIES: Number of page IVs remembered per key, a power of two.
+//About 20 bytes each.
+const size_t IV_CACHE_ENTRIES = 1024;
+
+//IV_CACHE_PROBES: Slots searched from a page's home slot before the home
+//slot is overwritten.
+const size_t IV_CACHE_PROBES = 4;
+
+/**
+* Bounded cache of derived page IVs for a single key, so hot pages skip the
+* MAC that derives their IV. A flat open addressed table: page numbers are
+* kept apart from the IVs so probing stays within one or two cache lines.
+* Everything is allocated on construction.
+*/
+class IvCache
+{
+public:
+    /**
+    * @param entries number of entries, a power of two.
+    * @param ivLength length of each IV in bytes.
+    */
+    IvCache(size_t entries, size_t ivLength);
+
+    /**
+    * @param page page number.
+    * @return the cached IV of the page, nullptr if not cached.
+    */
+    const uint8_t* find(uint32_t page);
+
+    /**
+    * Remember the IV of a page, evicting another page if the slots it may
+    * use are all taken.
+    */
+    void insert(uint32_t page, const uint8_t* iv);
+
+    uint64_t hits() const { return m_hits; }
+    uint64_t misses() const { return m_misses; }
+    void resetStats();
+
+private:
+    size_t homeSlot(uint32_t page) const;
+
+private:
+    // Page number of each slot, 0 for empty slots (pages start at 1)
+    std::vector<uint32_t> m_pages;
+    SecureBytes m_ivs;
+    size_t m_ivLength;
+    size_t m_mask;
+
+    uint64_t m_hits;
+    uint64_t m_misses;
+};
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * Process wide derived key cache for SQLite3 encryption codec.
+ * (C) 2010 Olivier de Gaalon
+ * (C) 2016 Archibald Neil MacDonald
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#include "kdf_cache.h"
+#include "pbkdf2.h"
+
+#include <cstring>
+
+KdfCache::KdfCache() :
+    m_capacity(0)
+{ }
+
+KdfCache& KdfCache::instance()
+{
+    static KdfCache cache;
+    return cache;
+}
+
+void KdfCache::setCapacity(size_t entries)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_capacity = entries;
+    while (m_entries.size() > m_capacity)
+    {
+        m_entries.pop_back();
+    }
+}
+
+size_t KdfCache::capacity() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_capacity;
+}
+
+bool KdfCache::deriveKey(const KdfAlgorithm& kdf,
+                         const char* password, size_t passwordLength,
+                         const uint8_t* salt, size_t saltLength,
+                         const KdfCost& cost,
+                         uint8_t* out, size_t outLength)
+{
+    if (0 == capacity())
+    {
+        return deriveKeyParallel(kdf, password, passwordLength,
+                                 salt, saltLength, cost,
+                                 out, outLength);
+    }
+
+    // The parameters salt the identifier, so each derivation has its own
+    SecureBytes idSalt(salt, salt + saltLength);
+    const uint8_t parameters[15] = { kdf.id,
+                                     (uint8_t) (cost.iterations >> 24),
+                                     (uint8_t) (cost.iterations >> 16),
+                                     (uint8_t) (cost.iterations >> 8),
+                                     (uint8_t) cost.iterations,
+                                     (uint8_t) (cost.memory >> 24),
+                                     (uint8_t) (cost.memory >> 16),
+                                     (uint8_t) (cost.memory >> 8),
+                                     (uint8_t) cost.memory,
+                                     cost.lanes,
+                                     (uint8_t) (outLength >> 24),
+                                     (uint8_t) (outLength >> 16),
+                                     (uint8_t) (outLength >> 8),
+                                     (uint8_t) outLength,
+                                     (uint8_t) saltLength };
+    idSalt.insert(idSalt.end(), parameters, parameters + sizeof(parameters));
+
+    uint8_t id[KDF_CACHE_ID_SIZE];
+    if (!CryptoBackend::deriveKey(*findKdf(KDF_PBKDF2_SHA256), password,
+                                  passwordLength, idSalt.data(), idSalt.size(),
+                                  KdfCost(1), id, sizeof(id)))
+    {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (std::list<Entry>::iterator it = m_entries.begin();
+             it != m_entries.end(); ++it)
+        {
+            if (0 == memcmp(it->id, id, sizeof(id)))
+            {
+                memcpy(out, it->key.data(), outLength);
+                m_entries.splice(m_entries.begin(), m_entries, it);
+                return true;
+            }
+        }
+    }
+
+    if (!deriveKeyParallel(kdf, password, passwordLength,
+                           salt, saltLength, cost,
+                           out, outLength))
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (0 == m_capacity)
+    {
+        return true;
+    }
+
+    // Another thread may have derived the same key meanwhile, the newest
+    // entry is found first either way
+    m_entries.push_front(Entry());
+    memcpy(m_entries.front().id, id, sizeof(id));
+    m_entries.front().key.assign(out, out + outLength);
+    while (m_entries.size() > m_capacity)
+    {
+        m_entries.pop_back();
+    }
+    return true;
+}
@@ -0,0 +1,73 @@
+/*
+ * Process wide derived key cache for SQLite3 encryption codec.
+ * (C) 2010 Olivier de Gaalon
+ * (C) 2016 Archibald Neil MacDonald
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#ifndef KDF_CACHE_H_
+#define KDF_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+
+#include "crypto_backend.h"
+
+using namespace std;
+
+//KDF_CACHE_ID_SIZE: Size of the identifier of a cached derivation
+const size_t KDF_CACHE_ID_SIZE = 32;
+
+/**
+* Bounded, least recently used cache of KDF outputs shared by every codec
+* of the process, so opening the same database again skips the KDF. Off
+* (no entries) unless sqlite3_codec_kdf_cache sets a capacity.
+*
+* Entries are found by an identifier derived from the password, salt and
+* KDF parameters with a single PBKDF2 iteration, so passwords themselves
+* are never kept. The derived keys are, until evicted or the cache is
+* turned off, in memory that is wiped on release.
+*/
+class KdfCache
+{
+public:
+    static KdfCache& instance();
+
+    /**
+    * Set the number of entries, 0 to turn the cache off. Entries past the
+    * new capacity are dropped.
+    */
+    void setCapacity(size_t entries);
+    size_t capacity() const;
+
+    /**
+    * CryptoBackend::deriveKey, answered from the cache when possible.
+    * @return false if the KDF is not supported.
+    */
+    bool deriveKey(const KdfAlgorithm& kdf,
+                   const char* password, size_t passwordLength,
+                   const uint8_t* salt, size_t saltLength,
+                   const KdfCost& cost,
+                   uint8_t* out, size_t outLength);
+
+private:
+    KdfCache();
+
+    struct Entry
+    {
+        uint8_t id[KDF_CACHE_ID_SIZE];
+        SecureBytes key;
+    };
+
+    // Most recently used first
+    std::list<Entry> m_entries;
+    size_t m_capacity;
+
+    // Derivations run outside the lock, only lookups hold it
+    mutable std::mutex m_mutex;
+};
+
+#endif
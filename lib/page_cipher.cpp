@@ -0,0 +1,223 @@
+/*
+ * Pre-keyed page cipher for SQLite3 encryption codec.
+ * (C) 2010 Olivier de Gaalon
+ * (C) 2016 Archibald Neil MacDonald
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#include "page_cipher.h"
+
+#include <algorithm>
+#include <cstring>
+
+PageCipher::PageCipher(const CodecHeader& header, const SecureBytes& key,
+                       const SecureBytes& ivKey) :
+    m_header(header),
+    m_suite(*findCipherSuite(header.suite)),
+
+    m_key(key),
+    m_ivKey(ivKey),
+
+    m_cipher(CryptoBackend::createCipher(m_suite, m_key.data(), m_key.size()))
+{
+    if (!m_header.hasTweakIV())
+    {
+        m_cmac = CryptoBackend::createMac(m_suite, m_ivKey.data(), m_ivKey.size());
+        m_ivCache.reset(new IvCache(IV_CACHE_ENTRIES, m_cipher->ivLength()));
+    }
+
+    m_iv.resize(m_cipher->ivLength());
+    m_batchIvs.resize(PAGE_BATCH_SIZE * m_cipher->ivLength());
+
+    // Sized once here, setState only copies into it
+    m_header.keySlots.resize(m_header.keySlotCount() * CODEC_KEY_SLOT_SIZE);
+
+    m_keyCheck = computeKeyCheck();
+}
+
+uint64_t PageCipher::ivCacheHits() const
+{
+    return m_ivCache ? m_ivCache->hits() : 0;
+}
+
+uint64_t PageCipher::ivCacheMisses() const
+{
+    return m_ivCache ? m_ivCache->misses() : 0;
+}
+
+void PageCipher::resetStats()
+{
+    if (m_ivCache)
+    {
+        m_ivCache->resetStats();
+    }
+}
+
+uint64_t PageCipher::computeKeyCheck()
+{
+    uint8_t block[16] = { 0 };
+    memset(m_iv.data(), 0, m_iv.size());
+    m_cipher->encrypt(m_iv.data(), block, sizeof(block));
+
+    uint64_t check = 0;
+    for (size_t i = 0; i < 8; ++i)
+    {
+        check = (check << 8) | block[i];
+    }
+    return check;
+}
+
+void PageCipher::setState(const CodecHeader& state)
+{
+    m_header.rekeyWatermark = state.rekeyWatermark;
+    m_header.rekeyKeyCheck = state.rekeyKeyCheck;
+    m_header.baseKeyCheck = state.baseKeyCheck;
+
+    // Copy into the slots sized by the constructor, page 1 writes do not
+    // allocate
+    std::copy_n(state.keySlots.begin(),
+                std::min(m_header.keySlots.size(), state.keySlots.size()),
+                m_header.keySlots.begin());
+}
+
+void PageCipher::encrypt(uint32_t page, uint8_t* data, size_t pageSize)
+{
+    getIVForPage(page, m_iv.data());
+    m_cipher->encrypt(m_iv.data(), data + encryptedOffset(page),
+                      encryptedLength(page, pageSize));
+
+    finishEncrypt(page, data, pageSize);
+}
+
+void PageCipher::decrypt(uint32_t page, uint8_t* data, size_t pageSize)
+{
+    getIVForPage(page, m_iv.data());
+    m_cipher->decrypt(m_iv.data(), data + encryptedOffset(page),
+                      encryptedLength(page, pageSize));
+
+    if (1 == page && m_header.hasHeader())
+    {
+        m_header.restore(data);
+    }
+}
+
+void PageCipher::encryptBatch(const CodecPage* pages, size_t count,
+                              size_t pageSize)
+{
+    processBatch(true, pages, count, pageSize);
+}
+
+void PageCipher::decryptBatch(const CodecPage* pages, size_t count,
+                              size_t pageSize)
+{
+    processBatch(false, pages, count, pageSize);
+}
+
+void PageCipher::processBatch(bool encrypt, const CodecPage* pages,
+                              size_t count, size_t pageSize)
+{
+    const size_t ivLength = m_iv.size();
+
+    // Pages other than page 1 all have the same encrypted region
+    const size_t length = pageSize - m_header.reserve;
+    size_t batched = 0;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        const uint32_t page = (uint32_t) pages[i].page;
+
+        // Page 1 may have a plaintext header, and so a shorter region
+        if (0 != encryptedOffset(page))
+        {
+            encrypt ? this->encrypt(page, pages[i].data, pageSize) :
+                      decrypt(page, pages[i].data, pageSize);
+            continue;
+        }
+
+        getIVForPage(page, m_batchIvs.data() + batched * ivLength);
+        m_batchData[batched] = pages[i].data;
+
+        if (encrypt)
+        {
+            finishEncrypt(page, pages[i].data, pageSize);
+        }
+
+        if (PAGE_BATCH_SIZE == ++batched)
+        {
+            flushBatch(encrypt, length, batched);
+            batched = 0;
+        }
+    }
+
+    flushBatch(encrypt, length, batched);
+}
+
+void PageCipher::flushBatch(bool encrypt, size_t length, size_t count)
+{
+    if (0 == count)
+    {
+        return;
+    }
+
+    if (encrypt)
+    {
+        m_cipher->encryptBatch(m_batchIvs.data(), m_batchData, length, count);
+    }
+    else
+    {
+        m_cipher->decryptBatch(m_batchIvs.data(), m_batchData, length, count);
+    }
+}
+
+void PageCipher::finishEncrypt(uint32_t page, uint8_t* data, size_t pageSize)
+{
+    if (m_header.hasHeader())
+    {
+        // Never leave whatever was in the reserved bytes on disk
+        memset(data + pageSize - m_header.reserve, 0, m_header.reserve);
+
+        if (1 == page)
+        {
+            m_header.write(data, pageSize);
+        }
+        m_header.writePageTag(data, pageSize, m_keyCheck);
+    }
+}
+
+size_t PageCipher::encryptedOffset(uint32_t page) const
+{
+    return 1 == page && m_header.hasHeader() ? CODEC_HEADER_SIZE : 0;
+}
+
+size_t PageCipher::encryptedLength(uint32_t page, size_t pageSize) const
+{
+    return pageSize - m_header.reserve - encryptedOffset(page);
+}
+
+void PageCipher::getIVForPage(uint32_t page, uint8_t* iv)
+{
+    // Page number, little endian
+    const uint8_t intiv[4] = { (uint8_t) page, (uint8_t) (page >> 8),
+                               (uint8_t) (page >> 16), (uint8_t) (page >> 24) };
+
+    if (m_header.hasTweakIV())
+    {
+        // XTS encrypts the tweak with its second key, so the page number
+        // itself is a safe tweak (the data unit number of IEEE 1619)
+        memset(iv, 0, m_iv.size());
+        memcpy(iv, intiv, sizeof(intiv));
+        return;
+    }
+
+    // The IV of a page never changes for a key, hot pages skip the MAC
+    const uint8_t* cached = m_ivCache->find(page);
+    if (nullptr != cached)
+    {
+        memcpy(iv, cached, m_iv.size());
+        return;
+    }
+
+    m_cmac->compute(intiv, sizeof(intiv), iv);
+    m_ivCache->insert(page, iv);
+}
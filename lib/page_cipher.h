@@ -0,0 +1,139 @@
+/*
+ * Pre-keyed page cipher for SQLite3 encryption codec.
+ * (C) 2010 Olivier de Gaalon
+ * (C) 2016 Archibald Neil MacDonald
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#ifndef PAGE_CIPHER_H_
+#define PAGE_CIPHER_H_
+
+#include <memory>
+
+#include "cipher_suite.h"
+#include "codec_header.h"
+#include "codec_interface.h"
+#include "crypto_backend.h"
+#include "iv_cache.h"
+
+using namespace std;
+
+//PAGE_BATCH_SIZE: Pages handed to the cipher together by the batch calls.
+const size_t PAGE_BATCH_SIZE = 16;
+
+/**
+* Holds the cipher and IV derivation objects for a single key, along with
+* the header describing the format pages are written in.
+* The key schedules are computed once on construction, pages are then
+* encrypted and decrypted in place without rekeying or heap allocation.
+*/
+class PageCipher
+{
+public:
+    /**
+    * The suite named by the header must be supported by the crypto backend.
+    */
+    PageCipher(const CodecHeader& header, const SecureBytes& key,
+               const SecureBytes& ivKey);
+
+    /**
+    * Encrypt a full page in place, adding the codec header to page 1.
+    * @param page page number.
+    * @param data page data.
+    * @param pageSize size of the page in bytes.
+    */
+    void encrypt(uint32_t page, uint8_t* data, size_t pageSize);
+
+    /**
+    * Decrypt a full page in place, restoring the SQLite header on page 1.
+    * @param page page number.
+    * @param data page data.
+    * @param pageSize size of the page in bytes.
+    */
+    void decrypt(uint32_t page, uint8_t* data, size_t pageSize);
+
+    /**
+    * Encrypt or decrypt several full pages in place, passing them to the
+    * cipher together.
+    * @param pages pages to process.
+    * @param count number of pages.
+    * @param pageSize size of each page in bytes.
+    */
+    void encryptBatch(const CodecPage* pages, size_t count, size_t pageSize);
+    void decryptBatch(const CodecPage* pages, size_t count, size_t pageSize);
+
+    /**
+    * Implementation picked for this CPU, e.g. "aesni" or "base".
+    */
+    string provider() const { return m_cipher->provider(); }
+
+    /**
+    * Key check value: the start of a zero block encrypted with a zero IV,
+    * which no page uses. Identifies the key without revealing it, and tags
+    * the pages written with it.
+    */
+    uint64_t keyCheck() const { return m_keyCheck; }
+
+    /**
+    * Take the rekey and key rotation state and key slots of a header, to be
+    * written to page 1 along with the header.
+    */
+    void setState(const CodecHeader& state);
+
+    /**
+    * IV cache statistics, zero for formats without derived IVs.
+    */
+    uint64_t ivCacheHits() const;
+    uint64_t ivCacheMisses() const;
+    void resetStats();
+
+    const CodecHeader& header() const { return m_header; }
+    const SecureBytes& key() const { return m_key; }
+    const SecureBytes& ivKey() const { return m_ivKey; }
+
+private:
+    void getIVForPage(uint32_t page, uint8_t* iv);
+
+    uint64_t computeKeyCheck();
+
+    void processBatch(bool encrypt, const CodecPage* pages, size_t count,
+                      size_t pageSize);
+
+    void flushBatch(bool encrypt, size_t length, size_t count);
+
+    /**
+    * Clear the reserved bytes and write the page tag and header, after
+    * encryption.
+    */
+    void finishEncrypt(uint32_t page, uint8_t* data, size_t pageSize);
+
+    /**
+    * Part of the page that is encrypted. The codec header on page 1 and
+    * the codec reserved bytes stay in plaintext.
+    */
+    size_t encryptedOffset(uint32_t page) const;
+    size_t encryptedLength(uint32_t page, size_t pageSize) const;
+
+private:
+    CodecHeader m_header;
+    const CipherSuite& m_suite;
+
+    SecureBytes m_key;
+    SecureBytes m_ivKey;
+
+    std::unique_ptr<CryptoBackend::Cipher> m_cipher;
+    // Only for formats that derive the IV with a MAC
+    std::unique_ptr<CryptoBackend::Mac> m_cmac;
+    std::unique_ptr<IvCache> m_ivCache;
+
+    uint64_t m_keyCheck;
+
+    // Scratch space sized on construction, so processing a page never
+    // allocates.
+    SecureBytes m_iv;
+    SecureBytes m_batchIvs;
+    uint8_t* m_batchData[PAGE_BATCH_SIZE];
+};
+
+#endif
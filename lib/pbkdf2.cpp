@@ -0,0 +1,134 @@
+/*
+ * Parallel PBKDF2 for SQLite3 encryption codec.
+ * (C) 2010 Olivier de Gaalon
+ * (C) 2016 Archibald Neil MacDonald
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#include "pbkdf2.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    // Shortest probe calibrateIterations scales from, in milliseconds
+    const double CALIBRATION_PROBE_TIME = 10.0;
+
+    /**
+    * Block T_i of PBKDF2: U_1 = PRF(salt || INT(i)), U_j = PRF(U_j-1),
+    * T_i = U_1 ^ ... ^ U_iterations.
+    * @param out receives prf.outputLength() bytes.
+    */
+    void deriveBlock(CryptoBackend::Mac& prf,
+                     const uint8_t* salt, size_t saltLength,
+                     uint32_t iterations, uint32_t block, uint8_t* out)
+    {
+        SecureBytes u(salt, salt + saltLength);
+        u.push_back((uint8_t) (block >> 24));
+        u.push_back((uint8_t) (block >> 16));
+        u.push_back((uint8_t) (block >> 8));
+        u.push_back((uint8_t) block);
+
+        const size_t length = prf.outputLength();
+        prf.compute(u.data(), u.size(), out);
+        u.assign(out, out + length);
+
+        for (uint32_t i = 1; i < iterations; ++i)
+        {
+            // The PRF takes all of its input before writing the output
+            prf.compute(u.data(), length, u.data());
+            for (size_t j = 0; j < length; ++j)
+            {
+                out[j] ^= u[j];
+            }
+        }
+    }
+}
+
+bool deriveKeyParallel(const KdfAlgorithm& kdf,
+                       const char* password, size_t passwordLength,
+                       const uint8_t* salt, size_t saltLength,
+                       const KdfCost& cost,
+                       uint8_t* out, size_t outLength)
+{
+    if (!CryptoBackend::supports(kdf))
+    {
+        return false;
+    }
+
+    // One PRF per block, keyed on the calling thread. KDFs without one
+    // are the backend's to run, in parallel if they have lanes.
+    std::vector<std::unique_ptr<CryptoBackend::Mac>> prfs;
+    prfs.push_back(CryptoBackend::createKdfPrf(kdf, password, passwordLength));
+    const size_t blockLength = prfs[0] ? prfs[0]->outputLength() : 0;
+    const size_t blocks = 0 != blockLength ?
+                          (outLength + blockLength - 1) / blockLength : 0;
+
+    if (blocks <= 1 || std::thread::hardware_concurrency() <= 1)
+    {
+        return CryptoBackend::deriveKey(kdf, password, passwordLength,
+                                        salt, saltLength, cost,
+                                        out, outLength);
+    }
+
+    for (size_t i = 1; i < blocks; ++i)
+    {
+        prfs.push_back(CryptoBackend::createKdfPrf(kdf, password,
+                                                   passwordLength));
+    }
+
+    // The last block is cut to the output length
+    SecureBytes derived(blocks * blockLength);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < blocks; ++i)
+    {
+        threads.emplace_back(deriveBlock, std::ref(*prfs[i]), salt, saltLength,
+                             cost.iterations, (uint32_t) (i + 1),
+                             derived.data() + i * blockLength);
+    }
+    deriveBlock(*prfs[0], salt, saltLength, cost.iterations, 1, derived.data());
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    memcpy(out, derived.data(), outLength);
+    return true;
+}
+
+uint32_t calibrateIterations(const KdfAlgorithm& kdf, size_t outLength,
+                             uint32_t milliseconds)
+{
+    static const char password[] = "calibration";
+    const uint8_t salt[16] = { 0 };
+    SecureBytes out(outLength);
+
+    // Double a probe until it is long enough to time, then scale it
+    for (uint64_t iterations = KDF_MIN_CALIBRATED_ITERATIONS; ;
+         iterations *= 2)
+    {
+        const std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+        if (!deriveKeyParallel(kdf, password, sizeof(password) - 1,
+                               salt, sizeof(salt), KdfCost((uint32_t) iterations),
+                               out.data(), out.size()))
+        {
+            return KDF_MIN_CALIBRATED_ITERATIONS;
+        }
+        const double elapsed = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+
+        if (elapsed >= CALIBRATION_PROBE_TIME || iterations >= 0x80000000ULL)
+        {
+            const double scaled = iterations * (milliseconds / elapsed);
+            return (uint32_t) std::max<double>(KDF_MIN_CALIBRATED_ITERATIONS,
+                                               std::min<double>(scaled, 0xFFFFFFFFU));
+        }
+    }
+}
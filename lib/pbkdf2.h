@@ -0,0 +1,49 @@
+/*
+ * Parallel PBKDF2 for SQLite3 encryption codec.
+ * (C) 2010 Olivier de Gaalon
+ * (C) 2016 Archibald Neil MacDonald
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#ifndef PBKDF2_H_
+#define PBKDF2_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "crypto_backend.h"
+
+using namespace std;
+
+/**
+* CryptoBackend::deriveKey, with the output blocks of PBKDF2 (RFC 8018)
+* derived on one thread each. Each block runs all iterations of the KDF on
+* its own, so keys longer than the PRF output, like the cipher and IV keys
+* of a page cipher, take the time of a single block. The output is the
+* same byte for byte.
+* @return false if the KDF is not supported.
+*/
+bool deriveKeyParallel(const KdfAlgorithm& kdf,
+                       const char* password, size_t passwordLength,
+                       const uint8_t* salt, size_t saltLength,
+                       const KdfCost& cost,
+                       uint8_t* out, size_t outLength);
+
+//KDF_MIN_CALIBRATED_ITERATIONS: Fewest iterations calibrateIterations
+//picks, however short the time budget.
+const uint32_t KDF_MIN_CALIBRATED_ITERATIONS = 1000;
+
+//KDF_MAX_CALIBRATION_TIME: Largest time budget, in milliseconds.
+const uint32_t KDF_MAX_CALIBRATION_TIME = 60000;
+
+/**
+* Number of iterations deriveKeyParallel takes about the given time for on
+* this host, measured with a few short runs.
+* @param outLength length of the key the iterations are for.
+* @param milliseconds time budget.
+*/
+uint32_t calibrateIterations(const KdfAlgorithm& kdf, size_t outLength,
+                             uint32_t milliseconds);
+
+#endif
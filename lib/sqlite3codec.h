@@ -0,0 +1,323 @@
+/*
+ * Encryption codec extensions to the SQLite3 API
+ * (C) 2010 Olivier de Gaalon
+ * (C) 2016 Archibald Neil MacDonald
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#ifndef SQLITE3CODEC_H_
+#define SQLITE3CODEC_H_
+
+#include <sqlite3.h>
+
+#   ifdef __cplusplus
+extern "C"
+{
+#   endif
+
+    /**
+    * Returned by sqlite3_key and the other keying functions, and by ATTACH
+    * with a KEY, for a key the database is known not to be encrypted with.
+    * An extended result code of SQLITE_NOTADB, which a wrong key results in
+    * when it can only be told from the pages.
+    */
+#   define SQLITE_NOTADB_WRONGKEY (SQLITE_NOTADB | (0x40 << 8))
+
+    /**
+    * Set an encryption codec parameter for a database. Parameters apply
+    * when the database is created by a following sqlite3_key, or rekeyed by
+    * a following sqlite3_rekey. The same parameters can be given as URI
+    * parameters of a database file, e.g. "file:hot.db?cipher=aes-xts".
+    * @param db database connection.
+    * @param zDbName schema name ("main", attached name), NULL for "main".
+    * @param zParam parameter name: "cipher", "kdf", "kdf_iter", "kdf_time",
+    * "kdf_memory", "kdf_lanes", "format", "rekey_threads", "key_slots" or
+    * "raw_key" (1 to take keys of the form x'<hex>' as raw keys, see
+    * sqlite3_key_raw, 0 by default).
+    * @param zValue parameter value.
+    * @return SQLITE_OK, or SQLITE_ERROR for unknown parameters or values.
+    */
+    SQLITE_API int sqlite3_codec_config(sqlite3* db, const char* zDbName,
+                                        const char* zParam,
+                                        const char* zValue);
+
+    /**
+    * Codec counters, see sqlite3_codec_status. The IV cache hit rate is
+    * HIT / (HIT + MISS). Pages using the page number as tweak (format 2)
+    * do not go through the IV cache.
+    */
+#   define SQLITE_CODECSTATUS_IV_CACHE_HIT    0
+#   define SQLITE_CODECSTATUS_IV_CACHE_MISS   1
+
+    /**
+    * Progress of an incremental rekey, see sqlite3_rekey_step: the first
+    * page not yet encrypted with the new key, 0 when no rekey is pending.
+    * Not a counter, resetFlag does not affect it.
+    */
+#   define SQLITE_CODECSTATUS_REKEY_WATERMARK 2
+
+    /**
+    * Read a codec counter of a database, like sqlite3_db_status. Counters
+    * cover the current keys; keying or rekeying starts them over.
+    * @param db database connection.
+    * @param zDbName schema name ("main", attached name), NULL for "main".
+    * @param op one of the SQLITE_CODECSTATUS_* counters.
+    * @param pCurrent receives the counter, 0 for unencrypted databases.
+    * @param resetFlag if non-zero, reset all counters of the database.
+    * @return SQLITE_OK, or SQLITE_ERROR for unknown databases or counters.
+    */
+    SQLITE_API int sqlite3_codec_status(sqlite3* db, const char* zDbName,
+                                        int op, sqlite3_int64* pCurrent,
+                                        int resetFlag);
+
+    /**
+    * Add a password to an envelope database, created with the "key_slots"
+    * parameter. Envelope databases encrypt their pages with a random data
+    * key, kept wrapped for each password in a key slot on page 1, so adding
+    * or removing a password, or changing one with sqlite3_rekey, only
+    * rewrites page 1.
+    * @param db database connection, keyed with one of the passwords.
+    * @param zDbName schema name ("main", attached name), NULL for "main".
+    * @param zKey password to add.
+    * @param nKey length of the password.
+    * @return SQLITE_OK, or SQLITE_ERROR if the database is no envelope
+    * database or has no free key slot.
+    */
+    SQLITE_API int sqlite3_key_slot_add(sqlite3* db, const char* zDbName,
+                                        const void* zKey, int nKey);
+
+    /**
+    * Remove a password from an envelope database. The last password can't
+    * be removed.
+    * @param db database connection, keyed with one of the passwords.
+    * @param zDbName schema name ("main", attached name), NULL for "main".
+    * @param zKey password to remove.
+    * @param nKey length of the password.
+    * @return SQLITE_OK, or SQLITE_ERROR if no key slot other than the last
+    * one opens with the password.
+    */
+    SQLITE_API int sqlite3_key_slot_remove(sqlite3* db, const char* zDbName,
+                                           const void* zKey, int nKey);
+
+    /**
+    * sqlite3_rekey with progress reporting and cancellation. Every nStep
+    * pages, and after the last one, xProgress is called with the pages
+    * rewritten so far and the page count of the database. It returns 0 (or
+    * any positive value) to go on, or a negative value to abort: the rekey
+    * transaction is then rolled back and the database keeps its key. The
+    * write lock is held throughout, so a rekey is not paused; to throttle
+    * one, use sqlite3_rekey_step and pause between steps.
+    * Also behind sqlite3_rekey_v2. Databases attached to one connection are
+    * rekeyed one at a time, as a rekey holds the connection mutex. To rekey
+    * several files at once, use one connection, and thread, per file: their
+    * codecs share no state, so the rekeys run in parallel.
+    * @param db database connection.
+    * @param zDbName schema name ("main", attached name), NULL for "main".
+    * @param zKey new key, NULL to decrypt the database.
+    * @param nKey length of the new key.
+    * @param nStep pages between calls of xProgress.
+    * @param xProgress progress callback, NULL for none.
+    * @param pArg first argument of xProgress.
+    * @return SQLITE_OK, SQLITE_INTERRUPT if xProgress aborted, SQLITE_ERROR
+    * for unknown databases and the temp database, or an error code.
+    */
+    SQLITE_API int sqlite3_rekey_v3(sqlite3* db, const char* zDbName,
+                                    const void* zKey, int nKey, int nStep,
+                                    int (*xProgress)(void*, int, int),
+                                    void* pArg);
+
+    /**
+    * Rekey a database file by copying it: every page is decrypted and
+    * encrypted with the new key into "<file>-rekey", on the rekey_threads
+    * worker threads, and the copy is then renamed over the file. Instead of
+    * a journal the size of the database, the copy takes that much room
+    * until the rename. Writers wait for the whole copy, readers only for the
+    * rename, which is synced to disk before this returns. Page 1 of the old
+    * file is then zeroed, so connections that still have it open get
+    * SQLITE_NOTADB on their next transaction instead of reading or writing
+    * a file that is no longer the database. Close them and reopen them with
+    * the new key. If zeroing fails, the new file is in place but an error
+    * is still returned.
+    * @param zFilename database file, URI parameters (such as cipher or
+    * rekey_threads) apply to the copy.
+    * @param zKey current key.
+    * @param nKey length of the current key.
+    * @param zNewKey new key.
+    * @param nNewKey length of the new key.
+    * @param pzErrMsg receives an error message to free with sqlite3_free,
+    * NULL if not needed.
+    * @return SQLITE_OK, or SQLITE_ERROR for envelope databases, databases in
+    * WAL mode or during an incremental rekey, or another error code.
+    */
+    SQLITE_API int sqlite3_rekey_copy(const char* zFilename, const void* zKey,
+                                      int nKey, const void* zNewKey,
+                                      int nNewKey, char** pzErrMsg);
+
+    /**
+    * Start rotating a database to a new key in steps, without holding the
+    * write lock for the whole database. The new key uses the salt and
+    * parameters of the current one. Until the rotation is done, pages below
+    * a watermark kept on page 1 use the new key and the others the old one,
+    * so every connection to the database, including ones opened after a
+    * crash, must open it with the old key and call sqlite3_rekey_begin with
+    * the new one before running any statement. sqlite3_rekey is refused
+    * meanwhile.
+    * @param db database connection.
+    * @param zDbName schema name ("main", attached name), NULL for "main".
+    * @param zKey new key.
+    * @param nKey length of the new key.
+    * @return SQLITE_OK, or SQLITE_ERROR if the database has no codec header
+    * extension (databases encrypted by sqlite3_rekey), is an envelope
+    * database, or is being rotated to another key.
+    */
+    SQLITE_API int sqlite3_rekey_begin(sqlite3* db, const char* zDbName,
+                                       const void* zKey, int nKey);
+
+    /**
+    * Encrypt the next pages of a database with the key given to
+    * sqlite3_rekey_begin, in one write transaction of its own. Readers and
+    * writers can use the database between steps. A step that fails or is
+    * interrupted by a crash leaves the watermark where it was.
+    * @param db database connection.
+    * @param zDbName schema name ("main", attached name), NULL for "main".
+    * @param nPage number of pages to encrypt, negative for all remaining.
+    * The pages of a step are kept in the page cache until it commits.
+    * @return SQLITE_OK while pages remain, SQLITE_DONE once the new key is
+    * the only key, or an error code.
+    */
+    SQLITE_API int sqlite3_rekey_step(sqlite3* db, const char* zDbName,
+                                      int nPage);
+
+    /**
+    * Rotate a database to a new key lazily. Only page 1 is rewritten right
+    * away: every page records the key it was written with, pages are read
+    * with that key and all writes use the new one, so pages move to the new
+    * key as they are written. The older keys stay in the keyring of this
+    * connection until sqlite3_rekey_sweep has moved the remaining pages.
+    * Other connections, and this database once reopened, must be keyed with
+    * the new key and given the older ones with sqlite3_keyring_add.
+    * @param db database connection.
+    * @param zDbName schema name ("main", attached name), NULL for "main".
+    * @param zKey new key.
+    * @param nKey length of the new key.
+    * @return SQLITE_OK, or SQLITE_ERROR if the database has no codec header
+    * extension (databases encrypted by sqlite3_rekey), is an envelope
+    * database, is in an incremental rekey or already uses the key.
+    */
+    SQLITE_API int sqlite3_rekey_lazy(sqlite3* db, const char* zDbName,
+                                      const void* zKey, int nKey);
+
+    /**
+    * Add an older key of a lazily rotated database, for reading the pages
+    * that still use it.
+    * @param db database connection, keyed with the current key.
+    * @param zDbName schema name ("main", attached name), NULL for "main".
+    * @param zKey older key.
+    * @param nKey length of the older key.
+    * @return SQLITE_OK, or SQLITE_ERROR if the database has no codec header
+    * extension or is an envelope database.
+    */
+    SQLITE_API int sqlite3_keyring_add(sqlite3* db, const char* zDbName,
+                                       const void* zKey, int nKey);
+
+    /**
+    * Rewrite the next pages of a lazily rotated database that still use an
+    * older key, in one write transaction of its own, to run at low priority
+    * between regular transactions. Pages already using the current key are
+    * skipped without going through the pager.
+    * @param db database connection.
+    * @param zDbName schema name ("main", attached name), NULL for "main".
+    * @param nPage number of pages to rewrite, negative for all remaining.
+    * @return SQLITE_OK while pages remain, SQLITE_DONE once every page uses
+    * the current key and the keyring is dropped, or an error code.
+    */
+    SQLITE_API int sqlite3_rekey_sweep(sqlite3* db, const char* zDbName,
+                                       int nPage);
+
+    /**
+    * Turn on a process wide cache of derived keys, shared by all
+    * connections, so opening a database again with the same password skips
+    * the KDF. Entries are found by a hash of the password, salt and KDF
+    * parameters; the derived keys stay in memory until evicted.
+    * @param nEntries number of derived keys kept, least recently used ones
+    * are evicted first. 0 (the default) turns the cache off and drops its
+    * entries.
+    * @return SQLITE_OK, or SQLITE_ERROR for a negative nEntries.
+    */
+    SQLITE_API int sqlite3_codec_kdf_cache(int nEntries);
+
+    /**
+    * Keys of an encrypted database, derived once, for keying further
+    * connections to the same database without running the KDF.
+    */
+    typedef struct sqlite3_key_handle sqlite3_key_handle;
+
+    /**
+    * Make a key handle from a keyed database.
+    * @param db database connection.
+    * @param zDbName schema name ("main", attached name), NULL for "main".
+    * @param ppHandle receives the handle, to free with
+    * sqlite3_key_handle_free. It does not refer to db.
+    * @return SQLITE_OK, or SQLITE_ERROR if the database is not encrypted.
+    */
+    SQLITE_API int sqlite3_key_handle_create(sqlite3* db, const char* zDbName,
+                                             sqlite3_key_handle** ppHandle);
+
+    /**
+    * Key a database with a key handle, instead of sqlite3_key_v2. The
+    * handle can be used by any number of connections, from any thread.
+    * @param db database connection.
+    * @param zDbName schema name ("main", attached name), NULL for "main".
+    * @param pHandle key handle.
+    * @return SQLITE_OK, or SQLITE_ERROR if the handle was made for another
+    * database (one with another salt or parameters, including new ones).
+    */
+    SQLITE_API int sqlite3_key_handle_apply(sqlite3* db, const char* zDbName,
+                                            sqlite3_key_handle* pHandle);
+
+    SQLITE_API void sqlite3_key_handle_free(sqlite3_key_handle* pHandle);
+
+    /**
+    * Key a database like sqlite3_key_v2, but derive the key on a background
+    * thread and return right away. The first statement that reads or writes
+    * the database waits for the key, so opening further databases and
+    * other setup overlap with the KDF.
+    * @param db database connection.
+    * @param zDbName schema name ("main", attached name), NULL for "main".
+    * @param zKey password, copied.
+    * @param nKey length of the password.
+    * @return SQLITE_OK, or SQLITE_ERROR if the cipher suite or KDF is not
+    * supported. A wrong password shows like with sqlite3_key_v2, once the
+    * database is read. If the derivation itself fails (e.g. the KDF runs
+    * out of memory), every statement that reads or writes the database
+    * fails with SQLITE_NOMEM, and nothing is written unencrypted; key it
+    * again on a new connection.
+    */
+    SQLITE_API int sqlite3_key_async(sqlite3* db, const char* zDbName,
+                                     const void* zKey, int nKey);
+
+    /**
+    * Key a database with raw key bytes instead of a password, for keys that
+    * come from a key store or a random source. Raw keys skip the stretching
+    * of the KDF, the key is only spread over the cipher keys with a single
+    * PBKDF2 iteration. Only the key given here is raw: a later sqlite3_rekey
+    * takes a password as usual. With the "raw_key" parameter, set through
+    * sqlite3_codec_config or as URI parameter, the same key can also be
+    * given to sqlite3_key, or as PRAGMA key, as the blob literal x'<hex>'.
+    * Without it, keys of that form are passwords like any other.
+    * @param db database connection.
+    * @param zDbName schema name ("main", attached name), NULL for "main".
+    * @param pKey key bytes.
+    * @param nKey length of the key, at least 16 bytes.
+    * @return SQLITE_OK, SQLITE_ERROR for shorter keys, or SQLITE_TOOBIG for
+    * keys whose hex form would be longer than SQLITE_MAX_LENGTH.
+    */
+    SQLITE_API int sqlite3_key_raw(sqlite3* db, const char* zDbName,
+                                   const void* pKey, int nKey);
+
+#   ifdef __cplusplus
+}
+#   endif
+
+#endif
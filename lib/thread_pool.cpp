@@ -0,0 +1,92 @@
+/*
+ * Worker threads for SQLite3 encryption codec.
+ * (C) 2010 Olivier de Gaalon
+ * (C) 2016 Archibald Neil MacDonald
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(size_t threads) :
+    m_task(nullptr),
+    m_count(0),
+    m_next(0),
+    m_busy(0),
+    m_generation(0),
+    m_stop(false)
+{
+    for (size_t i = 1; i < threads; ++i)
+    {
+        m_threads.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_started.notify_all();
+
+    for (std::thread& thread : m_threads)
+    {
+        thread.join();
+    }
+}
+
+void ThreadPool::run(size_t count, const Task& task)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_task = &task;
+        m_count = count;
+        m_next = 0;
+        m_busy = m_threads.size();
+        ++m_generation;
+    }
+    m_started.notify_all();
+
+    // The caller is worker 0
+    runTasks(0);
+
+    // Every worker checks in, so none is left holding the task
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_finished.wait(lock, [this] { return 0 == m_busy; });
+    m_task = nullptr;
+}
+
+void ThreadPool::workerLoop(size_t worker)
+{
+    uint64_t generation = 0;
+
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_started.wait(lock, [&] { return m_stop || generation != m_generation; });
+            if (m_stop)
+            {
+                return;
+            }
+            generation = m_generation;
+        }
+
+        runTasks(worker);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            --m_busy;
+        }
+        m_finished.notify_one();
+    }
+}
+
+void ThreadPool::runTasks(size_t worker)
+{
+    for (size_t task = m_next++; task < m_count; task = m_next++)
+    {
+        (*m_task)(task, worker);
+    }
+}
@@ -0,0 +1,76 @@
+/*
+ * Worker threads for SQLite3 encryption codec.
+ * (C) 2010 Olivier de Gaalon
+ * (C) 2016 Archibald Neil MacDonald
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/**
+* Fixed set of threads that run the tasks of one call to run() at a time,
+* together with the thread calling run(). Used by the codec to spread the
+* cipher work of a rekey over several cores.
+*/
+class ThreadPool
+{
+public:
+    /**
+    * Function run for each task.
+    * @param task index of the task.
+    * @param worker index of the thread running it, below size(). Tasks with
+    * the same worker never run at once, so it can pick per thread state.
+    */
+    typedef std::function<void(size_t task, size_t worker)> Task;
+
+    /**
+    * @param threads number of threads to run tasks on, including the thread
+    * calling run(). One runs everything on the caller.
+    */
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+
+    /**
+    * Run tasks 0 to count - 1 and wait until all of them are done.
+    */
+    void run(size_t count, const Task& task);
+
+    size_t size() const { return m_threads.size() + 1; }
+
+private:
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+
+    void workerLoop(size_t worker);
+    void runTasks(size_t worker);
+
+private:
+    std::vector<std::thread> m_threads;
+
+    std::mutex m_mutex;
+    std::condition_variable m_started;
+    std::condition_variable m_finished;
+
+    // Current run, guarded by m_mutex except for m_next
+    const Task* m_task;
+    size_t m_count;
+    std::atomic<size_t> m_next;
+    size_t m_busy;
+    uint64_t m_generation;
+    bool m_stop;
+};
+
+#endif
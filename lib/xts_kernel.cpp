@@ -0,0 +1,411 @@
+/*
+ * Multi-buffer AES-256/XTS kernel for SQLite3 encryption codec.
+ * (C) 2010 Olivier de Gaalon
+ * (C) 2016 Archibald Neil MacDonald
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#include "xts_kernel.h"
+
+#include <cstring>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+    #define XTS_KERNEL_X86
+    #include <immintrin.h>
+#endif
+
+#if defined(XTS_KERNEL_X86)
+
+#define TARGET_AESNI __attribute__((target("sse2,aes")))
+#define TARGET_VAES __attribute__((target("sse2,aes,avx2,avx512f,vaes")))
+
+// Lanes only stay in registers if the loops over them are unrolled
+#define UNROLL_LANES _Pragma("GCC unroll 16")
+
+namespace
+{
+    const size_t AES_256_ROUNDS = 14;
+
+    //AESNI_LANES: Pages per AES-NI pass, enough to cover the latency of
+    //aesenc on current cores
+    const size_t AESNI_LANES = 8;
+
+    //VAES_PAGES: Pages per VAES pass, one 512 bit register of four blocks each
+    const size_t VAES_PAGES = 8;
+    const size_t VAES_BLOCKS = 4;
+
+    TARGET_AESNI inline __m128i expandRoundKey(__m128i key, __m128i assist)
+    {
+        key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+        key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+        key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+        return _mm_xor_si128(key, assist);
+    }
+
+    #define EXPAND_ROUND_KEYS(rk, i, rcon)                                       \
+        rk[i] = expandRoundKey(rk[i - 2], _mm_shuffle_epi32(                   \
+                    _mm_aeskeygenassist_si128(rk[i - 1], rcon), 0xFF));        \
+        rk[i + 1] = expandRoundKey(rk[i - 1], _mm_shuffle_epi32(               \
+                    _mm_aeskeygenassist_si128(rk[i], 0), 0xAA))
+
+    TARGET_AESNI void expandKey(const uint8_t* key, uint8_t* encKeys,
+                                uint8_t* decKeys)
+    {
+        __m128i rk[AES_256_ROUNDS + 1];
+        rk[0] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key));
+        rk[1] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key + 16));
+
+        EXPAND_ROUND_KEYS(rk, 2, 0x01);
+        EXPAND_ROUND_KEYS(rk, 4, 0x02);
+        EXPAND_ROUND_KEYS(rk, 6, 0x04);
+        EXPAND_ROUND_KEYS(rk, 8, 0x08);
+        EXPAND_ROUND_KEYS(rk, 10, 0x10);
+        EXPAND_ROUND_KEYS(rk, 12, 0x20);
+        rk[14] = expandRoundKey(rk[12], _mm_shuffle_epi32(
+                     _mm_aeskeygenassist_si128(rk[13], 0x40), 0xFF));
+
+        for (size_t r = 0; r <= AES_256_ROUNDS; ++r)
+        {
+            // Equivalent inverse cipher for aesdec
+            const __m128i dk = 0 == r || AES_256_ROUNDS == r ?
+                               rk[AES_256_ROUNDS - r] :
+                               _mm_aesimc_si128(rk[AES_256_ROUNDS - r]);
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(encKeys + 16 * r), rk[r]);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(decKeys + 16 * r), dk);
+        }
+    }
+
+    #undef EXPAND_ROUND_KEYS
+
+    /**
+    * Multiply tweaks by x in GF(2^128), little endian as in IEEE 1619.
+    */
+    TARGET_AESNI inline __m128i mulAlpha(__m128i t)
+    {
+        const __m128i poly = _mm_set_epi64x(1, 0x87);
+        const __m128i carries = _mm_shuffle_epi32(_mm_srli_epi64(t, 63), 0x4E);
+        const __m128i mask = _mm_sub_epi64(_mm_setzero_si128(), carries);
+        return _mm_xor_si128(_mm_slli_epi64(t, 1), _mm_and_si128(mask, poly));
+    }
+
+    TARGET_VAES inline __m512i mulAlpha512(__m512i t)
+    {
+        const __m512i poly = _mm512_set_epi64(1, 0x87, 1, 0x87, 1, 0x87, 1, 0x87);
+        const __m512i carries = _mm512_shuffle_epi32(_mm512_srli_epi64(t, 63),
+                                                     _MM_PERM_BADC);
+        const __m512i mask = _mm512_sub_epi64(_mm512_setzero_si512(), carries);
+        return _mm512_xor_si512(_mm512_slli_epi64(t, 1), _mm512_and_si512(mask, poly));
+    }
+
+    /**
+    * Encrypt the IVs of N pages with the tweak key, side by side.
+    */
+    template<size_t N>
+    TARGET_AESNI void xtsTweaks(const uint8_t* tweakKeys, const uint8_t* ivs,
+                                __m128i* t)
+    {
+        UNROLL_LANES
+        for (size_t i = 0; i < N; ++i)
+        {
+            t[i] = _mm_xor_si128(_mm_loadu_si128(
+                       reinterpret_cast<const __m128i*>(ivs + 16 * i)),
+                       _mm_loadu_si128(reinterpret_cast<const __m128i*>(tweakKeys)));
+        }
+        for (size_t r = 1; r < AES_256_ROUNDS; ++r)
+        {
+            const __m128i k = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(tweakKeys + 16 * r));
+            UNROLL_LANES
+            for (size_t i = 0; i < N; ++i)
+            {
+                t[i] = _mm_aesenc_si128(t[i], k);
+            }
+        }
+        const __m128i k = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(tweakKeys + 16 * AES_256_ROUNDS));
+        UNROLL_LANES
+        for (size_t i = 0; i < N; ++i)
+        {
+            t[i] = _mm_aesenclast_si128(t[i], k);
+        }
+    }
+
+    /**
+    * XTS over N pages, block j of every page in flight together.
+    * @param keys data round keys, encryption or decryption schedule.
+    * @param tweakKeys tweak round keys.
+    */
+    template<size_t N, bool DECRYPT>
+    TARGET_AESNI void xtsAesni(const uint8_t* keys, const uint8_t* tweakKeys,
+                               const uint8_t* ivs, uint8_t* const* data,
+                               size_t blocks)
+    {
+        __m128i k[AES_256_ROUNDS + 1];
+        __m128i t[N];
+        __m128i b[N];
+
+        xtsTweaks<N>(tweakKeys, ivs, t);
+
+        for (size_t r = 0; r <= AES_256_ROUNDS; ++r)
+        {
+            k[r] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + 16 * r));
+        }
+
+        for (size_t j = 0; j < blocks; ++j)
+        {
+            UNROLL_LANES
+            for (size_t i = 0; i < N; ++i)
+            {
+                b[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data[i] + 16 * j));
+                b[i] = _mm_xor_si128(_mm_xor_si128(b[i], t[i]), k[0]);
+            }
+            for (size_t r = 1; r < AES_256_ROUNDS; ++r)
+            {
+                UNROLL_LANES
+                for (size_t i = 0; i < N; ++i)
+                {
+                    b[i] = DECRYPT ? _mm_aesdec_si128(b[i], k[r]) :
+                                     _mm_aesenc_si128(b[i], k[r]);
+                }
+            }
+            UNROLL_LANES
+            for (size_t i = 0; i < N; ++i)
+            {
+                b[i] = DECRYPT ? _mm_aesdeclast_si128(b[i], k[AES_256_ROUNDS]) :
+                                 _mm_aesenclast_si128(b[i], k[AES_256_ROUNDS]);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(data[i] + 16 * j),
+                                 _mm_xor_si128(b[i], t[i]));
+                t[i] = mulAlpha(t[i]);
+            }
+        }
+    }
+
+    template<bool DECRYPT>
+    TARGET_AESNI void xtsAesniAny(const uint8_t* keys, const uint8_t* tweakKeys,
+                                  const uint8_t* ivs, uint8_t* const* data,
+                                  size_t blocks, size_t count)
+    {
+        switch (count)
+        {
+        case 1: xtsAesni<1, DECRYPT>(keys, tweakKeys, ivs, data, blocks); break;
+        case 2: xtsAesni<2, DECRYPT>(keys, tweakKeys, ivs, data, blocks); break;
+        case 3: xtsAesni<3, DECRYPT>(keys, tweakKeys, ivs, data, blocks); break;
+        case 4: xtsAesni<4, DECRYPT>(keys, tweakKeys, ivs, data, blocks); break;
+        case 5: xtsAesni<5, DECRYPT>(keys, tweakKeys, ivs, data, blocks); break;
+        case 6: xtsAesni<6, DECRYPT>(keys, tweakKeys, ivs, data, blocks); break;
+        case 7: xtsAesni<7, DECRYPT>(keys, tweakKeys, ivs, data, blocks); break;
+        case 8: xtsAesni<8, DECRYPT>(keys, tweakKeys, ivs, data, blocks); break;
+        }
+    }
+
+    /**
+    * Multiply the tweak in each 128 bit lane by x^4, moving it four blocks on.
+    */
+    TARGET_VAES inline __m512i mulAlpha4(__m512i t)
+    {
+        // Top nibble of each half, moved into the other half
+        const __m512i carries = _mm512_shuffle_epi32(_mm512_srli_epi64(t, 60),
+                                                     _MM_PERM_BADC);
+        // Carries out of the high half are reduced with x^7 + x^2 + x + 1
+        const __m512i reduced = _mm512_xor_si512(
+            _mm512_xor_si512(carries, _mm512_slli_epi64(carries, 1)),
+            _mm512_xor_si512(_mm512_slli_epi64(carries, 2),
+                             _mm512_slli_epi64(carries, 7)));
+        return _mm512_xor_si512(_mm512_slli_epi64(t, 4),
+                                _mm512_mask_blend_epi64(0xAA, reduced, carries));
+    }
+
+    /**
+    * XTS over Z pages, four consecutive blocks of a page per 512 bit
+    * register, one register per page in flight.
+    */
+    template<size_t Z, bool DECRYPT>
+    TARGET_VAES void xtsVaes(const uint8_t* keys, const uint8_t* tweakKeys,
+                             const uint8_t* ivs, uint8_t* const* data,
+                             size_t blocks)
+    {
+        __m512i k[AES_256_ROUNDS + 1];
+        __m512i t[Z];
+        __m512i b[Z];
+
+        // Encrypted IVs, then the tweaks of blocks 0..3 of every page
+        __m128i first[Z];
+        xtsTweaks<Z>(tweakKeys, ivs, first);
+        UNROLL_LANES
+        for (size_t z = 0; z < Z; ++z)
+        {
+            const __m128i t1 = mulAlpha(first[z]);
+            const __m128i t2 = mulAlpha(t1);
+            const __m128i t3 = mulAlpha(t2);
+            t[z] = _mm512_inserti32x4(_mm512_castsi128_si512(first[z]), t1, 1);
+            t[z] = _mm512_inserti32x4(t[z], t2, 2);
+            t[z] = _mm512_inserti32x4(t[z], t3, 3);
+        }
+
+        for (size_t r = 0; r <= AES_256_ROUNDS; ++r)
+        {
+            k[r] = _mm512_broadcast_i32x4(_mm_loadu_si128(
+                       reinterpret_cast<const __m128i*>(keys + 16 * r)));
+        }
+
+        for (size_t j = 0; j < blocks; j += VAES_BLOCKS)
+        {
+            // Pages rarely hold a multiple of four blocks, the last
+            // iteration leaves the lanes past the end untouched
+            const size_t left = blocks - j < VAES_BLOCKS ? blocks - j : VAES_BLOCKS;
+            const __mmask16 mask = (__mmask16) ((1u << (4 * left)) - 1);
+
+            UNROLL_LANES
+
+            for (size_t z = 0; z < Z; ++z)
+            {
+                b[z] = _mm512_maskz_loadu_epi32(mask, data[z] + 16 * j);
+                b[z] = _mm512_xor_si512(_mm512_xor_si512(b[z], t[z]), k[0]);
+            }
+            for (size_t r = 1; r < AES_256_ROUNDS; ++r)
+            {
+                UNROLL_LANES
+                for (size_t z = 0; z < Z; ++z)
+                {
+                    b[z] = DECRYPT ? _mm512_aesdec_epi128(b[z], k[r]) :
+                                     _mm512_aesenc_epi128(b[z], k[r]);
+                }
+            }
+            UNROLL_LANES
+            for (size_t z = 0; z < Z; ++z)
+            {
+                b[z] = DECRYPT ? _mm512_aesdeclast_epi128(b[z], k[AES_256_ROUNDS]) :
+                                 _mm512_aesenclast_epi128(b[z], k[AES_256_ROUNDS]);
+                _mm512_mask_storeu_epi32(data[z] + 16 * j, mask,
+                                         _mm512_xor_si512(b[z], t[z]));
+                t[z] = mulAlpha4(t[z]);
+            }
+        }
+    }
+
+    template<bool DECRYPT>
+    TARGET_VAES void xtsVaesAny(const uint8_t* keys, const uint8_t* tweakKeys,
+                                const uint8_t* ivs, uint8_t* const* data,
+                                size_t blocks, size_t count)
+    {
+        switch (count)
+        {
+        case 1: xtsVaes<1, DECRYPT>(keys, tweakKeys, ivs, data, blocks); break;
+        case 2: xtsVaes<2, DECRYPT>(keys, tweakKeys, ivs, data, blocks); break;
+        case 3: xtsVaes<3, DECRYPT>(keys, tweakKeys, ivs, data, blocks); break;
+        case 4: xtsVaes<4, DECRYPT>(keys, tweakKeys, ivs, data, blocks); break;
+        case 5: xtsVaes<5, DECRYPT>(keys, tweakKeys, ivs, data, blocks); break;
+        case 6: xtsVaes<6, DECRYPT>(keys, tweakKeys, ivs, data, blocks); break;
+        case 7: xtsVaes<7, DECRYPT>(keys, tweakKeys, ivs, data, blocks); break;
+        case 8: xtsVaes<8, DECRYPT>(keys, tweakKeys, ivs, data, blocks); break;
+        }
+    }
+}
+
+std::unique_ptr<AesXtsKernel> AesXtsKernel::create(const uint8_t* key,
+                                                   size_t keyLength)
+{
+    __builtin_cpu_init();
+    if (64 != keyLength || !__builtin_cpu_supports("aes"))
+    {
+        return nullptr;
+    }
+
+    const bool vaes = __builtin_cpu_supports("vaes") &&
+                      __builtin_cpu_supports("avx512f");
+    return std::unique_ptr<AesXtsKernel>(new AesXtsKernel(key, vaes));
+}
+
+AesXtsKernel::AesXtsKernel(const uint8_t* key, bool vaes) :
+    m_vaes(vaes)
+{
+    expandKey(key, m_encKeys, m_decKeys);
+
+    // The tweak is only ever encrypted, its decryption schedule is unused
+    uint8_t unused[sizeof(m_tweakKeys)];
+    expandKey(key + 32, m_tweakKeys, unused);
+    memset(unused, 0, sizeof(unused));
+}
+
+void AesXtsKernel::process(bool encrypt, const uint8_t* ivs,
+                           uint8_t* const* data, size_t length,
+                           size_t count) const
+{
+    const uint8_t* keys = encrypt ? m_encKeys : m_decKeys;
+    const size_t blocks = length / 16;
+
+    while (count > 0)
+    {
+        const size_t lanes = m_vaes ? VAES_PAGES : AESNI_LANES;
+        const size_t done = count < lanes ? count : lanes;
+        if (m_vaes)
+        {
+            encrypt ? xtsVaesAny<false>(keys, m_tweakKeys, ivs, data, blocks, done) :
+                      xtsVaesAny<true>(keys, m_tweakKeys, ivs, data, blocks, done);
+        }
+        else
+        {
+            encrypt ? xtsAesniAny<false>(keys, m_tweakKeys, ivs, data, blocks, done) :
+                      xtsAesniAny<true>(keys, m_tweakKeys, ivs, data, blocks, done);
+        }
+
+        ivs += 16 * done;
+        data += done;
+        count -= done;
+    }
+}
+
+const char* AesXtsKernel::name() const
+{
+    return m_vaes ? "vaes-x8" : "aesni-x8";
+}
+
+#else
+
+std::unique_ptr<AesXtsKernel> AesXtsKernel::create(const uint8_t* key,
+                                                   size_t keyLength)
+{
+    return nullptr;
+}
+
+AesXtsKernel::AesXtsKernel(const uint8_t* key, bool vaes) :
+    m_vaes(vaes)
+{ }
+
+void AesXtsKernel::process(bool encrypt, const uint8_t* ivs,
+                           uint8_t* const* data, size_t length,
+                           size_t count) const
+{ }
+
+const char* AesXtsKernel::name() const
+{
+    return "none";
+}
+
+#endif
+
+AesXtsKernel::~AesXtsKernel()
+{
+    volatile uint8_t* keys[] = { m_encKeys, m_decKeys, m_tweakKeys };
+    for (volatile uint8_t* k : keys)
+    {
+        for (size_t i = 0; i < sizeof(m_encKeys); ++i)
+        {
+            k[i] = 0;
+        }
+    }
+}
+
+void AesXtsKernel::encrypt(const uint8_t* ivs, uint8_t* const* data,
+                           size_t length, size_t count) const
+{
+    process(true, ivs, data, length, count);
+}
+
+void AesXtsKernel::decrypt(const uint8_t* ivs, uint8_t* const* data,
+                           size_t length, size_t count) const
+{
+    process(false, ivs, data, length, count);
+}
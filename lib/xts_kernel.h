@@ -0,0 +1,72 @@
+/*
+ * Multi-buffer AES-256/XTS kernel for SQLite3 encryption codec.
+ * (C) 2010 Olivier de Gaalon
+ * (C) 2016 Archibald Neil MacDonald
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#ifndef XTS_KERNEL_H_
+#define XTS_KERNEL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+using namespace std;
+
+/*XTS blocks only depend on their own page's tweak, so independent pages can
+ *go through the AES rounds side by side, keeping every AES unit busy. The
+ *kernel runs block j of up to 8 pages together with AES-NI, or four blocks
+ *of each of up to 8 pages in 512 bit registers with VAES and AVX-512. The
+ *code path is picked at runtime from CPUID; on other CPUs and compilers the
+ *kernel is not available and backends keep processing one page at a time.*/
+
+class AesXtsKernel
+{
+public:
+    /**
+    * @param key AES-256/XTS key: 32 byte data key followed by 32 byte
+    * tweak key.
+    * @param keyLength length of the key, must be 64.
+    * @return nullptr if the CPU or compiler has no kernel.
+    */
+    static std::unique_ptr<AesXtsKernel> create(const uint8_t* key,
+                                                size_t keyLength);
+
+    ~AesXtsKernel();
+
+    /**
+    * Encrypt or decrypt several buffers in place, like
+    * CryptoBackend::Cipher::encryptBatch.
+    * @param ivs one 16 byte IV per buffer, back to back.
+    * @param data buffers.
+    * @param length length of each buffer, a multiple of 16.
+    * @param count number of buffers.
+    */
+    void encrypt(const uint8_t* ivs, uint8_t* const* data, size_t length,
+                 size_t count) const;
+    void decrypt(const uint8_t* ivs, uint8_t* const* data, size_t length,
+                 size_t count) const;
+
+    /**
+    * Code path in use, "aesni-x8" or "vaes-x8".
+    */
+    const char* name() const;
+
+private:
+    AesXtsKernel(const uint8_t* key, bool vaes);
+
+    void process(bool encrypt, const uint8_t* ivs, uint8_t* const* data,
+                 size_t length, size_t count) const;
+
+private:
+    // Round keys: data encryption, data decryption and tweak encryption
+    uint8_t m_encKeys[15 * 16];
+    uint8_t m_decKeys[15 * 16];
+    uint8_t m_tweakKeys[15 * 16];
+
+    bool m_vaes;
+};
+
+#endif
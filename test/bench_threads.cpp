@@ -0,0 +1,174 @@
+/*
+ * Multi-thread scaling benchmark for the SQLite3 encryption codec.
+ * Each thread owns a connection to its own encrypted database and scans
+ * it with a tiny page cache, so nearly every page read goes through the
+ * codec. Throughput is reported for 1..N threads.
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace SQL
+{
+    const char * CREATE_TABLE_DATA =
+        "CREATE TABLE IF NOT EXISTS data (id INTEGER PRIMARY KEY, payload BLOB);";
+    const char * FILL_TABLE_DATA =
+        "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < 8000) "
+        "INSERT INTO data (payload) SELECT randomblob(400) FROM n;";
+    const char * COUNT_DATA =
+        "SELECT count(*) FROM data;";
+    const char * SCAN_DATA =
+        "SELECT sum(length(payload)) FROM data;";
+    const char * SMALL_CACHE =
+        "PRAGMA cache_size = 16;";
+};
+
+static const char* key = "anotherkey";
+
+static std::string databaseName(int n)
+{
+    return "./bench_threads_" + std::to_string(n) + ".db";
+}
+
+static sqlite3* openDatabase(int n)
+{
+    sqlite3* db = NULL;
+    if (sqlite3_open(databaseName(n).c_str(), &db) != SQLITE_OK ||
+        sqlite3_key(db, key, strlen(key)) != SQLITE_OK)
+    {
+        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
+        exit(1);
+    }
+    return db;
+}
+
+static sqlite3_int64 queryInt(sqlite3* db, const char* sql)
+{
+    sqlite3_stmt* stmt = NULL;
+    sqlite3_int64 value = -1;
+
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        value = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return value;
+}
+
+static void prepareDatabase(int n)
+{
+    sqlite3* db = openDatabase(n);
+    char* error = 0;
+
+    if (sqlite3_exec(db, SQL::CREATE_TABLE_DATA, 0, 0, &error) != SQLITE_OK ||
+        (queryInt(db, SQL::COUNT_DATA) == 0 &&
+         sqlite3_exec(db, SQL::FILL_TABLE_DATA, 0, 0, &error) != SQLITE_OK))
+    {
+        fprintf(stderr, "SQL error: %s\n", error);
+        exit(1);
+    }
+    sqlite3_close(db);
+}
+
+/**
+* Scan one database until told to stop.
+* @param n database to scan.
+* @param stop set by the main thread when the run is over.
+* @param bytes receives the number of page bytes read through the codec.
+*/
+static void scanDatabase(int n, const std::atomic<bool>* stop,
+                         sqlite3_int64* bytes)
+{
+    sqlite3* db = openDatabase(n);
+    sqlite3_exec(db, SQL::SMALL_CACHE, 0, 0, 0);
+
+    sqlite3_int64 pageSize = queryInt(db, "PRAGMA page_size;");
+    sqlite3_int64 pageCount = queryInt(db, "PRAGMA page_count;");
+
+    *bytes = 0;
+    while (!stop->load())
+    {
+        queryInt(db, SQL::SCAN_DATA);
+        *bytes += pageSize * pageCount;
+    }
+    sqlite3_close(db);
+}
+
+static double runThreads(int threads, double seconds)
+{
+    std::atomic<bool> stop(false);
+    std::vector<sqlite3_int64> bytes(threads, 0);
+    std::vector<std::thread> workers;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < threads; ++i)
+    {
+        workers.emplace_back(scanDatabase, i, &stop, &bytes[i]);
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+
+    sqlite3_int64 total = 0;
+    for (int i = 0; i < threads; ++i)
+    {
+        workers[i].join();
+        total += bytes[i];
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    return total / elapsed.count() / (1024.0 * 1024.0);
+}
+
+int main(int argc, char** argv)
+{
+    int maxThreads = argc > 1 ? atoi(argv[1]) :
+                                (int) std::thread::hardware_concurrency();
+    double seconds = argc > 2 ? atof(argv[2]) : 2.0;
+
+    if (maxThreads < 1)
+    {
+        maxThreads = 1;
+    }
+
+    if (sqlite3_threadsafe() == 0)
+    {
+        fprintf(stderr, "SQLite was built without thread support\n");
+        return 1;
+    }
+
+    fprintf(stderr, "Preparing %d encrypted databases\n", maxThreads);
+    for (int i = 0; i < maxThreads; ++i)
+    {
+        prepareDatabase(i);
+    }
+
+    double single = 0.0;
+    fprintf(stderr, "threads  MiB/s decrypted  scaling\n");
+    for (int threads = 1; threads <= maxThreads;
+         threads = threads < maxThreads && threads * 2 > maxThreads ?
+                   maxThreads : threads * 2)
+    {
+        double rate = runThreads(threads, seconds);
+        if (threads == 1)
+        {
+            single = rate;
+        }
+        fprintf(stderr, "%7d  %15.1f  %6.2fx\n", threads, rate,
+                single > 0.0 ? rate / single : 0.0);
+    }
+
+    return 0;
+}
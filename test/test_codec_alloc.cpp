@@ -0,0 +1,233 @@
+/*
+ * Allocation audit for the SQLite3 encryption codec page path.
+ * Fails if encrypting or decrypting a page touches the heap once the
+ * codec is keyed and sized, or if the batch calls disagree with the single
+ * page calls.
+ *
+ * Distributed under the terms of the Botan license
+ */
+
+#include "codec_interface.h"
+
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern "C"
+{
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t count, size_t size);
+    void* __libc_realloc(void* ptr, size_t size);
+    void __libc_free(void* ptr);
+}
+
+static bool auditing = false;
+static size_t allocations = 0;
+
+static void* countedMalloc(size_t size)
+{
+    if (auditing)
+    {
+        ++allocations;
+    }
+    return __libc_malloc(size);
+}
+
+extern "C" void* malloc(size_t size)
+{
+    return countedMalloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+    if (auditing)
+    {
+        ++allocations;
+    }
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size)
+{
+    if (auditing)
+    {
+        ++allocations;
+    }
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void* ptr)
+{
+    __libc_free(ptr);
+}
+
+void* operator new(size_t size)
+{
+    void* ptr = countedMalloc(size ? size : 1);
+    if (NULL == ptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    free(ptr);
+}
+
+static bool roundTrip(void* codec, int pageSize, int pages)
+{
+    unsigned char* original = static_cast<unsigned char*>(malloc(pageSize));
+    unsigned char* page = static_cast<unsigned char*>(malloc(pageSize));
+    bool good = true;
+
+    for (int i = 0; i < pageSize; ++i)
+    {
+        original[i] = (unsigned char) (i * 31 + 7);
+    }
+    // Page 1 of a database starts with the SQLite header, which takes the
+    // place of the codec header when the codec writes one
+    memcpy(original, "SQLite format 3", 16);
+
+    // Warm up once outside the audit, lazy library initialisation is fine
+    memcpy(page, codecEncrypt(codec, 1, original, 1), pageSize);
+    codecDecrypt(codec, 1, page);
+
+    allocations = 0;
+    auditing = true;
+
+    for (int n = 1; good && n <= pages; ++n)
+    {
+        // Main database write, journal write and page load
+        memcpy(page, codecEncrypt(codec, n, original, 1), pageSize);
+        codecDecrypt(codec, n, page);
+        good = 0 == memcmp(page, original, pageSize);
+
+        memcpy(page, codecEncrypt(codec, n, original, 0), pageSize);
+        codecDecrypt(codec, n, page);
+        good = good && 0 == memcmp(page, original, pageSize);
+    }
+
+    auditing = false;
+
+    if (!good)
+    {
+        fprintf(stderr, "\tPage size %d: round trip did not restore the page\n",
+                pageSize);
+    }
+    else if (allocations > 0)
+    {
+        fprintf(stderr, "\tPage size %d: %lu allocations over %d round trips\n",
+                pageSize, (unsigned long) allocations, pages);
+        good = false;
+    }
+
+    free(page);
+    free(original);
+    return good;
+}
+
+static bool batchRoundTrip(void* codec, int pageSize, int pages)
+{
+    unsigned char* single = static_cast<unsigned char*>(malloc(pageSize * pages));
+    unsigned char* batch = static_cast<unsigned char*>(malloc(pageSize * pages));
+    CodecPage* batchPages = static_cast<CodecPage*>(malloc(sizeof(CodecPage) * pages));
+    bool good = true;
+
+    for (int i = 0; i < pageSize * pages; ++i)
+    {
+        batch[i] = (unsigned char) (i * 13 + 1);
+    }
+    memcpy(batch, "SQLite format 3", 16);
+
+    for (int n = 0; n < pages; ++n)
+    {
+        unsigned char* page = batch + n * pageSize;
+        memcpy(single + n * pageSize, codecEncrypt(codec, n + 1, page, 1), pageSize);
+
+        batchPages[n].page = n + 1;
+        batchPages[n].data = page;
+    }
+
+    allocations = 0;
+    auditing = true;
+    codecEncryptBatch(codec, batchPages, pages, 1);
+    auditing = false;
+
+    good = 0 == memcmp(single, batch, pageSize * pages);
+
+    auditing = true;
+    codecDecryptBatch(codec, batchPages, pages);
+    auditing = false;
+
+    for (int n = 0; good && n < pages; ++n)
+    {
+        codecDecrypt(codec, n + 1, single + n * pageSize);
+    }
+    good = good && 0 == memcmp(single, batch, pageSize * pages);
+
+    if (!good)
+    {
+        fprintf(stderr, "\tPage size %d: batch and single page results differ\n",
+                pageSize);
+    }
+    else if (allocations > 0)
+    {
+        fprintf(stderr, "\tPage size %d: %lu allocations in batch calls\n",
+                pageSize, (unsigned long) allocations);
+        good = false;
+    }
+
+    free(batchPages);
+    free(batch);
+    free(single);
+    return good;
+}
+
+int main(int argc, char** argv)
+{
+    const char* key = "anotherkey";
+    const int pageSizes[] = { 512, 4096, 65536 };
+    bool good = true;
+
+    void* codec = initializeNewCodec(NULL);
+    if (!generateWriteKey(codec, key, strlen(key)))
+    {
+        // Crypto backend without the legacy suite
+        codecSetParameter(codec, "cipher", "auto");
+        codecCreateHeader(codec, 0);
+        generateWriteKey(codec, key, strlen(key));
+    }
+    setReadIsWrite(codec);
+
+    for (size_t i = 0; i < sizeof(pageSizes) / sizeof(pageSizes[0]); ++i)
+    {
+        fprintf(stderr, "Auditing page size %d\n", pageSizes[i]);
+        setPageSize(codec, pageSizes[i]);
+        good = roundTrip(codec, pageSizes[i], 1000) && good;
+        good = batchRoundTrip(codec, pageSizes[i], 37) && good;
+    }
+
+    deleteCodec(codec);
+
+    if (!good)
+    {
+        fprintf(stderr, "Page path allocated or corrupted data\n");
+        return 1;
+    }
+
+    fprintf(stderr, "All Seems Good \n");
+    return 0;
+}
@@ -6,6 +6,7 @@
  */
 
 #include <sqlite3.h>
+#include <sqlite3codec.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -27,8 +28,13 @@ namespace SQL
          INSERT INTO test2 (name, creationtime) VALUES ('widget2', '3rd time2');\
          INSERT INTO test2 (name, creationtime) VALUES ('widget2', '4th time2');\
          INSERT INTO test2 (name, creationtime) VALUES ('widget2', '5th time2');";
+    const char * INSERT_BULK_INTO_TEST = 
+        "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < 20000)\
+         INSERT INTO test (name, creationtime) SELECT 'bulk', i FROM n;";
     const char * SELECT_FROM_TEST = 
         "SELECT * FROM test;";
+    const char * COUNT_FROM_TEST = 
+        "SELECT count(*) FROM test;";
     const char * SELECT_FROM_TEST2 = 
         "SELECT * FROM test2;";
 };
@@ -43,6 +49,132 @@ static int callback(void *NotUsed, int argc, char **argv, char **azColName){
     return 0;
 }
 
+// Counts its calls, aborts the rekey once pArg calls were made
+static int abortingProgress(void *pArg, int nDone, int nTotal){
+    int* calls = (int*) pArg;
+    fprintf(stderr, "\tRekeyed %d of %d pages\n", nDone, nTotal);
+    return --*calls > 0 ? 0 : -1;
+}
+
+static bool copyFile(const char* from, const char* to){
+    FILE* in = fopen(from, "rb");
+    FILE* out = fopen(to, "wb");
+    char buffer[4096];
+    size_t length;
+    bool ok = NULL != in && NULL != out;
+    while (ok && 0 < (length = fread(buffer, 1, sizeof(buffer), in))){
+        ok = length == fwrite(buffer, 1, length, out);
+    }
+    if (NULL != in) fclose(in);
+    if (NULL != out) fclose(out);
+    return ok;
+}
+
+// Copies the database and its journal as a crash would leave them, once
+// every page was rekeyed, then aborts the rekey
+static int crashingProgress(void *pArg, int nDone, int nTotal){
+    if (nDone < nTotal) return 0;
+    bool* copied = (bool*) pArg;
+    *copied = copyFile("./testdb_crash", "./testdb_crashed") &&
+              copyFile("./testdb_crash-journal", "./testdb_crashed-journal");
+    return -1;
+}
+
+// VFS that counts page sized reads at the start of files, to see at which
+// size page 1 is read. Everything else goes to the default VFS.
+static sqlite3_vfs* countingBaseVfs;
+static sqlite3_vfs countingVfs;
+static int page1Reads = 0;
+static int page1ReadSize = 0;
+
+struct CountingFile {
+    sqlite3_file base;
+    sqlite3_file* real; // the default VFS file, right after this struct
+};
+
+static sqlite3_file* realFile(sqlite3_file* file){
+    return ((CountingFile*) file)->real;
+}
+
+static int countingClose(sqlite3_file* file){
+    int rc = realFile(file)->pMethods->xClose(realFile(file));
+    file->pMethods = NULL;
+    return rc;
+}
+
+static int countingRead(sqlite3_file* file, void* buffer, int amount, sqlite3_int64 offset){
+    if (0 == offset && amount >= 512) {
+        ++page1Reads;
+        page1ReadSize = amount;
+    }
+    return realFile(file)->pMethods->xRead(realFile(file), buffer, amount, offset);
+}
+
+static int countingWrite(sqlite3_file* file, const void* buffer, int amount, sqlite3_int64 offset){
+    return realFile(file)->pMethods->xWrite(realFile(file), buffer, amount, offset);
+}
+
+static int countingTruncate(sqlite3_file* file, sqlite3_int64 size){
+    return realFile(file)->pMethods->xTruncate(realFile(file), size);
+}
+
+static int countingSync(sqlite3_file* file, int flags){
+    return realFile(file)->pMethods->xSync(realFile(file), flags);
+}
+
+static int countingFileSize(sqlite3_file* file, sqlite3_int64* size){
+    return realFile(file)->pMethods->xFileSize(realFile(file), size);
+}
+
+static int countingLock(sqlite3_file* file, int lock){
+    return realFile(file)->pMethods->xLock(realFile(file), lock);
+}
+
+static int countingUnlock(sqlite3_file* file, int lock){
+    return realFile(file)->pMethods->xUnlock(realFile(file), lock);
+}
+
+static int countingCheckReservedLock(sqlite3_file* file, int* result){
+    return realFile(file)->pMethods->xCheckReservedLock(realFile(file), result);
+}
+
+static int countingFileControl(sqlite3_file* file, int op, void* arg){
+    return realFile(file)->pMethods->xFileControl(realFile(file), op, arg);
+}
+
+static int countingSectorSize(sqlite3_file* file){
+    return realFile(file)->pMethods->xSectorSize(realFile(file));
+}
+
+static int countingDeviceCharacteristics(sqlite3_file* file){
+    return realFile(file)->pMethods->xDeviceCharacteristics(realFile(file));
+}
+
+// Version 1: no shared memory or memory mapping, so no WAL databases
+static const sqlite3_io_methods countingMethods = {
+    1, countingClose, countingRead, countingWrite, countingTruncate,
+    countingSync, countingFileSize, countingLock, countingUnlock,
+    countingCheckReservedLock, countingFileControl, countingSectorSize,
+    countingDeviceCharacteristics
+};
+
+static int countingOpen(sqlite3_vfs* vfs, const char* name, sqlite3_file* file, int flags, int* outFlags){
+    CountingFile* counting = (CountingFile*) file;
+    counting->real = (sqlite3_file*) &counting[1];
+    int rc = countingBaseVfs->xOpen(countingBaseVfs, name, counting->real, flags, outFlags);
+    file->pMethods = NULL != counting->real->pMethods ? &countingMethods : NULL;
+    return rc;
+}
+
+static void registerCountingVfs(){
+    countingBaseVfs = sqlite3_vfs_find(NULL);
+    countingVfs = *countingBaseVfs;
+    countingVfs.zName = "counting";
+    countingVfs.szOsFile = (int) sizeof(CountingFile) + countingBaseVfs->szOsFile;
+    countingVfs.xOpen = countingOpen;
+    sqlite3_vfs_register(&countingVfs, 0);
+}
+
 int main(int argc, char** argv)
 {
     sqlite3 * db;
@@ -97,6 +229,747 @@ int main(int argc, char** argv)
     fprintf(stderr, "Closing Database \"%s\"\n", dbname);
     sqlite3_close(db);
 
+    const char* aesdbname = "./testdb_aes";
+
+    fprintf(stderr, "Creating Database \"%s\" with cipher \"aes-xts\"\n", aesdbname);
+    rc = sqlite3_open(aesdbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_codec_config(db, "main", "cipher", "aes-xts");
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't configure codec: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, key, keylen);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_exec(db, SQL::CREATE_TABLE_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    rc = sqlite3_exec(db, SQL::INSERT_INTO_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    sqlite3_close(db);
+
+    fprintf(stderr, "Opening Database \"%s\", cipher read from its header\n", aesdbname);
+    rc = sqlite3_open(aesdbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, key, keylen);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    fprintf(stderr, "Selecting all from test\n");
+    rc = sqlite3_exec(db, SQL::SELECT_FROM_TEST, callback, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    sqlite3_int64 hits = 0;
+    sqlite3_int64 misses = 0;
+    rc = sqlite3_codec_status(db, "main", SQLITE_CODECSTATUS_IV_CACHE_HIT, &hits, 0);
+    if (rc == SQLITE_OK) rc = sqlite3_codec_status(db, "main", SQLITE_CODECSTATUS_IV_CACHE_MISS, &misses, 1);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't read codec status: %s\n", sqlite3_errmsg(db)); return 1; }
+    fprintf(stderr, "IV cache: %lld hits, %lld misses\n", (long long) hits, (long long) misses);
+
+    fprintf(stderr, "Closing Database \"%s\"\n", aesdbname);
+    sqlite3_close(db);
+
+    const char* newkey = "rekeyedkey";
+
+    fprintf(stderr, "Rekeying Database \"%s\" with key \"%s\" on 4 threads\n", aesdbname, newkey);
+    rc = sqlite3_open(aesdbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, key, keylen);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_exec(db, SQL::INSERT_BULK_INTO_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    rc = sqlite3_codec_config(db, "main", "rekey_threads", "4");
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't configure codec: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    fprintf(stderr, "Cancelling a rekey of Database \"%s\" through its progress callback\n", aesdbname);
+    int progressCalls = 3;
+    rc = sqlite3_rekey_v3(db, "main", newkey, strlen(newkey), 64, abortingProgress, &progressCalls);
+    if (rc != SQLITE_INTERRUPT) { fprintf(stderr, "Rekey not cancelled: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_exec(db, SQL::COUNT_FROM_TEST, callback, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    rc = sqlite3_rekey(db, newkey, strlen(newkey));
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't rekey database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    sqlite3_close(db);
+
+    fprintf(stderr, "Opening Database \"%s\" with key \"%s\"\n", aesdbname, newkey);
+    rc = sqlite3_open(aesdbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, newkey, strlen(newkey));
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    fprintf(stderr, "Counting rows of test\n");
+    rc = sqlite3_exec(db, SQL::COUNT_FROM_TEST, callback, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    fprintf(stderr, "Closing Database \"%s\"\n", aesdbname);
+    sqlite3_close(db);
+
+    const char* copykey = "copiedkey";
+
+    sqlite3* staledb;
+    rc = sqlite3_open(aesdbname, &staledb);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(staledb)); return 1; }
+
+    rc = sqlite3_key(staledb, newkey, strlen(newkey));
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(staledb)); return 1; }
+
+    rc = sqlite3_exec(staledb, SQL::COUNT_FROM_TEST, callback, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    fprintf(stderr, "Rekeying Database \"%s\" to key \"%s\" by copy\n", aesdbname, copykey);
+    rc = sqlite3_rekey_copy("file:./testdb_aes?rekey_threads=4", newkey, strlen(newkey), copykey, strlen(copykey), &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't rekey by copy: %s\n", error); return 1; }
+
+    fprintf(stderr, "Writing through a connection opened before the copy\n");
+    rc = sqlite3_exec(staledb, SQL::INSERT_INTO_TEST, 0, 0, &error);
+    if (rc != SQLITE_NOTADB) { fprintf(stderr, "Stale connection not stopped: %d\n", rc); return 1; }
+    sqlite3_close(staledb);
+
+    rc = sqlite3_open(aesdbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, copykey, strlen(copykey));
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    fprintf(stderr, "Counting rows of test\n");
+    rc = sqlite3_exec(db, SQL::COUNT_FROM_TEST, callback, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    fprintf(stderr, "Closing Database \"%s\"\n", aesdbname);
+    sqlite3_close(db);
+
+    const char* tweakdbname = "file:./testdb_tweak?format=2";
+
+    fprintf(stderr, "Creating Database \"%s\" with the page number as tweak\n", tweakdbname);
+    rc = sqlite3_open_v2(tweakdbname, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, NULL);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, key, keylen);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_exec(db, SQL::CREATE_TABLE_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    rc = sqlite3_exec(db, SQL::INSERT_INTO_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    sqlite3_close(db);
+
+    fprintf(stderr, "Opening Database \"./testdb_tweak\", format read from its header\n");
+    rc = sqlite3_open("./testdb_tweak", &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, key, keylen);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    fprintf(stderr, "Selecting all from test\n");
+    rc = sqlite3_exec(db, SQL::SELECT_FROM_TEST, callback, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    fprintf(stderr, "Closing Database \"./testdb_tweak\"\n");
+    sqlite3_close(db);
+
+    const char* calibrateddbname = "file:./testdb_calibrated?kdf_time=20";
+
+    fprintf(stderr, "Creating Database \"%s\" with KDF iterations calibrated to 20 ms\n", calibrateddbname);
+    rc = sqlite3_open_v2(calibrateddbname, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, NULL);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, key, keylen);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_exec(db, SQL::CREATE_TABLE_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    rc = sqlite3_exec(db, SQL::INSERT_INTO_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    sqlite3_close(db);
+
+    fprintf(stderr, "Opening Database \"./testdb_calibrated\", iterations read from its header\n");
+    rc = sqlite3_open("./testdb_calibrated", &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, key, keylen);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    fprintf(stderr, "Selecting all from test\n");
+    rc = sqlite3_exec(db, SQL::SELECT_FROM_TEST, callback, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    sqlite3_close(db);
+
+    const char* argon2dbname = "./testdb_argon2";
+
+    fprintf(stderr, "Creating Database \"%s\" with Argon2id, if the crypto backend has it\n", argon2dbname);
+    rc = sqlite3_open(argon2dbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    if (SQLITE_OK == sqlite3_codec_config(db, "main", "kdf", "argon2id"))
+    {
+        rc = sqlite3_codec_config(db, "main", "kdf_memory", "8192");
+        if (rc != SQLITE_OK) { fprintf(stderr, "Can't set KDF memory: %s\n", sqlite3_errmsg(db)); return 1; }
+
+        rc = sqlite3_codec_config(db, "main", "kdf_lanes", "2");
+        if (rc != SQLITE_OK) { fprintf(stderr, "Can't set KDF lanes: %s\n", sqlite3_errmsg(db)); return 1; }
+
+        rc = sqlite3_key(db, key, keylen);
+        if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+        rc = sqlite3_exec(db, SQL::CREATE_TABLE_TEST, 0, 0, &error);
+        if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+        rc = sqlite3_exec(db, SQL::INSERT_INTO_TEST, 0, 0, &error);
+        if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+        sqlite3_close(db);
+
+        fprintf(stderr, "Opening Database \"%s\", Argon2id parameters read from its header\n", argon2dbname);
+        rc = sqlite3_open(argon2dbname, &db);
+        if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+        rc = sqlite3_key(db, key, keylen);
+        if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+        fprintf(stderr, "Selecting all from test\n");
+        rc = sqlite3_exec(db, SQL::SELECT_FROM_TEST, callback, 0, &error);
+        if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+    }
+    else
+    {
+        // Needs Botan 2.11 or OpenSSL 3.2, test_kdf checks its output
+        fprintf(stderr, "Skipping Argon2id: not in this crypto backend\n");
+    }
+
+    sqlite3_close(db);
+
+    const char* onlinedbname = "./testdb_online";
+    const char* onlinekey = "onlinekey";
+
+    fprintf(stderr, "Creating Database \"%s\"\n", onlinedbname);
+    rc = sqlite3_open(onlinedbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, key, keylen);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_exec(db, SQL::CREATE_TABLE_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    rc = sqlite3_exec(db, SQL::INSERT_BULK_INTO_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    fprintf(stderr, "Rekeying Database \"%s\" to key \"%s\" in steps\n", onlinedbname, onlinekey);
+    rc = sqlite3_rekey_begin(db, "main", onlinekey, strlen(onlinekey));
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't begin rekey: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    // A few steps, with writes in between
+    for (int i = 0; i < 4; ++i)
+    {
+        rc = sqlite3_rekey_step(db, "main", 16);
+        if (rc != SQLITE_OK) { fprintf(stderr, "Can't rekey step: %s\n", sqlite3_errmsg(db)); return 1; }
+
+        rc = sqlite3_exec(db, SQL::INSERT_INTO_TEST, 0, 0, &error);
+        if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+    }
+
+    rc = sqlite3_rekey(db, onlinekey, strlen(onlinekey));
+    if (rc == SQLITE_OK) { fprintf(stderr, "Rekey allowed during an incremental rekey\n"); return 1; }
+
+    sqlite3_close(db);
+
+    fprintf(stderr, "Resuming rekey of Database \"%s\"\n", onlinedbname);
+    rc = sqlite3_open(onlinedbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, key, keylen);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_rekey_begin(db, "main", onlinekey, strlen(onlinekey));
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't begin rekey: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    sqlite3_int64 watermark = 0;
+    rc = sqlite3_codec_status(db, "main", SQLITE_CODECSTATUS_REKEY_WATERMARK, &watermark, 0);
+    if (rc != SQLITE_OK || watermark <= 1) { fprintf(stderr, "Rekey did not resume\n"); return 1; }
+
+    fprintf(stderr, "Counting rows of test\n");
+    rc = sqlite3_exec(db, SQL::COUNT_FROM_TEST, callback, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    while (SQLITE_OK == (rc = sqlite3_rekey_step(db, "main", 16)))
+    {
+        rc = sqlite3_exec(db, SQL::INSERT_INTO_TEST, 0, 0, &error);
+        if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+    }
+    if (rc != SQLITE_DONE) { fprintf(stderr, "Can't rekey step: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    sqlite3_close(db);
+
+    fprintf(stderr, "Opening Database \"%s\" with key \"%s\"\n", onlinedbname, onlinekey);
+    rc = sqlite3_open(onlinedbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, onlinekey, strlen(onlinekey));
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    fprintf(stderr, "Counting rows of test\n");
+    rc = sqlite3_exec(db, SQL::COUNT_FROM_TEST, callback, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    fprintf(stderr, "Closing Database \"%s\"\n", onlinedbname);
+    sqlite3_close(db);
+
+    fprintf(stderr, "Opening Database \"%s\" with the key it was rotated from\n", onlinedbname);
+    rc = sqlite3_open(onlinedbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, key, keylen);
+    if (rc != SQLITE_NOTADB_WRONGKEY) { fprintf(stderr, "Old key not told apart after the rotation: %d\n", rc); return 1; }
+
+    sqlite3_close(db);
+
+    const char* crashdbname = "./testdb_crash";
+
+    fprintf(stderr, "Crashing during a rekey of Database \"%s\"\n", crashdbname);
+    rc = sqlite3_open(crashdbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, key, keylen);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_exec(db, SQL::CREATE_TABLE_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    rc = sqlite3_exec(db, SQL::INSERT_BULK_INTO_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    // A small cache spills rekeyed pages, page 1 first, before the commit
+    rc = sqlite3_exec(db, "PRAGMA cache_size = 8", 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    bool copied = false;
+    rc = sqlite3_rekey_v3(db, "main", newkey, strlen(newkey), 1000000, crashingProgress, &copied);
+    if (rc != SQLITE_INTERRUPT || !copied) { fprintf(stderr, "Can't copy the database during its rekey\n"); return 1; }
+
+    sqlite3_close(db);
+
+    fprintf(stderr, "Opening the crashed copy with the key it had before the rekey\n");
+    rc = sqlite3_open("./testdb_crashed", &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, key, keylen);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Old key refused before the hot journal was rolled back: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    fprintf(stderr, "Counting rows of test\n");
+    rc = sqlite3_exec(db, SQL::COUNT_FROM_TEST, callback, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    sqlite3_close(db);
+
+    const char* resumedbname = "./testdb_resume";
+
+    fprintf(stderr, "Creating Database \"%s\"\n", resumedbname);
+    rc = sqlite3_open(resumedbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, key, keylen);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_exec(db, SQL::CREATE_TABLE_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    rc = sqlite3_exec(db, SQL::INSERT_BULK_INTO_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    fprintf(stderr, "Closing Database \"%s\" after a single rekey step\n", resumedbname);
+    rc = sqlite3_rekey_begin(db, "main", onlinekey, strlen(onlinekey));
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't begin rekey: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_rekey_step(db, "main", 4);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't rekey step: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    sqlite3_close(db);
+
+    fprintf(stderr, "Resuming rekey of Database \"%s\" on a new connection\n", resumedbname);
+    rc = sqlite3_open(resumedbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, key, keylen);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    // Page 1 already uses the new key, nothing may be read before this
+    rc = sqlite3_rekey_begin(db, "main", onlinekey, strlen(onlinekey));
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't resume rekey: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_codec_status(db, "main", SQLITE_CODECSTATUS_REKEY_WATERMARK, &watermark, 0);
+    if (rc != SQLITE_OK || watermark != 5) { fprintf(stderr, "Rekey did not resume at page 5\n"); return 1; }
+
+    fprintf(stderr, "Counting rows of test\n");
+    rc = sqlite3_exec(db, SQL::COUNT_FROM_TEST, callback, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    rc = sqlite3_rekey_step(db, "main", -1);
+    if (rc != SQLITE_DONE) { fprintf(stderr, "Can't rekey step: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    sqlite3_close(db);
+
+    fprintf(stderr, "Attaching Database \"./testdb_tenant\" with its own key to \"%s\"\n", dbname);
+    rc = sqlite3_open(dbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key_v2(db, "main", key, keylen);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_exec(db, "ATTACH DATABASE './testdb_tenant' AS tenant KEY 'tenantkey';", 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    rc = sqlite3_exec(db, "CREATE TABLE tenant.test (id INTEGER PRIMARY KEY, name TEXT, creationtime TEXT);", 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    rc = sqlite3_exec(db, "INSERT INTO tenant.test (name, creationtime) VALUES ('tenant', '1st time');", 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    fprintf(stderr, "Rekeying attached Database \"tenant\" only\n");
+    rc = sqlite3_rekey_v2(db, "tenant", "tenantkey2", 10);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't rekey database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_exec(db, "DETACH DATABASE tenant;", 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    rc = sqlite3_exec(db, "ATTACH DATABASE './testdb_tenant' AS tenant KEY 'tenantkey2';", 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    fprintf(stderr, "Selecting all from tenant.test and main.test2\n");
+    rc = sqlite3_exec(db, "SELECT * FROM tenant.test;", callback, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    rc = sqlite3_exec(db, SQL::SELECT_FROM_TEST2, callback, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    fprintf(stderr, "Closing Database \"%s\"\n", dbname);
+    sqlite3_close(db);
+
+    fprintf(stderr, "Keying Database \"%s\" with a key handle\n", dbname);
+    sqlite3_codec_kdf_cache(4);
+    rc = sqlite3_open(dbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, key, keylen);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    sqlite3_key_handle* handle = NULL;
+    rc = sqlite3_key_handle_create(db, "main", &handle);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't create key handle: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    sqlite3* handledb;
+    rc = sqlite3_open(dbname, &handledb);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(handledb)); return 1; }
+
+    rc = sqlite3_key_handle_apply(handledb, "main", handle);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database with handle: %s\n", sqlite3_errmsg(handledb)); return 1; }
+
+    fprintf(stderr, "Selecting all from test2\n");
+    rc = sqlite3_exec(handledb, SQL::SELECT_FROM_TEST2, callback, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+    sqlite3_close(handledb);
+
+    rc = sqlite3_open(aesdbname, &handledb);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(handledb)); return 1; }
+
+    rc = sqlite3_key_handle_apply(handledb, "main", handle);
+    if (rc == SQLITE_OK) { fprintf(stderr, "Key handle applied to another database\n"); return 1; }
+    sqlite3_close(handledb);
+
+    sqlite3_key_handle_free(handle);
+    sqlite3_codec_kdf_cache(0);
+    sqlite3_close(db);
+
+    const char* lazydbname = "./testdb_lazy";
+    const char* lazykey = "lazykey";
+
+    fprintf(stderr, "Creating Database \"%s\"\n", lazydbname);
+    rc = sqlite3_open(lazydbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, key, keylen);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_exec(db, SQL::CREATE_TABLE_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    rc = sqlite3_exec(db, SQL::INSERT_BULK_INTO_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    fprintf(stderr, "Rotating Database \"%s\" to key \"%s\" lazily\n", lazydbname, lazykey);
+    rc = sqlite3_rekey_lazy(db, "main", lazykey, strlen(lazykey));
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't rotate key: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    // Some pages move to the new key through regular writes
+    rc = sqlite3_exec(db, SQL::INSERT_INTO_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    rc = sqlite3_rekey_sweep(db, "main", 16);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't sweep: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    sqlite3_close(db);
+
+    fprintf(stderr, "Opening Database \"%s\" with key \"%s\" and the older key\n", lazydbname, lazykey);
+    rc = sqlite3_open(lazydbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, lazykey, strlen(lazykey));
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_keyring_add(db, "main", key, keylen);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't add key to keyring: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    fprintf(stderr, "Counting rows of test\n");
+    rc = sqlite3_exec(db, SQL::COUNT_FROM_TEST, callback, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    while (SQLITE_OK == (rc = sqlite3_rekey_sweep(db, "main", 64)))
+    {
+    }
+    if (rc != SQLITE_DONE) { fprintf(stderr, "Can't sweep: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    sqlite3_close(db);
+
+    fprintf(stderr, "Opening Database \"%s\" with key \"%s\" only\n", lazydbname, lazykey);
+    rc = sqlite3_open(lazydbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, lazykey, strlen(lazykey));
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    fprintf(stderr, "Counting rows of test\n");
+    rc = sqlite3_exec(db, SQL::COUNT_FROM_TEST, callback, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    fprintf(stderr, "Closing Database \"%s\"\n", lazydbname);
+    sqlite3_close(db);
+
+    const char* envelopedbname = "file:./testdb_envelope?key_slots=2";
+    const char* secondkey = "secondkey";
+
+    fprintf(stderr, "Creating Database \"%s\" with key slots\n", envelopedbname);
+    rc = sqlite3_open_v2(envelopedbname, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, NULL);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, key, keylen);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_exec(db, SQL::CREATE_TABLE_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    rc = sqlite3_exec(db, SQL::INSERT_INTO_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    fprintf(stderr, "Adding key \"%s\", changing key \"%s\" to \"%s\"\n", secondkey, key, newkey);
+    rc = sqlite3_key_slot_add(db, "main", secondkey, strlen(secondkey));
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't add key slot: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key_slot_add(db, "main", secondkey, strlen(secondkey));
+    if (rc == SQLITE_OK) { fprintf(stderr, "Key slot added past the last one\n"); return 1; }
+
+    rc = sqlite3_rekey(db, newkey, strlen(newkey));
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't rekey database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    sqlite3_close(db);
+
+    const char* envelopekeys[] = { secondkey, newkey };
+    for (int i = 0; i < 2; ++i)
+    {
+        fprintf(stderr, "Opening Database \"./testdb_envelope\" with key \"%s\"\n", envelopekeys[i]);
+        rc = sqlite3_open("./testdb_envelope", &db);
+        if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+        rc = sqlite3_key(db, envelopekeys[i], strlen(envelopekeys[i]));
+        if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+        fprintf(stderr, "Selecting all from test\n");
+        rc = sqlite3_exec(db, SQL::SELECT_FROM_TEST, callback, 0, &error);
+        if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+        sqlite3_close(db);
+    }
+
+    fprintf(stderr, "Opening Database \"./testdb_envelope\" with the changed key \"%s\"\n", key);
+    rc = sqlite3_open("./testdb_envelope", &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, key, keylen);
+    if (rc != SQLITE_NOTADB_WRONGKEY) { fprintf(stderr, "Changed key still opens the database\n"); return 1; }
+
+    sqlite3_close(db);
+
+    // An odd number of key slots leaves the encrypted part of page 1 a half
+    // cipher block long
+    const char* oddslotdbnames[] = { "file:./testdb_slots1?key_slots=1",
+                                     "file:./testdb_slots3?key_slots=3" };
+    for (int i = 0; i < 2; ++i)
+    {
+        for (int reopen = 0; reopen < 2; ++reopen)
+        {
+            fprintf(stderr, "%s Database \"%s\"\n", reopen ? "Opening" : "Creating", oddslotdbnames[i]);
+            rc = sqlite3_open_v2(oddslotdbnames[i], &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, NULL);
+            if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+            rc = sqlite3_key(db, key, keylen);
+            if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+            rc = sqlite3_exec(db, reopen ? SQL::SELECT_FROM_TEST : SQL::CREATE_TABLE_TEST, callback, 0, &error);
+            if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+            rc = sqlite3_exec(db, SQL::INSERT_INTO_TEST, 0, 0, &error);
+            if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+            sqlite3_close(db);
+        }
+    }
+
+    fprintf(stderr, "Keying Databases \"%s\" and \"%s\" asynchronously\n", dbname, aesdbname);
+    sqlite3* asyncdb;
+    rc = sqlite3_open(dbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_open(aesdbname, &asyncdb);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(asyncdb)); return 1; }
+
+    rc = sqlite3_key_async(db, "main", key, keylen);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key_async(asyncdb, "main", copykey, strlen(copykey));
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(asyncdb)); return 1; }
+
+    fprintf(stderr, "Selecting all from test2\n");
+    rc = sqlite3_exec(db, SQL::SELECT_FROM_TEST2, callback, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    fprintf(stderr, "Counting rows of test\n");
+    rc = sqlite3_exec(asyncdb, SQL::COUNT_FROM_TEST, callback, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    sqlite3_close(asyncdb);
+    sqlite3_close(db);
+
+    const char* rawdbname = "./testdb_raw";
+    const unsigned char rawkey[16] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+                                       0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+
+    fprintf(stderr, "Creating Database \"%s\" with a raw key\n", rawdbname);
+    rc = sqlite3_open(rawdbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key_raw(db, "main", rawkey, 8);
+    if (rc == SQLITE_OK) { fprintf(stderr, "Short raw key accepted\n"); return 1; }
+
+    rc = sqlite3_key_raw(db, "main", rawkey, sizeof(rawkey));
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_exec(db, SQL::CREATE_TABLE_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    rc = sqlite3_exec(db, SQL::INSERT_INTO_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    sqlite3_close(db);
+
+    const char* rawliteral = "x'2b7e151628aed2a6abf7158809cf4f3c'";
+
+    fprintf(stderr, "Opening Database \"%s\" with the blob literal as a password\n", rawdbname);
+    rc = sqlite3_open(rawdbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, rawliteral, strlen(rawliteral));
+    if (rc != SQLITE_NOTADB_WRONGKEY) { fprintf(stderr, "Blob literal taken as a raw key without raw_key\n"); return 1; }
+
+    sqlite3_close(db);
+
+    fprintf(stderr, "Opening Database \"%s\" with the raw key as a blob literal\n", rawdbname);
+    rc = sqlite3_open_v2("file:./testdb_raw?raw_key=1", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_URI, NULL);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_exec(db, "PRAGMA key = \"x'2b7e151628aed2a6abf7158809cf4f3c'\"", 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    fprintf(stderr, "Selecting all from test\n");
+    rc = sqlite3_exec(db, SQL::SELECT_FROM_TEST, callback, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    sqlite3_close(db);
+
+    const char* rawrekeydbname = "./testdb_rawrekey";
+    const char* literalpassword = "x'000102030405060708090a0b0c0d0e0f'";
+
+    fprintf(stderr, "Rekeying Database \"%s\" from a raw key to a blob literal password\n", rawrekeydbname);
+    rc = sqlite3_open(rawrekeydbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key_raw(db, "main", rawkey, sizeof(rawkey));
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_exec(db, SQL::CREATE_TABLE_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    rc = sqlite3_rekey(db, literalpassword, strlen(literalpassword));
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't rekey database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    sqlite3_close(db);
+
+    rc = sqlite3_open(rawrekeydbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, literalpassword, strlen(literalpassword));
+    if (rc != SQLITE_OK) { fprintf(stderr, "Blob literal given to sqlite3_rekey taken as a raw key: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    sqlite3_close(db);
+
+    const char* pagesizedbname = "./testdb_pagesize";
+
+    fprintf(stderr, "Creating Database \"%s\" with 8192 byte pages\n", pagesizedbname);
+    rc = sqlite3_open(pagesizedbname, &db);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, key, keylen);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_exec(db, "PRAGMA page_size = 8192", 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    rc = sqlite3_exec(db, SQL::CREATE_TABLE_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    rc = sqlite3_exec(db, SQL::INSERT_INTO_TEST, 0, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    sqlite3_close(db);
+
+    fprintf(stderr, "Opening Database \"%s\" at the page size of its codec header\n", pagesizedbname);
+    registerCountingVfs();
+    rc = sqlite3_open_v2(pagesizedbname, &db, SQLITE_OPEN_READWRITE, "counting");
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't open/create database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    rc = sqlite3_key(db, key, keylen);
+    if (rc != SQLITE_OK) { fprintf(stderr, "Can't key database: %s\n", sqlite3_errmsg(db)); return 1; }
+
+    fprintf(stderr, "Selecting all from test\n");
+    rc = sqlite3_exec(db, SQL::SELECT_FROM_TEST, callback, 0, &error);
+    if (rc != SQLITE_OK) { fprintf(stderr, "SQL error: %s\n", error); return 1; }
+
+    // Read once at its real size, not at the default size and again
+    fprintf(stderr, "\tPage 1 read %d times, last with %d bytes\n", page1Reads, page1ReadSize);
+    if (page1Reads != 1 || page1ReadSize != 8192) { fprintf(stderr, "Page 1 not read at the page size of the header\n"); return 1; }
+
+    sqlite3_close(db);
+
     fprintf(stderr, "All Seems Good \n");
     return 0;
 }